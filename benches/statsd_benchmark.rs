@@ -8,6 +8,48 @@ fn parse(
     statsrelay::statsd_proto::Pdu::parse(line.clone())
 }
 
+/// Split on newlines and parse each line separately, as the servers did
+/// before the structural scanner
+fn parse_each_line(buf: &Bytes) -> usize {
+    let mut count = 0;
+    let mut start = 0;
+    for newline in memchr::memchr_iter(b'\n', buf) {
+        if parse(&buf.slice(start..newline)).is_ok() {
+            count += 1;
+        }
+        start = newline + 1;
+    }
+    count
+}
+
+fn parse_lines(buf: &Bytes) -> usize {
+    let mut count = 0;
+    statsrelay::statsd_proto::Pdu::parse_lines(buf, |_, pdu| {
+        if pdu.is_ok() {
+            count += 1;
+        }
+    });
+    count
+}
+
+/// Parse the newline terminated lines of a datagram and then its remnant
+/// separately, as the UDP server did before it parsed whole datagrams
+fn parse_datagram_two_pass(datagram: &[u8]) -> usize {
+    let mut buf = bytes::BytesMut::from(datagram);
+    let mut count = 0;
+    if let Some(newline) = memchr::memrchr(b'\n', &buf) {
+        count += parse_lines(&buf.split_to(newline + 1).freeze());
+    }
+    if !buf.is_empty() && parse(&buf.split().freeze()).is_ok() {
+        count += 1;
+    }
+    count
+}
+
+fn parse_datagram(datagram: &[u8]) -> usize {
+    parse_lines(&Bytes::copy_from_slice(datagram))
+}
+
 fn criterion_benchmark(c: &mut Criterion) {
     let by = Bytes::from_static(
         b"hello_world.worldworld_i_am_a_pumpkin:3|c|@1.0|#tags:tags,tags:tags,tags:tags,tags:tags",
@@ -19,6 +61,89 @@ fn criterion_benchmark(c: &mut Criterion) {
                 parse(black_box(&by)).unwrap().try_into().unwrap();
         })
     });
+
+    let counter: statsrelay::statsd_proto::Owned = parse(&by).unwrap().try_into().unwrap();
+    c.bench_function("statsd owned serialize", |b| {
+        b.iter(|| {
+            let _: statsrelay::statsd_proto::Pdu = black_box(&counter).try_into().unwrap();
+        })
+    });
+    let timer: statsrelay::statsd_proto::Owned = parse(&Bytes::from_static(
+        b"hello_world.request_time:12.3456|ms|@0.25|#a:b",
+    ))
+    .unwrap()
+    .try_into()
+    .unwrap();
+    c.bench_function("statsd owned serialize fractional", |b| {
+        b.iter(|| {
+            let _: statsrelay::statsd_proto::Pdu = black_box(&timer).try_into().unwrap();
+        })
+    });
+
+    let mut long_tags = b"hello_world.worldworld_i_am_a_pumpkin:3|c|@1.0|#".to_vec();
+    for i in 0..32 {
+        long_tags.extend_from_slice(format!("tag_name_{}:tag_value_{},", i, i).as_bytes());
+    }
+    long_tags.pop();
+    let long_tags = Bytes::from(long_tags);
+    c.bench_function("statsd pdu parsing long tags", |b| {
+        b.iter(|| parse(black_box(&long_tags)))
+    });
+    c.bench_function("statsd pdu scanning long tags", |b| {
+        b.iter(|| parse_lines(black_box(&long_tags)))
+    });
+
+    let mut multi = Vec::new();
+    for i in 0..64 {
+        multi.extend_from_slice(
+            format!("hello_world.pumpkin_{}:{}|c|@0.5|#a:b,c:d\n", i, i).as_bytes(),
+        );
+    }
+    let multi = Bytes::from(multi);
+    c.bench_function("statsd pdu parsing multi-line", |b| {
+        b.iter(|| parse_each_line(black_box(&multi)))
+    });
+    c.bench_function("statsd pdu scanning multi-line", |b| {
+        b.iter(|| parse_lines(black_box(&multi)))
+    });
+
+    // Datagrams as clients send them, the last line without a newline
+    let datagram = &multi[..multi.len() - 1];
+    c.bench_function("statsd datagram framing two-pass", |b| {
+        b.iter(|| parse_datagram_two_pass(black_box(datagram)))
+    });
+    c.bench_function("statsd datagram framing", |b| {
+        b.iter(|| parse_datagram(black_box(datagram)))
+    });
+    assert_eq!(parse_datagram_two_pass(datagram), 64);
+    assert_eq!(parse_datagram(datagram), 64);
+
+    let mut pdus = Vec::new();
+    statsrelay::statsd_proto::Pdu::parse_lines(&multi, |_, pdu| pdus.push(pdu.unwrap()));
+    c.bench_function("statsd binary encoding multi-line", |b| {
+        let mut encoder = statsrelay::statsd_proto::binary::Encoder::new(b"", b"");
+        b.iter(|| {
+            let mut frame = bytes::BytesMut::new();
+            encoder.encode_frame(black_box(&pdus), &mut frame);
+            frame
+        })
+    });
+    let mut frame = bytes::BytesMut::new();
+    statsrelay::statsd_proto::binary::Encoder::new(b"", b"").encode_frame(&pdus, &mut frame);
+    c.bench_function("statsd binary decoding multi-line", |b| {
+        b.iter(|| {
+            let mut count = 0;
+            let mut buf = black_box(&frame).clone();
+            statsrelay::statsd_proto::binary::Decoder::new()
+                .decode(&mut buf, |pdu| {
+                    if pdu.is_ok() {
+                        count += 1;
+                    }
+                })
+                .unwrap();
+            count
+        })
+    });
 }
 
 criterion_group!(benches, criterion_benchmark);
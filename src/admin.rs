@@ -1,4 +1,4 @@
-use log::info;
+use log::{error, info};
 
 use hyper::service::{make_service_fn, service_fn};
 use hyper::{Body, Method, Request, Response, Server};
@@ -6,12 +6,19 @@ use tokio::runtime;
 
 use std::boxed::Box;
 use std::convert::Infallible;
+use std::net::SocketAddr;
+use std::sync::Arc;
 
+use crate::ratelimit;
 use crate::stats::Collector;
 
+/// Peers listed per server by the top talkers endpoint
+const TOP_TALKERS: usize = 20;
+
 #[derive(Clone)]
 struct AdminState {
     collector: Collector,
+    limiters: ratelimit::Registry,
 }
 
 async fn metric_response(
@@ -25,6 +32,32 @@ async fn metric_response(
         .unwrap())
 }
 
+/// The peers sending the most lines to each rate limited server, as JSON
+fn top_talkers_response(state: AdminState) -> Result<Response<Body>, Infallible> {
+    let servers: serde_json::Map<String, serde_json::Value> = state
+        .limiters
+        .top_talkers(TOP_TALKERS)
+        .into_iter()
+        .map(|(server, talkers)| {
+            let talkers = talkers
+                .iter()
+                .map(|talker| {
+                    serde_json::json!({
+                        "peer": talker.peer.to_string(),
+                        "admitted": talker.admitted,
+                        "dropped": talker.dropped,
+                    })
+                })
+                .collect();
+            (server, serde_json::Value::Array(talkers))
+        })
+        .collect();
+    Ok(Response::builder()
+        .header(hyper::header::CONTENT_TYPE, "application/json")
+        .body(Body::from(serde_json::Value::Object(servers).to_string()))
+        .unwrap())
+}
+
 async fn request_handler(
     state: AdminState,
     req: Request<Body>,
@@ -35,6 +68,7 @@ async fn request_handler(
             .unwrap()),
         (&Method::GET, "/healthcheck") => Ok(Response::builder().body(Body::from("OK")).unwrap()),
         (&Method::GET, "/metrics") => metric_response(state, req).await,
+        (&Method::GET, "/top_talkers") => top_talkers_response(state),
         _ => Ok(Response::builder()
             .status(404)
             .body(Body::from("not found"))
@@ -42,9 +76,16 @@ async fn request_handler(
     }
 }
 
-async fn hyper_server(port: u16, collector: Collector) -> Result<(), Box<dyn std::error::Error>> {
-    let addr = format!("[::]:{}", port).parse().unwrap();
-    let admin_state = AdminState { collector };
+async fn hyper_server(
+    listener: std::net::TcpListener,
+    collector: Collector,
+    limiters: ratelimit::Registry,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let addr = listener.local_addr()?;
+    let admin_state = AdminState {
+        collector,
+        limiters,
+    };
     let make_svc = make_service_fn(move |_conn| {
         let service_capture = admin_state.clone();
         async {
@@ -53,15 +94,75 @@ async fn hyper_server(port: u16, collector: Collector) -> Result<(), Box<dyn std
             }))
         }
     });
-    info!("admin server starting on port {}", port);
-    Server::bind(&addr).serve(make_svc).await?;
+    info!("admin server starting on {}", addr);
+    Server::from_tcp(listener)?.serve(make_svc).await?;
     Ok(())
 }
 
-pub fn spawn_admin_server(port: u16, collector: Collector) {
+/// Serve the admin endpoints on an already bound listener, from a dedicated
+/// thread
+pub fn spawn_admin_server(
+    listener: std::net::TcpListener,
+    collector: Collector,
+    limiters: ratelimit::Registry,
+) -> anyhow::Result<()> {
+    listener.set_nonblocking(true)?;
     let rt = runtime::Builder::new_current_thread()
         .enable_all()
-        .build()
-        .unwrap();
-    std::thread::spawn(move || rt.block_on(hyper_server(port, collector)).unwrap());
+        .build()?;
+    std::thread::spawn(move || {
+        if let Err(e) = rt.block_on(hyper_server(listener, collector, limiters)) {
+            error!("admin server failed: {}", e);
+        }
+    });
+    Ok(())
+}
+
+async fn render_server<F>(listener: std::net::TcpListener, render: Arc<F>) -> anyhow::Result<()>
+where
+    F: Fn() -> Vec<u8> + Send + Sync + 'static,
+{
+    let make_svc = make_service_fn(move |_conn| {
+        let render = render.clone();
+        async move {
+            Ok::<_, Infallible>(service_fn(move |req: Request<Body>| {
+                let response = match (req.method(), req.uri().path()) {
+                    (&Method::GET, "/metrics") => Response::builder()
+                        .header(hyper::header::CONTENT_TYPE, prometheus::TEXT_FORMAT)
+                        .body(Body::from(render())),
+                    _ => Response::builder()
+                        .status(404)
+                        .body(Body::from("not found")),
+                };
+                async move { Ok::<_, Infallible>(response.unwrap()) }
+            }))
+        }
+    });
+    Server::from_tcp(listener)?.serve(make_svc).await?;
+    Ok(())
+}
+
+/// Serve the output of `render` on `/metrics` from a dedicated thread. The
+/// caller binds the listener, so that bind errors surface to it instead of
+/// the server thread.
+pub fn spawn_metrics_server<F>(
+    listener: std::net::TcpListener,
+    render: F,
+) -> anyhow::Result<SocketAddr>
+where
+    F: Fn() -> Vec<u8> + Send + Sync + 'static,
+{
+    listener.set_nonblocking(true)?;
+    let addr = listener.local_addr()?;
+    let rt = runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()?;
+    let render = Arc::new(render);
+    std::thread::spawn(move || {
+        if let Err(e) = rt.block_on(render_server(listener, render)) {
+            error!("metrics server on {} failed: {}", addr, e);
+        }
+    });
+    info!("metrics server listening on {}", addr);
+    Ok(addr)
 }
@@ -1,13 +1,16 @@
 use std::collections::{HashMap, HashSet};
 use std::sync::Arc;
+use std::time::Duration;
 
 use parking_lot::RwLock;
 use stream_cancel::Tripwire;
 use thiserror::Error;
+use tokio::time::Instant;
 
 use crate::discovery;
 use crate::stats;
 use crate::statsd_backend::StatsdBackend;
+use crate::statsd_client;
 use crate::statsd_proto::Event;
 use crate::{config, processors};
 
@@ -19,7 +22,7 @@ pub enum BackendError {
 
 struct BackendsInner {
     statsd: HashMap<String, StatsdBackend>,
-    processors: HashMap<String, Box<dyn processors::Processor + Send + Sync>>,
+    processors: HashMap<String, Arc<dyn processors::Processor + Send + Sync>>,
     stats: stats::Scope,
 }
 
@@ -35,7 +38,7 @@ impl BackendsInner {
     fn replace_processor(
         &mut self,
         name: &str,
-        processor: Box<dyn processors::Processor + Send + Sync>,
+        processor: Arc<dyn processors::Processor + Send + Sync>,
     ) -> anyhow::Result<()> {
         self.processors.insert(name.to_owned(), processor);
         Ok(())
@@ -62,6 +65,13 @@ impl BackendsInner {
         Ok(())
     }
 
+    fn queue_fill(&self) -> f64 {
+        self.statsd
+            .values()
+            .map(|backend| backend.queue_fill())
+            .fold(0.0, f64::max)
+    }
+
     fn backend_names(&self) -> HashSet<&String> {
         self.statsd.keys().collect()
     }
@@ -102,6 +112,12 @@ impl BackendsInner {
             proc.tick(now, backends);
         }
     }
+
+    fn processor_flush(&self, backends: &Backends) {
+        for (_, proc) in self.processors.iter() {
+            proc.flush(backends);
+        }
+    }
 }
 
 ///
@@ -125,7 +141,48 @@ impl Backends {
         name: &str,
         processor: Box<dyn processors::Processor + Send + Sync>,
     ) -> anyhow::Result<()> {
-        self.inner.write().replace_processor(name, processor)
+        self.inner.write().replace_processor(name, processor.into())
+    }
+
+    /// Route through the same processor instances as another set of
+    /// backends, so that several sets, such as one per core, feed a single
+    /// copy of processor state. Only one of the sets should drive
+    /// [`processor_tick`](Backends::processor_tick).
+    pub fn share_processors(&self, from: &Backends) {
+        let shared: Vec<_> = from
+            .inner
+            .read()
+            .processors
+            .iter()
+            .map(|(name, processor)| (name.clone(), processor.clone()))
+            .collect();
+        let mut inner = self.inner.write();
+        for (name, processor) in shared {
+            inner.processors.insert(name, processor);
+        }
+    }
+
+    /// Swap in a set of processors and remove others under one write lock,
+    /// so an event is routed either entirely before or entirely after the
+    /// change. Returns the processors which were replaced or removed.
+    pub fn publish_processors(
+        &self,
+        replace: &HashMap<String, Arc<dyn processors::Processor + Send + Sync>>,
+        remove: &HashSet<String>,
+    ) -> HashMap<String, Arc<dyn processors::Processor + Send + Sync>> {
+        let mut inner = self.inner.write();
+        let mut previous = HashMap::new();
+        for (name, processor) in replace {
+            if let Some(old) = inner.processors.insert(name.clone(), processor.clone()) {
+                previous.insert(name.clone(), old);
+            }
+        }
+        for name in remove {
+            if let Some(old) = inner.processors.remove(name) {
+                previous.insert(name.clone(), old);
+            }
+        }
+        previous
     }
 
     pub fn replace_statsd_backend(
@@ -171,9 +228,48 @@ impl Backends {
         }
     }
 
+    /// Provide a batch of events generated by a processor tick, taking the
+    /// routing lock once for the whole batch. Ticks are driven while holding
+    /// the read lock, so it is acquired recursively here to avoid deadlocking
+    /// behind a queued writer.
+    pub fn provide_statsd_batch(&self, pdu: &[Event], route: &[config::Route]) {
+        let lock = self.inner.read_recursive();
+        for p in pdu {
+            lock.provide_statsd(p, route);
+        }
+    }
+
+    /// Fraction in use of the fullest send queue of any statsd backend
+    pub fn queue_fill(&self) -> f64 {
+        self.inner.read().queue_fill()
+    }
+
     pub fn processor_tick(&self, now: std::time::SystemTime) {
         self.inner.read().processor_tick(now, self);
     }
+
+    /// Flush every processor regardless of its schedule, waiting until what
+    /// they held has been handed to the statsd backends.
+    pub fn processor_flush(&self) {
+        self.inner.read().processor_flush(self);
+    }
+
+    /// Wait, for at most the given time, until the send queues of every
+    /// statsd backend are empty and their last batches have had time to be
+    /// sent. Returns whether the queues emptied.
+    pub async fn drain(&self, timeout: Duration) -> bool {
+        let deadline = Instant::now() + timeout;
+        while self.queue_fill() > 0.0 {
+            if Instant::now() >= deadline {
+                return false;
+            }
+            tokio::time::sleep(Duration::from_millis(10)).await;
+        }
+        // Batches are sent at least once per send delay
+        let flushed = Instant::now() + statsd_client::SEND_DELAY * 2;
+        tokio::time::sleep_until(flushed.min(deadline)).await;
+        true
+    }
 }
 
 pub async fn ticker(tripwire: Tripwire, backends: Backends) {
@@ -254,7 +350,53 @@ pub mod test {
             .inner
             .write()
             .processors
-            .insert(name.to_owned(), proc);
+            .insert(name.to_owned(), proc.into());
+    }
+
+    #[test]
+    fn shared_processor_test() {
+        let collector = crate::stats::Collector::default();
+        let first = Backends::new(collector.scope("prefix"));
+        let second = Backends::new(collector.scope("prefix"));
+        let (counter, proc) = make_counting_mock();
+        insert_proc(&first, "count", proc);
+        second.share_processors(&first);
+
+        let pdu = statsd_proto::Pdu::parse(bytes::Bytes::from_static(b"foo.bar:3|c")).unwrap();
+        let route = vec![config::Route {
+            route_type: config::RouteType::Processor,
+            route_to: "count".to_owned(),
+        }];
+        first.provide_statsd(&Event::Pdu(pdu.clone()), &route);
+        second.provide_statsd(&Event::Pdu(pdu), &route);
+        // Both sets of backends feed the one processor instance
+        assert_eq!(2, counter.load(Ordering::Acquire));
+    }
+
+    #[test]
+    fn publish_processor_test() {
+        let backend = Backends::new(crate::stats::Collector::default().scope("prefix"));
+        let (old_counter, old) = make_counting_mock();
+        let (_, removed) = make_counting_mock();
+        insert_proc(&backend, "count", old);
+        insert_proc(&backend, "removed", removed);
+
+        let (new_counter, new) = make_counting_mock();
+        let mut replace = HashMap::new();
+        replace.insert("count".to_owned(), new.into());
+        let remove = vec!["removed".to_owned()].into_iter().collect();
+        let previous = backend.publish_processors(&replace, &remove);
+        assert_eq!(previous.len(), 2);
+        assert!(backend.inner.read().processors.get("removed").is_none());
+
+        let pdu = statsd_proto::Pdu::parse(bytes::Bytes::from_static(b"foo.bar:3|c")).unwrap();
+        let route = vec![config::Route {
+            route_type: config::RouteType::Processor,
+            route_to: "count".to_owned(),
+        }];
+        backend.provide_statsd(&Event::Pdu(pdu), &route);
+        assert_eq!(0, old_counter.load(Ordering::Acquire));
+        assert_eq!(1, new_counter.load(Ordering::Acquire));
     }
 
     #[test]
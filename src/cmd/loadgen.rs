@@ -3,7 +3,7 @@ use chrono::prelude::*;
 use std::time::Duration;
 use structopt::StructOpt;
 use tokio::io::AsyncWriteExt;
-use tokio::net::TcpStream;
+use tokio::net::{TcpStream, UdpSocket};
 
 const PRINT_INTERVAL: u64 = 100000;
 
@@ -11,17 +11,57 @@ const PRINT_INTERVAL: u64 = 100000;
 struct Options {
     #[structopt(short = "e", long = "--endpoint", default_value = "localhost:8129")]
     pub endpoint: String,
+
+    /// Send datagrams over UDP instead of a TCP stream, for comparing the
+    /// receive paths of the UDP listener
+    #[structopt(long = "--udp")]
+    pub udp: bool,
+
+    /// Lines per write, or per datagram with --udp
+    #[structopt(short = "l", long = "--lines", default_value = "1")]
+    pub lines: u64,
+}
+
+enum Output {
+    Tcp(TcpStream),
+    Udp(UdpSocket),
+}
+
+impl Output {
+    async fn connect(options: &Options) -> Self {
+        if options.udp {
+            let socket = UdpSocket::bind("0.0.0.0:0").await.unwrap();
+            socket.connect(options.endpoint.as_str()).await.unwrap();
+            Output::Udp(socket)
+        } else {
+            Output::Tcp(TcpStream::connect(options.endpoint.as_str()).await.unwrap())
+        }
+    }
+
+    async fn send(&mut self, buf: &mut BytesMut) {
+        match self {
+            Output::Tcp(stream) => {
+                stream.write_buf(buf).await.unwrap();
+            }
+            Output::Udp(socket) => {
+                // Datagrams are best effort, a full receive buffer just drops them
+                let _ = socket.send(buf).await;
+                buf.clear();
+            }
+        }
+    }
 }
 
 #[tokio::main]
 async fn main() {
     let options = Options::from_args();
-    let mut stream = TcpStream::connect(options.endpoint).await.unwrap();
+    let mut output = Output::connect(&options).await;
     let mut buf = BytesMut::with_capacity(131072);
     let mut counter = 0_u64;
     let mut last_time = Local::now();
+    let lines = options.lines.max(1);
     loop {
-        for _ in 0..1 {
+        for _ in 0..lines {
             buf.put(
                 format!(
                     "hello.hello.hello.hello.hello.hello.hello.hello.hello:{}|c\n",
@@ -30,11 +70,11 @@ async fn main() {
                 .as_bytes()
                 .as_ref(),
             );
+            counter += 1;
         }
-        stream.write_buf(&mut buf).await.unwrap();
-        counter += 1;
+        output.send(&mut buf).await;
 
-        if counter % PRINT_INTERVAL == 0 {
+        if counter % PRINT_INTERVAL < lines {
             let now_time = Local::now();
             let diff = now_time - last_time;
             last_time = now_time;
@@ -11,17 +11,23 @@ use structopt::StructOpt;
 
 use std::collections::HashMap;
 use std::collections::HashSet;
+use std::sync::Arc;
+use std::time::Duration;
 
 use tokio::runtime;
 use tokio::select;
 use tokio::signal::unix::{signal, SignalKind};
 
 use env_logger::Env;
-use log::{debug, error, info};
+use log::{debug, error, info, warn};
 
 use statsrelay::config;
 use statsrelay::discovery;
+use statsrelay::handoff;
+use statsrelay::overload;
 use statsrelay::processors;
+use statsrelay::prometheus_server;
+use statsrelay::ratelimit;
 use statsrelay::stats;
 use statsrelay::statsd_server;
 use statsrelay::{admin, config::Config};
@@ -38,51 +44,314 @@ struct Options {
     #[structopt(short = "t", long = "--threaded")]
     pub threaded: bool,
 
+    /// Run a shared-nothing copy of the statsd servers on each of this many
+    /// cores, each with its own runtime thread, listeners sharing the
+    /// configured addresses through SO_REUSEPORT, and backend connections
+    #[structopt(long = "--cores", conflicts_with = "threaded")]
+    pub cores: Option<usize>,
+
+    /// Pin the thread of each core to the cpu of the same index
+    #[structopt(long = "--pin-cores", conflicts_with = "threaded")]
+    pub pin_cores: bool,
+
+    /// Take over the listening sockets of the statsrelay process serving
+    /// handoffs on this unix socket path, if any, then serve handoffs there
+    /// for the next process
+    #[structopt(long = "--handoff")]
+    pub handoff: Option<String>,
+
     #[structopt(long = "--version")]
     pub version: bool,
 }
 
-/// The main server invocation, for a given configuration, options and stats
-/// scope. The server will spawn any listeners, initialize a backend
-/// configuration update loop, as well as register signal handlers.
-async fn server(scope: stats::Scope, config: Config, opts: Options) {
-    let backend_reloads = scope.counter("backend_reloads").unwrap();
-    let config_load_failures = scope.counter("backend_reloads_failure").unwrap();
-    let backends = backends::Backends::new(scope.scope("backends"));
+/// How long a shutting down process waits for its backend queues to empty
+const DRAIN_TIMEOUT: Duration = Duration::from_secs(5);
 
-    // Load processors
-    if let Some(processors) = config.processors.as_ref() {
-        load_processors(scope.scope("processors"), &backends, processors)
-            .await
-            .unwrap();
+/// The backends of one core, whose statsd clients run on that core's runtime
+#[derive(Clone)]
+struct Core {
+    backends: backends::Backends,
+    handle: runtime::Handle,
+}
+
+/// Ingest state shared by the statsd servers of every core
+#[derive(Clone)]
+struct Shared {
+    limiters: ratelimit::Registry,
+    overload: Option<Arc<overload::Controller>>,
+    tripwire: Tripwire,
+}
+
+/// Pin the calling thread to a single cpu
+#[cfg(target_os = "linux")]
+fn pin_to_cpu(cpu: usize) {
+    // Safety: cpu_set_t is a plain bitmask, for which all zeroes is the
+    // empty set
+    let result = unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cpu, &mut set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set)
+    };
+    if result != 0 {
+        warn!(
+            "failed to pin thread to cpu {}: {}",
+            cpu,
+            std::io::Error::last_os_error()
+        );
     }
+}
 
-    let (sender, tripwire) = Tripwire::new();
-    let mut run: FuturesUnordered<_> = config
+#[cfg(not(target_os = "linux"))]
+fn pin_to_cpu(cpu: usize) {
+    warn!(
+        "cpu pinning is only supported on linux, not pinning to cpu {}",
+        cpu
+    );
+}
+
+/// Start the statsd servers of the configuration on the current runtime,
+/// returning futures which complete, with the server name, on shutdown. The
+/// servers inherit and record their sockets in the handoff registry, if any.
+fn statsd_servers(
+    scope: &stats::Scope,
+    config: &Config,
+    listen: statsd_server::ListenOptions,
+    backends: &backends::Backends,
+    shared: &Shared,
+    handoff: Option<&handoff::Registry>,
+) -> FuturesUnordered<futures::future::LocalBoxFuture<'static, String>> {
+    config
         .statsd
         .servers
         .iter()
         .map({
             |(server_name, server_config)| {
                 let name = server_name.clone();
+                let scope = scope.scope("statsd_server").scope(server_name);
+                let controls = statsd_server::Controls {
+                    limiter: server_config.rate_limit.as_ref().map(|rate_limit| {
+                        shared
+                            .limiters
+                            .limiter(scope.scope("rate_limit"), server_name, rate_limit)
+                    }),
+                    overload: shared.overload.clone(),
+                };
                 statsd_server::run(
-                    scope.scope("statsd_server").scope(server_name),
-                    tripwire.clone(),
+                    scope,
+                    shared.tripwire.clone(),
                     server_config.clone(),
+                    listen,
                     backends.clone(),
+                    controls,
+                    handoff.map(|registry| registry.server(server_name)),
                 )
                 .map(|_| name)
+                .boxed_local()
             }
         })
-        .collect();
+        .collect()
+}
+
+/// Spawn the thread of an additional core. The core serves its own copy of
+/// the statsd servers, routing into its own backends until shutdown, while
+/// processors are shared with the primary core.
+fn spawn_core(
+    index: usize,
+    scope: stats::Scope,
+    config: Config,
+    pin: bool,
+    primary: &backends::Backends,
+    shared: Shared,
+) -> anyhow::Result<(Core, std::thread::JoinHandle<()>)> {
+    let runtime = runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()?;
+    let core = Core {
+        backends: backends::Backends::new(scope.scope("backends")),
+        handle: runtime.handle().clone(),
+    };
+    core.backends.share_processors(primary);
+    let backends = core.backends.clone();
+    let listen = statsd_server::ListenOptions {
+        reuse_port: true,
+        unix_socket: false,
+    };
+    let thread = std::thread::Builder::new()
+        .name(format!("statsrelay-core-{}", index))
+        .spawn(move || {
+            if pin {
+                pin_to_cpu(index);
+            }
+            runtime.block_on(async move {
+                if let Some(overload) = shared.overload.as_ref() {
+                    tokio::spawn(overload::lag_probe(
+                        shared.tripwire.clone(),
+                        overload.clone(),
+                    ));
+                }
+                let mut run = statsd_servers(&scope, &config, listen, &backends, &shared, None);
+                while let Some(name) = run.next().await {
+                    debug!("server {} on core {} exited", name, index)
+                }
+                // The statsd clients of the core run on its runtime
+                if !backends.drain(DRAIN_TIMEOUT).await {
+                    warn!("backend queues of core {} not drained", index);
+                }
+            });
+        })?;
+    Ok((core, thread))
+}
 
-    // Trap ctrl+c and sigterm messages and perform a clean shutdown
+/// The main server invocation, for a given configuration, options and stats
+/// scope. The server will spawn any listeners, initialize a backend
+/// configuration update loop, as well as register signal handlers. With
+/// multiple cores it also spawns the additional cores, which it drives
+/// processor ticks, reloads and shutdown for. With a handoff registry it
+/// serves the sockets inherited from the previous process, tells it so, and
+/// shuts down once it handed its own sockets to the next process. Fails when
+/// a processor or prometheus server can't be started.
+async fn server(
+    scope: stats::Scope,
+    config: Config,
+    opts: Options,
+    limiters: ratelimit::Registry,
+    registry: Option<handoff::Registry>,
+    predecessor: Option<handoff::Predecessor>,
+) -> anyhow::Result<()> {
+    let backend_reloads = scope.counter("backend_reloads").unwrap();
+    let config_load_failures = scope.counter("backend_reloads_failure").unwrap();
+    let backends = backends::Backends::new(scope.scope("backends"));
+
+    // Load processors
+    if let Some(processors) = config.processors.as_ref() {
+        load_processors(
+            scope.scope("processors"),
+            &backends,
+            processors,
+            registry.as_ref(),
+        )
+        .await
+        .context("can't load processors")?;
+    }
+    // Bind the prometheus servers before anything starts serving
+    let mut prometheus_listeners = Vec::new();
+    if let Some(prometheus) = config.prometheus.as_ref() {
+        for (server_name, server_config) in prometheus.servers.iter() {
+            let listener = handoff::listen_http(
+                registry.as_ref(),
+                &format!("prometheus_server:{}", server_name),
+                &server_config.bind,
+            )
+            .with_context(|| {
+                format!(
+                    "can't serve prometheus server {} on {}",
+                    server_name, server_config.bind
+                )
+            })?;
+            prometheus_listeners.push((server_name.clone(), server_config.clone(), listener));
+        }
+    }
+
+    let (sender, tripwire) = Tripwire::new();
+    let overload = config.statsd.overload.as_ref().map(|overload| {
+        Arc::new(overload::Controller::new(scope.scope("overload"), overload).unwrap())
+    });
+    let shared = Shared {
+        limiters,
+        overload: overload.clone(),
+        tripwire: tripwire.clone(),
+    };
+    let core_count = opts.cores.unwrap_or(1).max(1);
+    if opts.pin_cores {
+        pin_to_cpu(0);
+    }
+    let mut cores = vec![Core {
+        backends: backends.clone(),
+        handle: runtime::Handle::current(),
+    }];
+    let mut core_threads = Vec::new();
+    for index in 1..core_count {
+        let (core, thread) = spawn_core(
+            index,
+            scope.clone(),
+            config.clone(),
+            opts.pin_cores,
+            &backends,
+            shared.clone(),
+        )
+        .unwrap();
+        cores.push(core);
+        core_threads.push(thread);
+    }
+    info!("serving on {} cores", core_count);
+
+    let listen = statsd_server::ListenOptions {
+        reuse_port: core_count > 1,
+        unix_socket: true,
+    };
+    let mut run = statsd_servers(
+        &scope,
+        &config,
+        listen,
+        &backends,
+        &shared,
+        registry.as_ref(),
+    );
+    // Shed load when the backends of any core fall behind
+    if let Some(overload) = overload {
+        tokio::spawn(overload::lag_probe(tripwire.clone(), overload.clone()));
+        tokio::spawn(overload::monitor(
+            tripwire.clone(),
+            overload,
+            cores.iter().map(|core| core.backends.clone()).collect(),
+        ));
+    }
+    for (server_name, server_config, listener) in prometheus_listeners {
+        run.push(
+            prometheus_server::run(
+                scope.scope("prometheus_server").scope(&server_name),
+                tripwire.clone(),
+                server_config,
+                listener,
+                backends.clone(),
+            )
+            .map(|_| server_name)
+            .boxed_local(),
+        );
+    }
+
+    // Trap ctrl+c and sigterm messages and perform a clean shutdown, which a
+    // handoff to a new process triggers as well
     let mut sigint = signal(SignalKind::interrupt()).unwrap();
     let mut sigterm = signal(SignalKind::terminate()).unwrap();
+    let handoff_path = opts.handoff.clone();
+    let server_count = config.statsd.servers.len();
+    let reload_registry = registry.clone();
     tokio::spawn(async move {
+        let handed_off = async move {
+            let (path, registry) = match handoff_path.zip(registry) {
+                Some(handoff) => handoff,
+                None => return futures::future::pending().await,
+            };
+            // Only let the previous process go once every server is up
+            registry.wait_bound(server_count).await;
+            if let Some(predecessor) = predecessor {
+                if let Err(e) = predecessor.ready() {
+                    warn!(
+                        "failed to confirm the handoff to the previous process: {}",
+                        e
+                    );
+                }
+            }
+            if let Err(e) = handoff::serve(&path, &registry).await {
+                error!("failed to serve handoffs on {}: {}", path, e);
+                futures::future::pending::<()>().await;
+            }
+        };
         select! {
         _ = sigint.recv() => info!("received sigint"),
         _ = sigterm.recv() => info!("received sigterm"),
+        _ = handed_off => info!("handed off sockets to a new process"),
         }
         sender.cancel();
     });
@@ -96,11 +365,13 @@ async fn server(scope: stats::Scope, config: Config, opts: Options) {
     // very slow. This is the intended state, as configuration of processors
     // and any buffers should have already been performed.
     //
-    // SIGHUP will attempt to reload backend configurations as well as any
-    // discovery changes.
-    let discovery_backends = backends.clone();
+    // SIGHUP will attempt to reload backend and processor configurations as
+    // well as any discovery changes.
+    let discovery_cores = cores.clone();
+    let processor_scope = scope.scope("processors");
     tokio::spawn(async move {
         let mut last_config = config.clone();
+        let mut active_processors = config.processors.clone().unwrap_or_default();
         let dconfig = config.discovery.unwrap_or_default();
         let discovery_cache = discovery::Cache::new();
         let mut discovery_stream =
@@ -110,7 +381,7 @@ async fn server(scope: stats::Scope, config: Config, opts: Options) {
             backend_reloads.inc();
             let config = match load_backend_configs(
                 &discovery_cache,
-                &discovery_backends,
+                &discovery_cores,
                 opts.config.as_ref(),
             )
             .await
@@ -125,6 +396,13 @@ async fn server(scope: stats::Scope, config: Config, opts: Options) {
                     last_config.clone()
                 }
             };
+            active_processors = reload_processors(
+                &processor_scope,
+                reload_registry.as_ref(),
+                &discovery_cores,
+                &active_processors,
+                &config.processors.clone().unwrap_or_default(),
+            );
             let dconfig = config.discovery.unwrap_or_default();
 
             tokio::select! {
@@ -148,8 +426,23 @@ async fn server(scope: stats::Scope, config: Config, opts: Options) {
     while let Some(name) = run.next().await {
         debug!("server {} exited", name)
     }
-    debug!("forcing processor tick to flush");
-    backends.processor_tick(std::time::SystemTime::now());
+    // Let the other cores hand over their last events before the final tick
+    tokio::task::spawn_blocking(move || {
+        for thread in core_threads {
+            thread.join().unwrap();
+        }
+    })
+    .await
+    .unwrap();
+    debug!("flushing processors");
+    let flushed = backends.clone();
+    tokio::task::spawn_blocking(move || flushed.processor_flush())
+        .await
+        .unwrap();
+    if !backends.drain(DRAIN_TIMEOUT).await {
+        warn!("backend queues not drained");
+    }
+    Ok(())
 }
 
 fn main() -> anyhow::Result<()> {
@@ -180,9 +473,27 @@ fn main() -> anyhow::Result<()> {
     }
 
     let collector = stats::Collector::default();
+    let limiters = ratelimit::Registry::default();
+
+    // Take over the sockets of a running process before binding any, as it
+    // still has every address bound
+    let registry = opts.handoff.as_ref().map(|_| handoff::Registry::default());
+    let predecessor = match opts.handoff.as_ref().zip(registry.as_ref()) {
+        Some((path, registry)) => handoff::inherit(path, registry).unwrap_or_else(|e| {
+            error!(
+                "failed to inherit sockets through {}, binding them: {}",
+                path, e
+            );
+            None
+        }),
+        None => None,
+    };
 
     if let Some(admin) = &config.admin {
-        admin::spawn_admin_server(admin.port, collector.clone());
+        let listener =
+            handoff::listen_http(registry.as_ref(), "admin", &format!("[::]:{}", admin.port))
+                .with_context(|| format!("can't serve the admin server on port {}", admin.port))?;
+        admin::spawn_admin_server(listener, collector.clone(), limiters.clone())?;
         info!("spawned admin server on port {}", admin.port);
     }
     debug!("installed metrics receiver");
@@ -197,53 +508,166 @@ fn main() -> anyhow::Result<()> {
 
     let scope = collector.scope("statsrelay");
 
-    runtime.block_on(server(scope, config, opts));
+    runtime.block_on(server(scope, config, opts, limiters, registry, predecessor))?;
 
     drop(runtime);
     info!("runtime terminated");
     Ok(())
 }
 
+/// Build the processor of a processor configuration. Exporters serve on a
+/// listener inherited through the handoff registry, if any.
+fn build_processor(
+    scope: &Scope,
+    registry: Option<&handoff::Registry>,
+    name: &str,
+    cp: &config::Processor,
+) -> anyhow::Result<Box<dyn processors::Processor + Send + Sync>> {
+    let proc: Box<dyn processors::Processor + Send + Sync> = match cp {
+        config::Processor::TagConverter(tc) => {
+            info!("processor tag_converter: {:?}", tc);
+            Box::new(processors::tag::Normalizer::new(tc.route.as_ref()))
+        }
+        config::Processor::Sampler(sampler) => {
+            info!("processor sampler: {:?}", sampler);
+            Box::new(processors::sampler::Sampler::new(
+                scope.scope(name),
+                sampler,
+            )?)
+        }
+        config::Processor::Cardinality(cardinality) => {
+            info!("processor cardinality: {:?}", cardinality);
+            Box::new(processors::cardinality::Cardinality::new(
+                scope.scope(name),
+                cardinality,
+            ))
+        }
+        config::Processor::RegexFilter(regex) => {
+            info!("processor regex_filter: {:?}", regex);
+            Box::new(processors::regex_filter::RegexFilter::new(
+                scope.scope(name),
+                regex,
+            )?)
+        }
+        config::Processor::PrometheusExporter(exporter) => {
+            info!("processor prometheus_exporter: {:?}", exporter);
+            let listener = handoff::listen_http(
+                registry,
+                &format!("prometheus_exporter:{}", name),
+                &exporter.bind,
+            )
+            .with_context(|| format!("can't serve prometheus metrics on {}", exporter.bind))?;
+            Box::new(processors::prometheus_exporter::Exporter::with_listener(
+                scope.scope(name),
+                exporter,
+                listener,
+            )?)
+        }
+    };
+    Ok(proc)
+}
+
 /// Load processors from a given config structure and pack them into the given
-/// backend set. Currently processors can't be reloaded at runtime.
+/// backend set.
 async fn load_processors(
     scope: Scope,
     backends: &backends::Backends,
     processors: &HashMap<String, config::Processor>,
+    registry: Option<&handoff::Registry>,
 ) -> anyhow::Result<()> {
     for (name, cp) in processors.iter() {
-        let proc: Box<dyn processors::Processor + Send + Sync> = match cp {
-            config::Processor::TagConverter(tc) => {
-                info!("processor tag_converter: {:?}", tc);
-                Box::new(processors::tag::Normalizer::new(tc.route.as_ref()))
-            }
-            config::Processor::Sampler(sampler) => {
-                info!("processor sampler: {:?}", sampler);
-                Box::new(processors::sampler::Sampler::new(sampler)?)
-            }
-            config::Processor::Cardinality(cardinality) => {
-                info!("processor cardinality: {:?}", cardinality);
-                Box::new(processors::cardinality::Cardinality::new(
-                    scope.scope(name),
-                    cardinality,
-                ))
-            }
-            config::Processor::RegexFilter(regex) => {
-                info!("processor regex_filter: {:?}", regex);
-                Box::new(processors::regex_filter::RegexFilter::new(
-                    scope.scope(name),
-                    regex,
-                )?)
-            }
-        };
-        backends.replace_processor(name.as_str(), proc)?;
+        backends.replace_processor(name.as_str(), build_processor(&scope, registry, name, cp)?)?;
     }
     Ok(())
 }
 
+/// Rebuild the processors whose configuration differs from the active one,
+/// and add and remove processors, on every core. Replacements adopt the state
+/// of the processors they replace once no core can reach those any more, and
+/// unchanged processors are left alone. Returns the processor configuration
+/// now in effect.
+fn reload_processors(
+    scope: &Scope,
+    registry: Option<&handoff::Registry>,
+    cores: &[Core],
+    active: &HashMap<String, config::Processor>,
+    next: &HashMap<String, config::Processor>,
+) -> HashMap<String, config::Processor> {
+    let mut effective = active.clone();
+    let mut replace: HashMap<String, Arc<dyn processors::Processor + Send + Sync>> = HashMap::new();
+    for (name, cp) in next.iter() {
+        let previous = active.get(name);
+        if previous == Some(cp) {
+            continue;
+        }
+        // The metrics server of an exporter can't be stopped, and would keep
+        // its address from a replacement
+        if let Some(config::Processor::PrometheusExporter(_)) = previous {
+            warn!(
+                "processor {} exports to prometheus, restart to change it",
+                name
+            );
+            continue;
+        }
+        match build_processor(scope, registry, name, cp) {
+            Ok(proc) => {
+                replace.insert(name.clone(), proc.into());
+                effective.insert(name.clone(), cp.clone());
+            }
+            Err(e) => error!(
+                "failed to rebuild processor {}, keeping the previous one: {:?}",
+                name, e
+            ),
+        }
+    }
+    let mut remove = HashSet::new();
+    for (name, previous) in active.iter() {
+        if next.contains_key(name) {
+            continue;
+        }
+        if let config::Processor::PrometheusExporter(_) = previous {
+            warn!(
+                "processor {} exports to prometheus, restart to remove it",
+                name
+            );
+            continue;
+        }
+        remove.insert(name.clone());
+        effective.remove(name);
+    }
+    if replace.is_empty() && remove.is_empty() {
+        return effective;
+    }
+
+    // Publishing takes the write lock of each core's backends, which waits
+    // out the events and ticks that core is routing, as they hold its read
+    // lock throughout. Once every core has been published to, nothing can
+    // reach a replaced processor, so its state is complete when taken.
+    let mut replaced = HashMap::new();
+    for core in cores {
+        replaced.extend(core.backends.publish_processors(&replace, &remove));
+    }
+    for (name, proc) in replace.iter() {
+        if let Some(state) = replaced
+            .get(name)
+            .and_then(|previous| previous.take_state())
+        {
+            proc.adopt_state(state);
+        }
+    }
+    info!(
+        "processors reloaded, {} replaced and {} removed",
+        replace.len(),
+        remove.len()
+    );
+    effective
+}
+
+/// Apply the backends of the configuration file at the given path to the
+/// backends of every core, on the runtime of that core.
 async fn load_backend_configs(
     discovery_cache: &discovery::Cache,
-    backends: &backends::Backends,
+    cores: &[Core],
     path: &str,
 ) -> anyhow::Result<config::Config> {
     // Check if we have to load the configuration file
@@ -258,23 +682,29 @@ async fn load_backend_configs(
     };
 
     let duplicate = &config.statsd.backends;
-    for (name, dp) in duplicate.iter() {
-        let discovery_data = if let Some(discovery_name) = &dp.shard_map_source {
-            discovery_cache.get(discovery_name)
-        } else {
-            None
-        };
-        if let Err(e) = backends.replace_statsd_backend(name, dp, discovery_data.as_ref()) {
-            error!("failed to replace backend index {} error {}", name, e);
-            continue;
-        }
-    }
-    let existing_backends = backends.backend_names();
     let config_backends: HashSet<String> = duplicate.keys().cloned().collect();
-    let difference = existing_backends.difference(&config_backends);
-    for remove in difference {
-        if let Err(e) = backends.remove_statsd_backend(remove) {
-            error!("failed to remove backend {} with error {:?}", remove, e);
+    for core in cores {
+        // Backend clients spawn their senders onto the runtime they are
+        // created from
+        let _runtime = core.handle.enter();
+        let backends = &core.backends;
+        for (name, dp) in duplicate.iter() {
+            let discovery_data = if let Some(discovery_name) = &dp.shard_map_source {
+                discovery_cache.get(discovery_name)
+            } else {
+                None
+            };
+            if let Err(e) = backends.replace_statsd_backend(name, dp, discovery_data.as_ref()) {
+                error!("failed to replace backend index {} error {}", name, e);
+                continue;
+            }
+        }
+        let existing_backends = backends.backend_names();
+        let difference = existing_backends.difference(&config_backends);
+        for remove in difference {
+            if let Err(e) = backends.remove_statsd_backend(remove) {
+                error!("failed to remove backend {} with error {:?}", remove, e);
+            }
         }
     }
 
@@ -80,20 +80,39 @@ impl Serialize for Route {
 pub mod processor {
     use super::*;
 
-    #[derive(Debug, Serialize, Deserialize, Clone)]
+    #[derive(Debug, Serialize, Deserialize, Clone, PartialEq)]
     pub struct Sampler {
         pub window: u32,
         pub timer_reservoir_size: Option<u32>,
+        /// Number of threads used to emit aggregates at the end of a window
+        pub flush_threads: Option<usize>,
+        /// Number of events handed to the backends at a time during a flush
+        pub flush_batch_size: Option<usize>,
+        /// Fraction of the window, in [0, 1), to spread flush output over
+        pub flush_smear: Option<f64>,
+        /// Flush on wall-clock multiples of the window instead of relative to
+        /// the previous flush
+        pub align_window: Option<bool>,
+        /// Upper bound in milliseconds of a deterministic per-instance offset
+        /// added to aligned flush times, to stagger relays
+        pub align_jitter_ms: Option<u64>,
+        /// Key hashed into the per-instance offset, defaults to the hostname
+        pub align_jitter_key: Option<String>,
+        /// Aggregate sets into a HyperLogLog per window, emitting the estimated
+        /// cardinality as a gauge, instead of passing set members through
+        pub aggregate_sets: Option<bool>,
+        /// Target relative error of set cardinality estimates
+        pub set_error_rate: Option<f64>,
 
         pub route: Vec<Route>,
     }
 
-    #[derive(Serialize, Deserialize, Debug, Clone)]
+    #[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
     pub struct TagConverter {
         pub route: Vec<Route>,
     }
 
-    #[derive(Serialize, Deserialize, Debug, Clone)]
+    #[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
     pub struct Cardinality {
         pub size_limit: usize,
         pub rotate_after_seconds: u64,
@@ -101,21 +120,32 @@ pub mod processor {
         pub route: Vec<Route>,
     }
 
-    #[derive(Serialize, Deserialize, Debug, Clone)]
+    #[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
     pub struct RegexFilter {
         pub remove: Option<Vec<String>>,
         pub allow: Option<Vec<String>>,
         pub route: Vec<Route>,
     }
+
+    #[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
+    pub struct PrometheusExporter {
+        /// Address the `/metrics` endpoint is served on
+        pub bind: String,
+        /// Stop exporting series which have not been updated for this long
+        pub expire_after_seconds: Option<u64>,
+        #[serde(default)]
+        pub route: Vec<Route>,
+    }
 }
 
-#[derive(Serialize, Deserialize, Debug, Clone)]
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
 #[serde(tag = "type", rename_all = "snake_case")]
 pub enum Processor {
     Sampler(processor::Sampler),
     TagConverter(processor::TagConverter),
     Cardinality(processor::Cardinality),
     RegexFilter(processor::RegexFilter),
+    PrometheusExporter(processor::PrometheusExporter),
 }
 
 #[derive(Serialize, Deserialize, Debug, Clone)]
@@ -128,20 +158,166 @@ pub struct StatsdBackendConfig {
     pub input_blocklist: Option<String>,
     pub input_filter: Option<String>,
     pub max_queue: Option<u32>,
+    pub protocol: Option<Protocol>,
+    pub compression: Option<Compression>,
+    pub compression_level: Option<i32>,
+    pub adaptive_sampling: Option<AdaptiveSampling>,
+}
+
+/// Sampling a statsd backend applies to counters and timers while its send
+/// queues fill up, rather than dropping lines once they are full
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct AdaptiveSampling {
+    /// Fraction of a send queue in use at which sampling starts
+    pub queue_fill: Option<f64>,
+    /// Sample rate applied once a send queue is full
+    pub min_rate: Option<f64>,
+}
+
+/// Wire format a statsd backend sends in
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "snake_case")]
+pub enum Protocol {
+    /// Newline separated statsd lines
+    Text,
+    /// Length prefixed binary frames, only understood by other statsrelay
+    /// servers
+    Binary,
+}
+
+impl Default for Protocol {
+    fn default() -> Self {
+        Protocol::Text
+    }
+}
+
+/// Stream compression a statsd backend applies to its connections
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "snake_case")]
+pub enum Compression {
+    None,
+    /// zstd, only understood by other statsrelay servers
+    Zstd,
+}
+
+impl Default for Compression {
+    fn default() -> Self {
+        Compression::None
+    }
+}
+
+/// How much of each incoming statsd line a server checks before routing it
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "snake_case")]
+pub enum Validation {
+    /// Only locate the fields needed to route a line
+    None,
+    /// Also require a non-empty name and a known metric type
+    Structural,
+    /// Also require numeric values and sample rates to be numbers
+    Full,
+}
+
+impl Default for Validation {
+    fn default() -> Self {
+        Validation::None
+    }
+}
+
+/// What a server does with the lines of a peer over its rate limit
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq)]
+#[serde(rename_all = "snake_case")]
+pub enum RateLimitAction {
+    /// Drop the lines over the limit
+    Drop,
+    /// Also close stream connections, shedding the peer until it reconnects.
+    /// Datagram peers have their lines dropped.
+    Disconnect,
+}
+
+impl Default for RateLimitAction {
+    fn default() -> Self {
+        RateLimitAction::Drop
+    }
+}
+
+/// Token bucket limit applied to each peer of a server
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct RateLimitConfig {
+    pub lines_per_second: u32,
+    /// Lines a peer may send at once above its rate, defaults to one
+    /// second's worth
+    pub burst: Option<u32>,
+    #[serde(default)]
+    pub action: RateLimitAction,
+    /// Peers tracked at once, rounded up to a power of two
+    pub max_peers: Option<usize>,
 }
 
 #[derive(Serialize, Deserialize, Debug, Clone)]
 pub struct StatsdServerConfig {
     pub bind: String,
     pub socket: Option<String>,
+    /// Path of a unix datagram socket to receive lines on
+    pub datagram_socket: Option<String>,
+    /// Kernel receive buffer size (SO_RCVBUF) of the UDP and unix datagram
+    /// sockets
+    pub receive_buffer: Option<usize>,
+    /// Set the receive buffer size with SO_RCVBUFFORCE, past the system
+    /// limit
+    pub receive_buffer_force: Option<bool>,
     pub read_buffer: Option<usize>,
+    pub validate: Option<Validation>,
+    /// Datagrams read per receive call on the UDP listener, batched with
+    /// recvmmsg on Linux
+    pub udp_batch: Option<usize>,
+    /// Number of threads reading from the UDP listener
+    pub udp_readers: Option<usize>,
+    /// Lines a stream connection may process before yielding to other
+    /// connections on the same runtime
+    pub lines_per_yield: Option<usize>,
+    /// Longest unterminated line a stream connection may buffer before it is
+    /// disconnected
+    pub max_line_length: Option<usize>,
+    /// Per peer limit on the lines accepted
+    pub rate_limit: Option<RateLimitConfig>,
     pub route: Vec<Route>,
 }
 
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct PrometheusServerConfig {
+    pub bind: String,
+    pub route: Vec<Route>,
+    pub batch_size: Option<usize>,
+}
+
+#[derive(Serialize, Deserialize, Debug, Clone, Default)]
+pub struct PrometheusConfig {
+    #[serde(default)]
+    pub servers: HashMap<String, PrometheusServerConfig>,
+}
+
+/// When the statsd servers shed incoming lines to keep up with their
+/// backends
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct OverloadConfig {
+    /// Fraction of a backend send queue in use at which the relay is
+    /// overloaded
+    pub queue_fill: Option<f64>,
+    /// Event loop lag, in milliseconds, at which the relay is overloaded
+    pub loop_lag_ms: Option<u64>,
+    /// Regular expressions matching the names of lines which are never shed
+    #[serde(default)]
+    pub protect: Vec<String>,
+    /// Largest fraction of the other lines shed
+    pub max_shed: Option<f64>,
+}
+
 #[derive(Serialize, Deserialize, Debug, Clone)]
 pub struct StatsdConfig {
     pub servers: HashMap<String, StatsdServerConfig>,
     pub backends: HashMap<String, StatsdBackendConfig>,
+    pub overload: Option<OverloadConfig>,
 }
 
 #[derive(Debug, Serialize, Deserialize, Clone)]
@@ -195,6 +371,7 @@ pub struct AdminConfig {
 pub struct Config {
     pub admin: Option<AdminConfig>,
     pub statsd: StatsdConfig,
+    pub prometheus: Option<PrometheusConfig>,
     pub discovery: Option<Discovery>,
     pub processors: Option<HashMap<String, Processor>>,
 }
@@ -240,6 +417,11 @@ fn check_config_route(config: &Config) -> Result<(), Error> {
     for (_, statsd) in config.statsd.servers.iter() {
         check_routes(config, statsd.route.as_ref())?;
     }
+    if let Some(prometheus) = &config.prometheus {
+        for (_, server) in prometheus.servers.iter() {
+            check_routes(config, server.route.as_ref())?;
+        }
+    }
     let routes: Result<Vec<_>, Error> = config
         .clone()
         .processors
@@ -250,6 +432,9 @@ fn check_config_route(config: &Config) -> Result<(), Error> {
             Processor::TagConverter(tc) => check_routes(config, tc.route.as_ref()),
             Processor::Cardinality(c) => check_routes(config, c.route.as_ref()),
             Processor::RegexFilter(filter) => check_routes(config, filter.route.as_ref()),
+            Processor::PrometheusExporter(exporter) => {
+                check_routes(config, exporter.route.as_ref())
+            }
         })
         .collect();
     routes.map(|_| ())
@@ -299,7 +484,8 @@ pub mod test {
                         {
                             "bind": "127.0.0.1:BIND_STATSD_PORT",
                             "route": ["statsd:test1"],
-                            "read_buffer": 65535
+                            "read_buffer": 65535,
+                            "validate": "full"
                         }
                 },
                 "backends": {
@@ -315,10 +501,20 @@ pub mod test {
                         {
                             "input_filter": "^(?=dontmatchme)",
                             "prefix": "test-2.",
-                            "shard_map_source": "my_s3"
+                            "shard_map_source": "my_s3",
+                            "protocol": "binary",
+                            "compression": "zstd"
                         }
                 }
             },
+            "prometheus": {
+                "servers": {
+                    "push": {
+                        "bind": "127.0.0.1:BIND_PROMETHEUS_PORT",
+                        "route": ["processor:tag1"]
+                    }
+                }
+            },
             "processors": {
                 "tag1": {
                     "type": "tag_converter",
@@ -366,6 +562,28 @@ pub mod test {
             default_server.bind,
             "127.0.0.1:BIND_STATSD_PORT".to_string()
         );
+        assert_eq!(default_server.validate, Some(Validation::Full));
+        // Check backends
+        let backends = &config.statsd.backends;
+        assert_eq!(backends.get("test1").unwrap().protocol, None);
+        assert_eq!(
+            backends.get("mapsource").unwrap().protocol,
+            Some(Protocol::Binary)
+        );
+        assert_eq!(
+            backends.get("mapsource").unwrap().compression,
+            Some(Compression::Zstd)
+        );
+        // Check prometheus servers
+        let push_server = config
+            .prometheus
+            .as_ref()
+            .unwrap()
+            .servers
+            .get("push")
+            .unwrap();
+        assert_eq!(push_server.route[0].route_to, "tag1");
+        assert_eq!(push_server.batch_size, None);
         // Check processors
         assert_eq!(2, config.clone().processors.unwrap_or_default().len());
         // Check discovery
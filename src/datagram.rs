@@ -0,0 +1,306 @@
+//! Batched datagram receive for the datagram listeners.
+//!
+//! On Linux a [`BatchReceiver`](BatchReceiver) reads up to a whole batch of
+//! datagrams with a single `recvmmsg` call, so a busy socket costs one
+//! syscall per batch rather than per datagram. Elsewhere it falls back to one
+//! `recv` per call. Sockets with [`enable_drop_count`](enable_drop_count)
+//! set also report how many datagrams the kernel dropped for lack of buffer
+//! space, which the receiver picks out of each datagram's ancillary data.
+
+use std::io;
+use std::mem::size_of;
+use std::net::{Ipv4Addr, Ipv6Addr, SocketAddr, SocketAddrV4, SocketAddrV6};
+use std::os::unix::io::AsRawFd;
+
+/// Largest datagram a receiver accepts, longer ones are truncated
+pub const MAX_DATAGRAM: usize = 65535;
+/// Words of ancillary data buffer per datagram, room for one drop count
+#[cfg(target_os = "linux")]
+const CONTROL_WORDS: usize = 4;
+
+/// Have the kernel attach its count of datagrams dropped by the socket
+/// (`SO_RXQ_OVFL`) to the datagrams it receives
+#[cfg(target_os = "linux")]
+pub fn enable_drop_count<S: AsRawFd>(socket: &S) -> io::Result<()> {
+    let enable: libc::c_int = 1;
+    // Safety: the option value is a c_int living for the duration of the call
+    let result = unsafe {
+        libc::setsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_RXQ_OVFL,
+            &enable as *const _ as *const libc::c_void,
+            size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if result < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn enable_drop_count<S: AsRawFd>(_socket: &S) -> io::Result<()> {
+    Err(io::Error::new(
+        io::ErrorKind::Other,
+        "drop counts are only reported on Linux",
+    ))
+}
+
+pub struct BatchReceiver {
+    buffer: Vec<u8>,
+    lengths: Vec<usize>,
+    sources: Vec<libc::sockaddr_storage>,
+    /// Kernel drop count reported with the last batch
+    dropped: Option<u32>,
+    #[cfg(target_os = "linux")]
+    _iovecs: Vec<libc::iovec>,
+    #[cfg(target_os = "linux")]
+    _controls: Vec<[u64; CONTROL_WORDS]>,
+    #[cfg(target_os = "linux")]
+    headers: Vec<libc::mmsghdr>,
+}
+
+impl BatchReceiver {
+    /// Create a receiver reading at most `batch` datagrams per call
+    pub fn new(batch: usize) -> Self {
+        let batch = batch.max(1);
+        let mut buffer = vec![0_u8; batch * MAX_DATAGRAM];
+        // Safety: sockaddr_storage is a plain C struct, for which all zeroes
+        // is an unspecified address
+        let mut sources = vec![unsafe { std::mem::zeroed::<libc::sockaddr_storage>() }; batch];
+        #[cfg(target_os = "linux")]
+        {
+            let mut iovecs: Vec<libc::iovec> = buffer
+                .chunks_exact_mut(MAX_DATAGRAM)
+                .map(|slot| libc::iovec {
+                    iov_base: slot.as_mut_ptr() as *mut libc::c_void,
+                    iov_len: MAX_DATAGRAM,
+                })
+                .collect();
+            // u64 words keep the control buffers aligned for cmsghdr
+            let mut controls = vec![[0_u64; CONTROL_WORDS]; batch];
+            let headers = iovecs
+                .iter_mut()
+                .zip(sources.iter_mut())
+                .zip(controls.iter_mut())
+                .map(|((iovec, source), control)| {
+                    // Safety: mmsghdr is a plain C struct, for which all zeroes
+                    // is a valid empty header
+                    let mut header: libc::mmsghdr = unsafe { std::mem::zeroed() };
+                    header.msg_hdr.msg_iov = iovec;
+                    header.msg_hdr.msg_iovlen = 1;
+                    header.msg_hdr.msg_name = source as *mut _ as *mut libc::c_void;
+                    header.msg_hdr.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+                    header
+                })
+                .collect();
+            // The headers point into the heap allocations of the buffer, the
+            // iovecs, the sources and the controls, which stay put when the
+            // receiver is moved
+            BatchReceiver {
+                buffer,
+                lengths: vec![0; batch],
+                sources,
+                dropped: None,
+                _iovecs: iovecs,
+                _controls: controls,
+                headers,
+            }
+        }
+        #[cfg(not(target_os = "linux"))]
+        {
+            buffer.truncate(MAX_DATAGRAM);
+            sources.truncate(1);
+            BatchReceiver {
+                buffer,
+                lengths: vec![0; 1],
+                sources,
+                dropped: None,
+            }
+        }
+    }
+
+    /// Receive a batch of datagrams, blocking until at least one arrives or
+    /// the socket's read timeout expires, and return how many were received
+    #[cfg(target_os = "linux")]
+    pub fn recv<S: AsRawFd>(&mut self, socket: &S) -> io::Result<usize> {
+        // The kernel shrinks the address and control lengths to what it
+        // filled in for each datagram
+        for header in self.headers.iter_mut() {
+            header.msg_hdr.msg_namelen = size_of::<libc::sockaddr_storage>() as _;
+            header.msg_hdr.msg_controllen = size_of::<[u64; CONTROL_WORDS]>() as _;
+        }
+        // Safety: every header points at an iovec covering its own
+        // MAX_DATAGRAM slot of the buffer, and at its own source address and
+        // control buffer, all owned by self
+        let received = unsafe {
+            libc::recvmmsg(
+                socket.as_raw_fd(),
+                self.headers.as_mut_ptr(),
+                self.headers.len() as _,
+                libc::MSG_WAITFORONE as _,
+                std::ptr::null_mut(),
+            )
+        };
+        if received < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let received = received as usize;
+        self.dropped = None;
+        for (length, header) in self.lengths.iter_mut().zip(&self.headers[..received]) {
+            *length = header.msg_len as usize;
+            if let Some(dropped) = drop_count(&header.msg_hdr) {
+                self.dropped = self.dropped.max(Some(dropped));
+            }
+        }
+        Ok(received)
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub fn recv<S: AsRawFd>(&mut self, socket: &S) -> io::Result<usize> {
+        let mut length = size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+        // Safety: the buffer is valid for MAX_DATAGRAM bytes, and the source
+        // for its length
+        let received = unsafe {
+            libc::recvfrom(
+                socket.as_raw_fd(),
+                self.buffer.as_mut_ptr() as *mut libc::c_void,
+                MAX_DATAGRAM,
+                0,
+                &mut self.sources[0] as *mut _ as *mut libc::sockaddr,
+                &mut length,
+            )
+        };
+        if received < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        self.lengths[0] = received as usize;
+        Ok(1)
+    }
+
+    /// The kernel's count of datagrams dropped by the socket, as reported
+    /// with the last batch. Only sockets with
+    /// [`enable_drop_count`](enable_drop_count) set report it, and only once
+    /// they dropped any.
+    pub fn dropped(&self) -> Option<u32> {
+        self.dropped
+    }
+
+    /// The `index`th datagram of the last batch received
+    pub fn datagram(&self, index: usize) -> &[u8] {
+        let start = index * MAX_DATAGRAM;
+        &self.buffer[start..start + self.lengths[index].min(MAX_DATAGRAM)]
+    }
+
+    /// The sender of the `index`th datagram of the last batch received, if
+    /// it was sent from an IP address
+    pub fn source(&self, index: usize) -> Option<SocketAddr> {
+        let source = &self.sources[index];
+        match source.ss_family as libc::c_int {
+            libc::AF_INET => {
+                // Safety: the family identifies the storage as a sockaddr_in
+                let v4 = unsafe { &*(source as *const _ as *const libc::sockaddr_in) };
+                Some(SocketAddr::V4(SocketAddrV4::new(
+                    Ipv4Addr::from(u32::from_be(v4.sin_addr.s_addr)),
+                    u16::from_be(v4.sin_port),
+                )))
+            }
+            libc::AF_INET6 => {
+                // Safety: the family identifies the storage as a sockaddr_in6
+                let v6 = unsafe { &*(source as *const _ as *const libc::sockaddr_in6) };
+                Some(SocketAddr::V6(SocketAddrV6::new(
+                    Ipv6Addr::from(v6.sin6_addr.s6_addr),
+                    u16::from_be(v6.sin6_port),
+                    v6.sin6_flowinfo,
+                    v6.sin6_scope_id,
+                )))
+            }
+            _ => None,
+        }
+    }
+}
+
+/// The drop count in the ancillary data of a received message
+#[cfg(target_os = "linux")]
+fn drop_count(header: &libc::msghdr) -> Option<u32> {
+    // Safety: the kernel filled in the control buffer of the header and set
+    // its length, and CMSG_NXTHDR stops at the end of it
+    unsafe {
+        let mut cmsg = libc::CMSG_FIRSTHDR(header);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SO_RXQ_OVFL {
+                return Some(std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const u32));
+            }
+            cmsg = libc::CMSG_NXTHDR(header, cmsg);
+        }
+    }
+    None
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use std::net::UdpSocket;
+    use std::time::Duration;
+
+    #[test]
+    fn receive_batches() {
+        let socket = UdpSocket::bind("127.0.0.1:0").unwrap();
+        socket
+            .set_read_timeout(Some(Duration::from_secs(5)))
+            .unwrap();
+        let sender = UdpSocket::bind("127.0.0.1:0").unwrap();
+        let sent: Vec<Vec<u8>> = (0..12)
+            .map(|i| format!("metric.{}:{}|c", i, i).into_bytes())
+            .collect();
+        for datagram in sent.iter() {
+            sender
+                .send_to(datagram, socket.local_addr().unwrap())
+                .unwrap();
+        }
+
+        let mut receiver = BatchReceiver::new(8);
+        let mut received = Vec::new();
+        while received.len() < sent.len() {
+            let count = receiver.recv(&socket).unwrap();
+            assert!(count >= 1 && count <= 8);
+            for i in 0..count {
+                received.push(receiver.datagram(i).to_vec());
+                assert_eq!(receiver.source(i), Some(sender.local_addr().unwrap()));
+            }
+        }
+        assert_eq!(received, sent);
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn report_drops() {
+        let socket = UdpSocket::bind("127.0.0.1:0").unwrap();
+        socket
+            .set_read_timeout(Some(Duration::from_secs(5)))
+            .unwrap();
+        socket2::SockRef::from(&socket)
+            .set_recv_buffer_size(1)
+            .unwrap();
+        enable_drop_count(&socket).unwrap();
+        let sender = UdpSocket::bind("127.0.0.1:0").unwrap();
+        // Overflow the smallest receive buffer the kernel allows
+        for _ in 0..1000 {
+            sender
+                .send_to(&[b'x'; 1000], socket.local_addr().unwrap())
+                .unwrap();
+        }
+        // A datagram carries the count as of when it was queued, so drain
+        // the ones queued before the drops
+        let mut receiver = BatchReceiver::new(8);
+        socket.set_nonblocking(true).unwrap();
+        while receiver.recv(&socket).is_ok() {}
+        socket.set_nonblocking(false).unwrap();
+        sender
+            .send_to(b"after", socket.local_addr().unwrap())
+            .unwrap();
+        assert_eq!(receiver.recv(&socket).unwrap(), 1);
+        assert!(receiver.dropped().unwrap() > 0);
+    }
+}
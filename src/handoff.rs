@@ -0,0 +1,477 @@
+//! Zero downtime restarts, by handing the listening sockets of the statsd
+//! servers, and the TCP listeners of the HTTP servers, from a running process
+//! to its replacement.
+//!
+//! A process started with a handoff path first asks the process listening
+//! there for its sockets, which arrive as `SCM_RIGHTS` ancillary data. Once
+//! the new process serves them it says so, and the old process shuts down:
+//! it stops reading, flushes its processors and drains its backend queues.
+//! Both processes serve the shared sockets in the meantime, so datagrams and
+//! connections keep being taken throughout. The new process then listens on
+//! the handoff path for its own successor.
+//!
+//! Only the sockets of the first core are handed over. The other cores of the
+//! new process join them through `SO_REUSEPORT`, which requires the old
+//! process to have run with several cores as well.
+
+use parking_lot::Mutex;
+
+use std::collections::{HashMap, HashSet};
+use std::io::{self, ErrorKind, Read, Write};
+use std::mem::size_of;
+use std::net::TcpListener;
+use std::os::unix::io::{AsFd, AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::sync::Arc;
+use std::time::Duration;
+
+use log::{error, info, warn};
+
+/// Most sockets the kernel passes in one message (SCM_MAX_FD)
+const MAX_SOCKETS: usize = 253;
+const MAX_PAYLOAD: usize = 64 * 1024;
+const READY: &[u8] = b"ready\n";
+/// How long a new process may take to serve the sockets it was handed
+const READY_TIMEOUT: Duration = Duration::from_secs(30);
+/// How long a new process waits for the previous one to hand over its
+/// sockets before binding its own
+const INHERIT_TIMEOUT: Duration = Duration::from_secs(5);
+
+#[cfg(target_os = "linux")]
+const RECV_FLAGS: libc::c_int = libc::MSG_CMSG_CLOEXEC;
+#[cfg(not(target_os = "linux"))]
+const RECV_FLAGS: libc::c_int = 0;
+
+/// The sockets a server listens on
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum Kind {
+    Tcp,
+    Udp,
+    Unix,
+    UnixDatagram,
+    /// The TCP listener of an HTTP server
+    Http,
+}
+
+impl Kind {
+    fn as_str(&self) -> &'static str {
+        match self {
+            Kind::Tcp => "tcp",
+            Kind::Udp => "udp",
+            Kind::Unix => "unix",
+            Kind::UnixDatagram => "unix_datagram",
+            Kind::Http => "http",
+        }
+    }
+
+    fn parse(kind: &str) -> Option<Self> {
+        match kind {
+            "tcp" => Some(Kind::Tcp),
+            "udp" => Some(Kind::Udp),
+            "unix" => Some(Kind::Unix),
+            "unix_datagram" => Some(Kind::UnixDatagram),
+            "http" => Some(Kind::Http),
+            _ => None,
+        }
+    }
+}
+
+#[derive(Default)]
+struct Inner {
+    /// Sockets handed over by the previous process, not yet taken by a server
+    inherited: HashMap<(String, Kind), OwnedFd>,
+    /// Duplicates of the sockets served, to hand over to the next process
+    serving: HashMap<(String, Kind), OwnedFd>,
+    /// Servers which are serving all of their sockets
+    bound: HashSet<String>,
+    handed_off: bool,
+}
+
+/// The listening sockets of every statsd server of a process
+#[derive(Clone, Default)]
+pub struct Registry {
+    inner: Arc<Mutex<Inner>>,
+}
+
+impl Registry {
+    /// The sockets of one server
+    pub fn server(&self, name: &str) -> Sockets {
+        Sockets {
+            registry: self.clone(),
+            server: name.to_owned(),
+        }
+    }
+
+    /// Whether the sockets have been handed to another process, which then
+    /// owns the socket files as well
+    pub fn handed_off(&self) -> bool {
+        self.inner.lock().handed_off
+    }
+
+    /// Wait until the given number of servers serve their sockets
+    pub async fn wait_bound(&self, servers: usize) {
+        while self.inner.lock().bound.len() < servers {
+            tokio::time::sleep(Duration::from_millis(10)).await;
+        }
+    }
+}
+
+/// The sockets of one statsd server
+#[derive(Clone)]
+pub struct Sockets {
+    registry: Registry,
+    server: String,
+}
+
+impl Sockets {
+    /// Take the socket of a kind handed over by the previous process, if any
+    pub fn inherit<S: From<OwnedFd>>(&self, kind: Kind) -> Option<S> {
+        let key = (self.server.clone(), kind);
+        let socket = self.registry.inner.lock().inherited.remove(&key)?;
+        info!(
+            "server {} inherited its {} socket",
+            self.server,
+            kind.as_str()
+        );
+        Some(S::from(socket))
+    }
+
+    /// Record a socket the server serves, to hand over to the next process
+    pub fn serve<S: AsFd>(&self, kind: Kind, socket: &S) -> io::Result<()> {
+        let socket = socket.as_fd().try_clone_to_owned()?;
+        self.registry
+            .inner
+            .lock()
+            .serving
+            .insert((self.server.clone(), kind), socket);
+        Ok(())
+    }
+
+    /// Mark the server as serving all of its sockets
+    pub fn bound(&self) {
+        self.registry.inner.lock().bound.insert(self.server.clone());
+    }
+
+    pub fn handed_off(&self) -> bool {
+        self.registry.handed_off()
+    }
+
+    /// The listener of an HTTP server: the one the previous process handed
+    /// over, which still has the address bound, or else a new one bound to
+    /// the address. Either way it is handed to the next process.
+    pub fn listen_http(&self, bind: &str) -> io::Result<TcpListener> {
+        let listener = match self.inherit(Kind::Http) {
+            Some(listener) => listener,
+            None => TcpListener::bind(bind)?,
+        };
+        self.serve(Kind::Http, &listener)?;
+        Ok(listener)
+    }
+}
+
+/// Bind the listener of an HTTP server, through the handoff registry if any
+pub fn listen_http(registry: Option<&Registry>, name: &str, bind: &str) -> io::Result<TcpListener> {
+    match registry {
+        Some(registry) => registry.server(name).listen_http(bind),
+        None => TcpListener::bind(bind),
+    }
+}
+
+/// A process whose sockets were inherited, waiting for the new process to
+/// serve them before it shuts down
+pub struct Predecessor {
+    stream: UnixStream,
+}
+
+impl Predecessor {
+    /// Tell the previous process that its sockets are served
+    pub fn ready(mut self) -> io::Result<()> {
+        self.stream.write_all(READY)
+    }
+}
+
+/// Take over the sockets of the process listening on the handoff path into
+/// the registry. Returns None when no process listens there. Blocks for at
+/// most [`INHERIT_TIMEOUT`] waiting for the sockets, so call it before
+/// starting a runtime or from a blocking task.
+pub fn inherit(path: &str, registry: &Registry) -> io::Result<Option<Predecessor>> {
+    inherit_within(path, registry, INHERIT_TIMEOUT)
+}
+
+fn inherit_within(
+    path: &str,
+    registry: &Registry,
+    timeout: Duration,
+) -> io::Result<Option<Predecessor>> {
+    let stream = match UnixStream::connect(path) {
+        Ok(stream) => stream,
+        Err(e) if e.kind() == ErrorKind::NotFound || e.kind() == ErrorKind::ConnectionRefused => {
+            return Ok(None)
+        }
+        Err(e) => return Err(e),
+    };
+    stream.set_read_timeout(Some(timeout))?;
+    stream.set_write_timeout(Some(timeout))?;
+    let (payload, sockets) = recv_sockets(&stream).map_err(|e| match e.kind() {
+        ErrorKind::WouldBlock | ErrorKind::TimedOut => io::Error::new(
+            ErrorKind::TimedOut,
+            "the previous process did not hand over its sockets in time",
+        ),
+        _ => e,
+    })?;
+    let names: Vec<&str> = std::str::from_utf8(&payload)
+        .map_err(|e| io::Error::new(ErrorKind::InvalidData, e))?
+        .lines()
+        .collect();
+    if names.len() != sockets.len() {
+        return Err(io::Error::new(
+            ErrorKind::InvalidData,
+            format!("{} sockets named, {} received", names.len(), sockets.len()),
+        ));
+    }
+    let mut inner = registry.inner.lock();
+    for (name, socket) in names.into_iter().zip(sockets) {
+        let key = name
+            .rsplit_once('/')
+            .and_then(|(server, kind)| Some((server.to_owned(), Kind::parse(kind)?)))
+            .ok_or_else(|| {
+                io::Error::new(ErrorKind::InvalidData, format!("bad socket {}", name))
+            })?;
+        inner.inherited.insert(key, socket);
+    }
+    info!(
+        "inherited {} sockets through {}",
+        inner.inherited.len(),
+        path
+    );
+    Ok(Some(Predecessor { stream }))
+}
+
+/// Listen on the handoff path until the sockets in the registry have been
+/// handed to a new process which serves them. Any socket file at the path is
+/// replaced, as a previous process keeps no use for it after a handoff.
+///
+/// A new process which takes the sockets but doesn't confirm serving them
+/// within [`READY_TIMEOUT`] has likely failed to start. This process then
+/// keeps running and serving handoffs, and the new process, if still alive,
+/// serves the same sockets alongside it until one of them is stopped.
+pub async fn serve(path: &str, registry: &Registry) -> io::Result<()> {
+    match std::fs::remove_file(path) {
+        Err(e) if e.kind() != ErrorKind::NotFound => return Err(e),
+        _ => (),
+    }
+    let listener = tokio::net::UnixListener::bind(path)?;
+    info!("handoff listening on {}", path);
+    loop {
+        let (stream, _) = listener.accept().await?;
+        let stream = stream.into_std()?;
+        let handoff = registry.clone();
+        let result = tokio::task::spawn_blocking(move || handoff.hand_off(stream))
+            .await
+            .unwrap();
+        match result {
+            Ok(()) => return Ok(()),
+            Err(e) if unconfirmed(&e) => error!(
+                "new process took the sockets but did not confirm serving them within {}s, \
+                 it likely failed to start ({}); this process keeps serving them, \
+                 stop the new process if it still runs",
+                READY_TIMEOUT.as_secs(),
+                e
+            ),
+            Err(e) => warn!("handoff failed, continuing to serve: {}", e),
+        }
+    }
+}
+
+/// Whether a handoff failed after the sockets were sent, waiting for the new
+/// process to confirm it serves them
+fn unconfirmed(e: &io::Error) -> bool {
+    matches!(
+        e.kind(),
+        ErrorKind::WouldBlock | ErrorKind::TimedOut | ErrorKind::UnexpectedEof
+    )
+}
+
+impl Registry {
+    fn hand_off(&self, mut stream: UnixStream) -> io::Result<()> {
+        stream.set_nonblocking(false)?;
+        stream.set_read_timeout(Some(READY_TIMEOUT))?;
+        {
+            let inner = self.inner.lock();
+            let mut payload = Vec::new();
+            let mut sockets = Vec::new();
+            for ((server, kind), socket) in inner.serving.iter() {
+                payload.extend_from_slice(format!("{}/{}\n", server, kind.as_str()).as_bytes());
+                sockets.push(socket.as_raw_fd());
+            }
+            send_sockets(&stream, &payload, &sockets)?;
+            info!("handed over {} sockets", sockets.len());
+        }
+        let mut ready = [0_u8; READY.len()];
+        stream.read_exact(&mut ready)?;
+        if ready != READY {
+            return Err(io::Error::new(
+                ErrorKind::InvalidData,
+                "new process did not confirm the handoff",
+            ));
+        }
+        self.inner.lock().handed_off = true;
+        info!("new process serves the handed over sockets");
+        Ok(())
+    }
+}
+
+/// Room for the ancillary data of `count` file descriptors, in words to keep
+/// it aligned for cmsghdr
+fn control_buffer(count: usize) -> Vec<u64> {
+    // Safety: CMSG_SPACE only computes a length
+    let space = unsafe { libc::CMSG_SPACE((count * size_of::<RawFd>()) as u32) } as usize;
+    vec![0_u64; (space + size_of::<u64>() - 1) / size_of::<u64>()]
+}
+
+fn send_sockets(stream: &UnixStream, payload: &[u8], sockets: &[RawFd]) -> io::Result<()> {
+    if sockets.is_empty() || sockets.len() > MAX_SOCKETS || payload.len() > MAX_PAYLOAD {
+        return Err(io::Error::new(
+            ErrorKind::InvalidInput,
+            format!("can't hand over {} sockets", sockets.len()),
+        ));
+    }
+    let mut control = control_buffer(sockets.len());
+    let mut iov = libc::iovec {
+        iov_base: payload.as_ptr() as *mut libc::c_void,
+        iov_len: payload.len(),
+    };
+    // Safety: msghdr is a plain C struct, for which all zeroes is a valid
+    // empty header
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = (control.len() * size_of::<u64>()) as _;
+    // Safety: the control buffer has room for a header and every socket, and
+    // the payload and control buffers outlive the call
+    let sent = unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN((sockets.len() * size_of::<RawFd>()) as u32) as _;
+        std::ptr::copy_nonoverlapping(
+            sockets.as_ptr(),
+            libc::CMSG_DATA(cmsg) as *mut RawFd,
+            sockets.len(),
+        );
+        libc::sendmsg(stream.as_raw_fd(), &msg, 0)
+    };
+    if sent < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    if sent as usize != payload.len() {
+        return Err(io::Error::new(ErrorKind::WriteZero, "short handoff write"));
+    }
+    Ok(())
+}
+
+fn recv_sockets(stream: &UnixStream) -> io::Result<(Vec<u8>, Vec<OwnedFd>)> {
+    let mut payload = vec![0_u8; MAX_PAYLOAD];
+    let mut control = control_buffer(MAX_SOCKETS);
+    let mut iov = libc::iovec {
+        iov_base: payload.as_mut_ptr() as *mut libc::c_void,
+        iov_len: payload.len(),
+    };
+    // Safety: msghdr is a plain C struct, for which all zeroes is a valid
+    // empty header
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = (control.len() * size_of::<u64>()) as _;
+    // Safety: the payload and control buffers are valid for their lengths
+    let received = unsafe { libc::recvmsg(stream.as_raw_fd(), &mut msg, RECV_FLAGS) };
+    if received < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    let mut sockets = Vec::new();
+    // Safety: the kernel filled in the control buffer and set its length,
+    // and each SCM_RIGHTS message holds as many descriptors as fit its
+    // length, which are now owned by this process
+    unsafe {
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg) as *const RawFd;
+                let length = (*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize;
+                for index in 0..length / size_of::<RawFd>() {
+                    let fd = std::ptr::read_unaligned(data.add(index));
+                    sockets.push(OwnedFd::from_raw_fd(fd));
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+    }
+    if msg.msg_flags & libc::MSG_CTRUNC != 0 {
+        return Err(io::Error::new(
+            ErrorKind::InvalidData,
+            "handed over sockets were truncated",
+        ));
+    }
+    payload.truncate(received as usize);
+    Ok((payload, sockets))
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use std::net::UdpSocket;
+
+    #[tokio::test]
+    async fn hand_over_sockets() {
+        let path = std::env::temp_dir().join(format!("statsrelay-handoff-{}", std::process::id()));
+        let path = path.to_str().unwrap().to_owned();
+        let old = Registry::default();
+        let udp = UdpSocket::bind("127.0.0.1:0").unwrap();
+        old.server("main").serve(Kind::Udp, &udp).unwrap();
+        let handoff = old.clone();
+        let serve_path = path.clone();
+        let serving = tokio::spawn(async move { serve(&serve_path, &handoff).await });
+        while std::fs::metadata(&path).is_err() {
+            tokio::time::sleep(Duration::from_millis(1)).await;
+        }
+
+        let new = Registry::default();
+        let inherit_path = path.clone();
+        let inherit_registry = new.clone();
+        let predecessor = tokio::task::spawn_blocking(move || {
+            inherit(&inherit_path, &inherit_registry).unwrap().unwrap()
+        })
+        .await
+        .unwrap();
+        let socket: UdpSocket = new.server("main").inherit(Kind::Udp).unwrap();
+        assert_eq!(socket.local_addr().unwrap(), udp.local_addr().unwrap());
+        assert!(new.server("main").inherit::<UdpSocket>(Kind::Tcp).is_none());
+        assert!(!old.handed_off());
+
+        predecessor.ready().unwrap();
+        serving.await.unwrap().unwrap();
+        assert!(old.handed_off());
+        std::fs::remove_file(&path).unwrap();
+        // Without a process listening there is nothing to inherit
+        assert!(inherit(&path, &Registry::default()).unwrap().is_none());
+    }
+
+    #[test]
+    fn silent_predecessor() {
+        let path =
+            std::env::temp_dir().join(format!("statsrelay-handoff-silent-{}", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+        // Accepts connections, but never hands anything over
+        let _listener = std::os::unix::net::UnixListener::bind(&path).unwrap();
+        let path = path.to_str().unwrap().to_owned();
+        let registry = Registry::default();
+        let e = inherit_within(&path, &registry, Duration::from_millis(50))
+            .err()
+            .unwrap();
+        assert_eq!(e.kind(), ErrorKind::TimedOut);
+        assert!(registry.inner.lock().inherited.is_empty());
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -2,8 +2,14 @@ pub mod admin;
 pub mod backends;
 pub mod config;
 pub mod cuckoofilter;
+pub mod datagram;
 pub mod discovery;
+pub mod handoff;
+pub mod overload;
 pub mod processors;
+pub mod prometheus_proto;
+pub mod prometheus_server;
+pub mod ratelimit;
 pub mod shard;
 pub mod stats;
 pub mod statsd_backend;
@@ -0,0 +1,235 @@
+//! Load shedding for the statsd servers.
+//!
+//! A [`Controller`](Controller) turns how full the backend send queues are,
+//! and how late the event loops run, into a shed level: the fraction of
+//! incoming lines the servers drop right after parsing, before processors or
+//! backends spend any work on them. Lines matching the protected patterns are
+//! never shed. The level rises quickly while the relay is overloaded and
+//! falls back slowly once it recovers, so shedding settles near the rate the
+//! backends keep up with instead of flapping.
+
+use regex::bytes::RegexSet;
+use stream_cancel::Tripwire;
+
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering::Relaxed;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use log::info;
+
+use crate::backends::Backends;
+use crate::config::OverloadConfig;
+use crate::stats;
+use crate::statsd_proto::Event;
+
+const EVALUATE_INTERVAL: Duration = Duration::from_millis(100);
+const PROBE_INTERVAL: Duration = Duration::from_millis(10);
+/// Shed level added per evaluation while overloaded
+const RAISE_STEP: f64 = 0.1;
+/// Shed level removed per evaluation otherwise
+const LOWER_STEP: f64 = 0.02;
+
+const QUEUE_FILL: f64 = 0.8;
+const LOOP_LAG_MS: u64 = 100;
+
+pub struct Controller {
+    queue_fill: f64,
+    loop_lag: Duration,
+    max_shed: f64,
+    protect: Option<RegexSet>,
+    /// Bits of the current shed level
+    level: AtomicU64,
+    /// Largest lag in microseconds seen by any probe since the last
+    /// evaluation
+    lag: AtomicU64,
+    shed_lines: stats::Counter,
+    level_gauge: stats::Gauge,
+    queue_fill_gauge: stats::Gauge,
+    loop_lag_gauge: stats::Gauge,
+}
+
+impl Controller {
+    pub fn new(stats: stats::Scope, config: &OverloadConfig) -> anyhow::Result<Self> {
+        let protect = if config.protect.is_empty() {
+            None
+        } else {
+            Some(RegexSet::new(&config.protect)?)
+        };
+        Ok(Controller {
+            queue_fill: config.queue_fill.unwrap_or(QUEUE_FILL),
+            loop_lag: Duration::from_millis(config.loop_lag_ms.unwrap_or(LOOP_LAG_MS)),
+            max_shed: config.max_shed.unwrap_or(1.0).max(0.0).min(1.0),
+            protect,
+            level: AtomicU64::new(0_f64.to_bits()),
+            lag: AtomicU64::new(0),
+            shed_lines: stats.counter("shed_lines").unwrap(),
+            level_gauge: stats.gauge("shed_level").unwrap(),
+            queue_fill_gauge: stats.gauge("queue_fill").unwrap(),
+            loop_lag_gauge: stats.gauge("loop_lag_ms").unwrap(),
+        })
+    }
+
+    /// Fraction of the unprotected lines currently shed
+    pub fn level(&self) -> f64 {
+        f64::from_bits(self.level.load(Relaxed))
+    }
+
+    fn protected(&self, event: &Event) -> bool {
+        match (event, self.protect.as_ref()) {
+            (Event::Pdu(pdu), Some(protect)) => protect.is_match(pdu.name()),
+            (Event::Pdu(_), None) => false,
+            // Only processors produce parsed events, which have been paid for
+            (Event::Parsed(_), _) => true,
+        }
+    }
+
+    /// Drop the current level's worth of the unprotected events
+    pub fn shed(&self, events: &mut Vec<Event>) {
+        let level = self.level();
+        if level <= 0.0 {
+            return;
+        }
+        let before = events.len();
+        events.retain(|event| self.protected(event) || fastrand::f64() >= level);
+        self.shed_lines.inc_by((before - events.len()) as f64);
+    }
+
+    fn record_lag(&self, lag: Duration) {
+        self.lag.fetch_max(lag.as_micros() as u64, Relaxed);
+    }
+
+    /// Fold the fill of the fullest send queue and the lag recorded since
+    /// the last evaluation into the shed level, returning the new level
+    pub fn evaluate(&self, queue_fill: f64) -> f64 {
+        let lag = Duration::from_micros(self.lag.swap(0, Relaxed));
+        let overloaded = queue_fill >= self.queue_fill || lag >= self.loop_lag;
+        let previous = self.level();
+        let level = if overloaded {
+            (previous + RAISE_STEP).min(self.max_shed)
+        } else {
+            (previous - LOWER_STEP).max(0.0)
+        };
+        self.level.store(level.to_bits(), Relaxed);
+        if previous == 0.0 && level > 0.0 {
+            info!(
+                "overloaded, shedding lines (queue fill {:.2}, loop lag {:?})",
+                queue_fill, lag
+            );
+        } else if previous > 0.0 && level == 0.0 {
+            info!("recovered from overload, no longer shedding lines");
+        }
+        self.level_gauge.set(level);
+        self.queue_fill_gauge.set(queue_fill);
+        self.loop_lag_gauge.set(lag.as_secs_f64() * 1000.0);
+        level
+    }
+}
+
+/// Measure how late the current runtime wakes a sleeping task, until
+/// shutdown. Run one probe on every runtime serving statsd.
+pub async fn lag_probe(tripwire: Tripwire, controller: Arc<Controller>) {
+    loop {
+        let start = Instant::now();
+        tokio::select! {
+            _ = tripwire.clone() => return,
+            _ = tokio::time::sleep(PROBE_INTERVAL) => {
+                controller.record_lag(start.elapsed().saturating_sub(PROBE_INTERVAL));
+            }
+        }
+    }
+}
+
+/// Evaluate the controller against the send queues of the given backends
+/// until shutdown
+pub async fn monitor(tripwire: Tripwire, controller: Arc<Controller>, backends: Vec<Backends>) {
+    let mut ticker = tokio::time::interval(EVALUATE_INTERVAL);
+    loop {
+        tokio::select! {
+            _ = tripwire.clone() => return,
+            _ = ticker.tick() => {
+                let fill = backends
+                    .iter()
+                    .map(|backends| backends.queue_fill())
+                    .fold(0.0, f64::max);
+                controller.evaluate(fill);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use crate::statsd_proto::Pdu;
+
+    fn events(name: &'static str, count: usize) -> Vec<Event> {
+        (0..count)
+            .map(|_| {
+                let line = bytes::Bytes::from(format!("{}:1|c", name));
+                Event::Pdu(Pdu::parse(line).unwrap())
+            })
+            .collect()
+    }
+
+    #[test]
+    fn shed_under_pressure() {
+        let controller = Controller::new(
+            stats::Collector::default().scope("test"),
+            &OverloadConfig {
+                queue_fill: Some(0.5),
+                loop_lag_ms: None,
+                protect: vec!["^critical\\.".to_owned()],
+                max_shed: None,
+            },
+        )
+        .unwrap();
+        let mut low = events("debug.requests", 1000);
+        controller.shed(&mut low);
+        assert_eq!(low.len(), 1000);
+
+        // Pressure raises the level a step at a time up to everything
+        for _ in 0..20 {
+            controller.evaluate(0.9);
+        }
+        assert_eq!(controller.level(), 1.0);
+        controller.shed(&mut low);
+        assert!(low.is_empty());
+        let mut protected = events("critical.requests", 1000);
+        controller.shed(&mut protected);
+        assert_eq!(protected.len(), 1000);
+
+        // And it recovers slower than it rose
+        controller.evaluate(0.1);
+        assert!(controller.level() > 0.9);
+        let mut low = events("debug.requests", 1000);
+        controller.shed(&mut low);
+        assert!(low.len() < 300);
+        for _ in 0..100 {
+            controller.evaluate(0.1);
+        }
+        assert_eq!(controller.level(), 0.0);
+    }
+
+    #[test]
+    fn lag_counts_as_pressure() {
+        let controller = Controller::new(
+            stats::Collector::default().scope("test"),
+            &OverloadConfig {
+                queue_fill: None,
+                loop_lag_ms: Some(50),
+                protect: Vec::new(),
+                max_shed: Some(0.5),
+            },
+        )
+        .unwrap();
+        for _ in 0..10 {
+            controller.record_lag(Duration::from_millis(80));
+            controller.evaluate(0.0);
+        }
+        assert_eq!(controller.level(), 0.5);
+        // Lag is only counted in the evaluation after it was recorded
+        controller.evaluate(0.0);
+        assert!(controller.level() < 0.5);
+    }
+}
@@ -1,5 +1,7 @@
+use std::any::Any;
 use std::convert::TryInto;
 use std::hash::{Hash, Hasher};
+use std::sync::Arc;
 use std::time::{Duration, SystemTime};
 
 use super::super::config;
@@ -15,7 +17,7 @@ use crate::cuckoofilter::{self, CuckooFilter};
 use ahash::AHasher;
 use parking_lot::Mutex;
 
-use log::warn;
+use log::{info, warn};
 
 struct TimeBoundedCuckoo<H>
 where
@@ -97,7 +99,8 @@ where
 
 pub struct Cardinality {
     route: Vec<config::Route>,
-    filter: Mutex<MultiCuckoo<AHasher>>,
+    /// Shared so that the filters can be handed over on a reload
+    filter: Arc<Mutex<MultiCuckoo<AHasher>>>,
     limit: usize,
     counter_flagged_metrics: Counter,
     gauge_metric_hwm: Gauge,
@@ -111,7 +114,7 @@ impl Cardinality {
         limit_gauge.set(from_config.size_limit as f64);
         Cardinality {
             route: from_config.route.clone(),
-            filter: Mutex::new(MultiCuckoo::new(from_config.buckets, &window)),
+            filter: Arc::new(Mutex::new(MultiCuckoo::new(from_config.buckets, &window))),
             limit: from_config.size_limit as usize,
             counter_flagged_metrics: scope.counter("flagged_metrics").unwrap(),
             gauge_metric_hwm: scope.gauge("count_hwm").unwrap(),
@@ -149,6 +152,28 @@ impl Processor for Cardinality {
     fn tick(&self, _time: std::time::SystemTime, _backends: &Backends) {
         self.rotate();
     }
+
+    fn take_state(&self) -> Option<Box<dyn Any + Send>> {
+        Some(Box::new(self.filter.clone()))
+    }
+
+    /// Keep the filters of the replaced processor when they rotate the same
+    /// way, so that metrics already seen stay admitted. The limit may change
+    /// freely.
+    fn adopt_state(&self, state: Box<dyn Any + Send>) {
+        let previous = match state.downcast::<Arc<Mutex<MultiCuckoo<AHasher>>>>() {
+            Ok(previous) => previous,
+            Err(_) => return,
+        };
+        let mut previous = previous.lock();
+        let mut filter = self.filter.lock();
+        if previous.buckets != filter.buckets || previous.window != filter.window {
+            info!("cardinality windows changed, starting with empty filters");
+            return;
+        }
+        // Metrics first seen since the swap are seen again soon enough
+        std::mem::swap(&mut *filter, &mut *previous);
+    }
 }
 
 #[cfg(test)]
@@ -243,4 +268,63 @@ pub mod test {
             filter.counter_flagged_metrics.get()
         );
     }
+
+    #[test]
+    fn test_cardinality_limit_tags() {
+        let config = config::processor::Cardinality {
+            size_limit: 0_usize,
+            rotate_after_seconds: 10,
+            buckets: 2,
+            route: vec![],
+        };
+        let scope = crate::stats::Collector::default().scope("test");
+        let filter = Cardinality::new(scope, &config);
+        let pdu = |line: &'static [u8]| {
+            Event::Pdu(crate::statsd_proto::Pdu::parse(bytes::Bytes::from_static(line)).unwrap())
+        };
+
+        assert!(filter
+            .provide_statsd(&pdu(b"metric:1|c|#host:a,az:1"))
+            .is_some());
+        // Same series with tags reordered, or in parsed form, is not new
+        assert!(filter
+            .provide_statsd(&pdu(b"metric:2|c|#az:1,host:a"))
+            .is_some());
+        let owned: Owned = (&pdu(b"metric:3|c|#host:a,az:1")).try_into().unwrap();
+        assert!(filter.provide_statsd(&Event::Parsed(owned)).is_some());
+        // Differing only by a tag value is a new series, over the limit
+        assert!(filter
+            .provide_statsd(&pdu(b"metric:1|c|#host:b,az:1"))
+            .is_none());
+    }
+
+    #[test]
+    fn test_cardinality_handoff() {
+        let make = |size_limit, buckets| {
+            let config = config::processor::Cardinality {
+                size_limit,
+                rotate_after_seconds: 10,
+                buckets,
+                route: vec![],
+            };
+            Cardinality::new(crate::stats::Collector::default().scope("test"), &config)
+        };
+        let pdu = |line: &'static [u8]| {
+            Event::Pdu(crate::statsd_proto::Pdu::parse(bytes::Bytes::from_static(line)).unwrap())
+        };
+        let previous = make(10, 2);
+        assert!(previous.provide_statsd(&pdu(b"seen:1|c")).is_some());
+
+        // A replacement with a lower limit still admits what was seen
+        let replacement = make(0, 2);
+        replacement.adopt_state(previous.take_state().unwrap());
+        assert!(replacement.provide_statsd(&pdu(b"seen:1|c")).is_some());
+        assert!(replacement.provide_statsd(&pdu(b"new:1|c")).is_none());
+
+        // Unless its filters rotate differently
+        let rebucketed = make(0, 3);
+        rebucketed.adopt_state(replacement.take_state().unwrap());
+        assert!(rebucketed.provide_statsd(&pdu(b"other:1|c")).is_some());
+        assert!(rebucketed.provide_statsd(&pdu(b"seen:1|c")).is_none());
+    }
 }
@@ -2,8 +2,10 @@ use super::backends::Backends;
 use crate::config;
 use crate::statsd_proto::Event;
 use smallvec::SmallVec;
+use std::any::Any;
 
 pub mod cardinality;
+pub mod prometheus_exporter;
 pub mod regex_filter;
 pub mod sampler;
 pub mod tag;
@@ -21,5 +23,18 @@ pub trait Processor {
     /// Backends structure is provided to re-inject messages into processor
     /// framework if desired.
     fn tick(&self, _time: std::time::SystemTime, _backends: &Backends) {}
+    /// Emit anything held back for a later tick right away, ignoring the
+    /// schedule, and return once it has been handed to the backends. Called
+    /// on shutdown.
+    fn flush(&self, _backends: &Backends) {}
     fn provide_statsd(&self, sample: &Event) -> Option<Output>;
+    /// Take the state worth keeping out of a processor which a configuration
+    /// reload replaced, for its replacement to adopt.
+    fn take_state(&self) -> Option<Box<dyn Any + Send>> {
+        None
+    }
+    /// Adopt the state taken from the processor this one replaced, merging
+    /// it with anything recorded since. State of another kind of processor,
+    /// or which doesn't fit the new configuration, is dropped.
+    fn adopt_state(&self, _state: Box<dyn Any + Send>) {}
 }
@@ -0,0 +1,568 @@
+use super::{Output, Processor};
+use crate::backends::Backends;
+use crate::config;
+use crate::stats;
+use crate::statsd_proto::{write_number, Event, Id, Owned, Parsed, Type};
+
+use ahash::RandomState;
+use anyhow::Context;
+use parking_lot::Mutex;
+use smallvec::SmallVec;
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::hash::{BuildHasher, Hash, Hasher};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+const SHARDS: usize = 16;
+
+/// Prometheus metric kind a statsd type is exported as
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Kind {
+    Counter,
+    Gauge,
+    Summary,
+}
+
+impl Kind {
+    fn from_type(mtype: &Type) -> Option<Self> {
+        match mtype {
+            Type::Counter => Some(Kind::Counter),
+            Type::Gauge | Type::DirectGauge => Some(Kind::Gauge),
+            Type::Timer => Some(Kind::Summary),
+            Type::Set => None,
+        }
+    }
+
+    fn as_bytes(&self) -> &'static [u8] {
+        match self {
+            Kind::Counter => b"counter",
+            Kind::Gauge => b"gauge",
+            Kind::Summary => b"summary",
+        }
+    }
+}
+
+#[derive(Debug)]
+enum Value {
+    Counter(f64),
+    Gauge(f64),
+    Summary { count: f64, sum: f64 },
+}
+
+impl Value {
+    fn new(kind: Kind) -> Self {
+        match kind {
+            Kind::Counter => Value::Counter(0_f64),
+            Kind::Gauge => Value::Gauge(0_f64),
+            Kind::Summary => Value::Summary {
+                count: 0_f64,
+                sum: 0_f64,
+            },
+        }
+    }
+
+    fn record(&mut self, owned: &Owned) {
+        // Sampled counters and timers stand in for 1 / rate events
+        let weight = match owned.sample_rate() {
+            Some(rate) if rate > 0_f64 && rate <= 1_f64 => 1_f64 / rate,
+            _ => 1_f64,
+        };
+        match self {
+            Value::Counter(total) => *total += owned.value() * weight,
+            Value::Gauge(value) if owned.is_relative() => *value += owned.value(),
+            Value::Gauge(value) => *value = owned.value(),
+            Value::Summary { count, sum } => {
+                *count += weight;
+                *sum += owned.value() * weight;
+            }
+        }
+    }
+}
+
+/// One labelled series of a metric family, with its label set encoded once
+/// and its sample lines re-encoded only after its value changes.
+#[derive(Debug)]
+struct Series {
+    value: Value,
+    labels: Vec<u8>,
+    encoded: Vec<u8>,
+    dirty: bool,
+    updated: u64,
+}
+
+impl Series {
+    fn encode(&mut self, name: &[u8]) {
+        self.encoded.clear();
+        match self.value {
+            Value::Counter(value) | Value::Gauge(value) => {
+                write_sample(&mut self.encoded, name, b"", &self.labels, value)
+            }
+            Value::Summary { count, sum } => {
+                write_sample(&mut self.encoded, name, b"_sum", &self.labels, sum);
+                write_sample(&mut self.encoded, name, b"_count", &self.labels, count);
+            }
+        }
+        self.dirty = false;
+    }
+}
+
+fn write_sample(out: &mut Vec<u8>, name: &[u8], suffix: &[u8], labels: &[u8], value: f64) {
+    out.extend_from_slice(name);
+    out.extend_from_slice(suffix);
+    out.extend_from_slice(labels);
+    out.push(b' ');
+    write_number(out, value);
+    out.push(b'\n');
+}
+
+/// All series sharing a metric name, which Prometheus requires to be exposed
+/// as one contiguous block under a single type line.
+#[derive(Debug)]
+struct Family {
+    kind: Kind,
+    name: Vec<u8>,
+    series: HashMap<u64, Series, RandomState>,
+    block: Vec<u8>,
+    dirty: bool,
+}
+
+impl Family {
+    fn encode(&mut self) -> &[u8] {
+        if self.dirty {
+            self.block.clear();
+            self.block.extend_from_slice(b"# TYPE ");
+            self.block.extend_from_slice(&self.name);
+            self.block.push(b' ');
+            self.block.extend_from_slice(self.kind.as_bytes());
+            self.block.push(b'\n');
+            for series in self.series.values_mut() {
+                if series.dirty {
+                    series.encode(&self.name);
+                }
+                self.block.extend_from_slice(&series.encoded);
+            }
+            self.dirty = false;
+        }
+        &self.block
+    }
+}
+
+/// Replace characters which are not valid in a Prometheus metric or label
+/// name with underscores.
+fn sanitize_name<E: Extend<u8>>(out: &mut E, name: &[u8], allow_colon: bool) {
+    if let Some(b'0'..=b'9') = name.first() {
+        out.extend(Some(b'_'));
+    }
+    out.extend(name.iter().map(|b| match b {
+        b'a'..=b'z' | b'A'..=b'Z' | b'0'..=b'9' | b'_' => *b,
+        b':' if allow_colon => b':',
+        _ => b'_',
+    }));
+}
+
+type Labels = SmallVec<[u8; 256]>;
+
+/// Encode a label set, sorted by label name so that the same tags written in
+/// a different order share a series. Tags whose names sanitize to the same
+/// label name would make the series invalid, so only the first of them by
+/// value is kept.
+fn encode_labels(id: &Id, out: &mut Labels) {
+    if id.tags.is_empty() {
+        return;
+    }
+    let mut tags: SmallVec<[(SmallVec<[u8; 32]>, &[u8]); 8]> = id
+        .tags
+        .iter()
+        .map(|tag| {
+            let mut name = SmallVec::new();
+            sanitize_name(&mut name, &tag.name, false);
+            (name, tag.value.as_slice())
+        })
+        .collect();
+    tags.sort_unstable();
+    tags.dedup_by(|later, first| later.0 == first.0);
+    out.push(b'{');
+    for (i, (name, value)) in tags.iter().enumerate() {
+        if i > 0 {
+            out.push(b',');
+        }
+        out.extend_from_slice(name);
+        out.extend_from_slice(b"=\"");
+        for b in value.iter() {
+            match b {
+                b'\\' => out.extend_from_slice(b"\\\\"),
+                b'"' => out.extend_from_slice(b"\\\""),
+                b'\n' => out.extend_from_slice(b"\\n"),
+                _ => out.push(*b),
+            }
+        }
+        out.push(b'"');
+    }
+    out.push(b'}');
+}
+
+type Shard = Mutex<RefCell<HashMap<Vec<u8>, Family, RandomState>>>;
+
+struct State {
+    shards: Vec<Shard>,
+    hasher: RandomState,
+    /// Seconds since the epoch as of the last tick, stamped on updated series
+    now: AtomicU64,
+    expire_after: Option<u64>,
+    series_count: AtomicUsize,
+    series: stats::Gauge,
+    type_conflicts: stats::Counter,
+    unsupported: stats::Counter,
+    invalid: stats::Counter,
+}
+
+impl State {
+    fn record(&self, owned: &Owned) {
+        let id = owned.id();
+        let kind = match Kind::from_type(&id.mtype) {
+            Some(kind) => kind,
+            None => {
+                self.unsupported.inc();
+                return;
+            }
+        };
+        // Families and series are keyed by what they are exposed as, so
+        // statsd names and tags which sanitize alike share them
+        let mut name: SmallVec<[u8; 128]> = SmallVec::new();
+        sanitize_name(&mut name, &id.name, true);
+        let mut hasher = self.hasher.build_hasher();
+        name.hash(&mut hasher);
+        let shard = &self.shards[hasher.finish() as usize % SHARDS];
+        let mut labels = Labels::new();
+        encode_labels(id, &mut labels);
+        let mut series_hasher = self.hasher.build_hasher();
+        labels.hash(&mut series_hasher);
+        let series_key = series_hasher.finish();
+
+        let lock = shard.lock();
+        let mut families = lock.borrow_mut();
+        let family = match families.get_mut(name.as_slice()) {
+            Some(family) => family,
+            None => families.entry(name.to_vec()).or_insert(Family {
+                kind,
+                name: name.to_vec(),
+                series: HashMap::with_hasher(self.hasher.clone()),
+                block: Vec::new(),
+                dirty: true,
+            }),
+        };
+        if family.kind != kind {
+            self.type_conflicts.inc();
+            return;
+        }
+        let series = family.series.entry(series_key).or_insert_with(|| {
+            let count = self.series_count.fetch_add(1, Ordering::Relaxed) + 1;
+            self.series.set(count as f64);
+            Series {
+                value: Value::new(kind),
+                labels: labels.to_vec(),
+                encoded: Vec::new(),
+                dirty: true,
+                updated: 0,
+            }
+        });
+        series.value.record(owned);
+        series.dirty = true;
+        series.updated = self.now.load(Ordering::Relaxed);
+        family.dirty = true;
+    }
+
+    /// Render the text exposition of every series, re-encoding only families
+    /// which changed since the last render.
+    fn render(&self) -> Vec<u8> {
+        let mut out = Vec::new();
+        for shard in self.shards.iter() {
+            let lock = shard.lock();
+            let mut families = lock.borrow_mut();
+            for family in families.values_mut() {
+                out.extend_from_slice(family.encode());
+            }
+        }
+        out
+    }
+
+    fn expire(&self, now: u64) {
+        let expire_after = match self.expire_after {
+            None => return,
+            Some(expire_after) => expire_after,
+        };
+        let mut removed = 0;
+        for shard in self.shards.iter() {
+            let lock = shard.lock();
+            let mut families = lock.borrow_mut();
+            families.retain(|_, family| {
+                let before = family.series.len();
+                family
+                    .series
+                    .retain(|_, series| now.saturating_sub(series.updated) < expire_after);
+                if family.series.len() != before {
+                    removed += before - family.series.len();
+                    family.dirty = true;
+                }
+                !family.series.is_empty()
+            });
+        }
+        if removed > 0 {
+            let count = self.series_count.fetch_sub(removed, Ordering::Relaxed) - removed;
+            self.series.set(count as f64);
+        }
+    }
+}
+
+/// Keeps the running state of every counter, gauge and timer it is given, and
+/// serves it in the Prometheus text exposition format on `/metrics`.
+///
+/// Counters are exported as monotonic totals, gauges as their last value and
+/// timers as summaries of their count and sum. Sets are not exported.
+pub struct Exporter {
+    state: Arc<State>,
+    route: Vec<config::Route>,
+}
+
+impl Exporter {
+    pub fn new(
+        scope: stats::Scope,
+        config: &config::processor::PrometheusExporter,
+    ) -> anyhow::Result<Self> {
+        let listener = std::net::TcpListener::bind(config.bind.as_str())
+            .with_context(|| format!("can't serve prometheus metrics on {}", config.bind))?;
+        Self::with_listener(scope, config, listener)
+    }
+
+    /// Build an exporter serving on a listener already bound to its address,
+    /// such as one inherited from a previous process
+    pub fn with_listener(
+        scope: stats::Scope,
+        config: &config::processor::PrometheusExporter,
+        listener: std::net::TcpListener,
+    ) -> anyhow::Result<Self> {
+        let state = Arc::new(State {
+            shards: (0..SHARDS)
+                .map(|_| Mutex::new(RefCell::new(HashMap::with_hasher(RandomState::new()))))
+                .collect(),
+            hasher: RandomState::new(),
+            now: AtomicU64::new(epoch_secs(SystemTime::now())),
+            expire_after: config.expire_after_seconds,
+            series_count: AtomicUsize::new(0),
+            series: scope.gauge("series").unwrap(),
+            type_conflicts: scope.counter("type_conflicts").unwrap(),
+            unsupported: scope.counter("unsupported").unwrap(),
+            invalid: scope.counter("invalid").unwrap(),
+        });
+        let render_state = state.clone();
+        crate::admin::spawn_metrics_server(listener, move || render_state.render())
+            .with_context(|| format!("can't serve prometheus metrics on {}", config.bind))?;
+        Ok(Exporter {
+            state,
+            route: config.route.clone(),
+        })
+    }
+}
+
+fn epoch_secs(time: SystemTime) -> u64 {
+    time.duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs())
+        .unwrap_or_default()
+}
+
+impl Processor for Exporter {
+    fn tick(&self, time: SystemTime, _backends: &Backends) {
+        let now = epoch_secs(time);
+        self.state.now.store(now, Ordering::Relaxed);
+        self.state.expire(now);
+    }
+
+    fn provide_statsd(&self, sample: &Event) -> Option<Output> {
+        match sample {
+            // Set members are not numbers, so don't bother parsing them
+            Event::Pdu(pdu) if pdu.pdu_type() == b"s" => self.state.unsupported.inc(),
+            _ => match sample.try_into() {
+                Ok(owned) => self.state.record(&owned),
+                Err(_) => self.state.invalid.inc(),
+            },
+        }
+        if self.route.is_empty() {
+            None
+        } else {
+            Some(Output {
+                new_events: None,
+                route: self.route.as_ref(),
+            })
+        }
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use crate::handoff;
+    use crate::statsd_proto::Pdu;
+    use bytes::Bytes;
+
+    fn make_exporter(expire_after_seconds: Option<u64>) -> Exporter {
+        let scope = crate::stats::Collector::default().scope("prefix");
+        let config = config::processor::PrometheusExporter {
+            bind: "127.0.0.1:0".to_owned(),
+            expire_after_seconds,
+            route: vec![],
+        };
+        Exporter::new(scope, &config).unwrap()
+    }
+
+    #[tokio::test]
+    async fn handoff_listener() {
+        let path = std::env::temp_dir().join(format!(
+            "statsrelay-exporter-handoff-{}",
+            std::process::id()
+        ));
+        let path = path.to_str().unwrap().to_owned();
+        let scope = crate::stats::Collector::default().scope("prefix");
+
+        // A running process with an exporter, serving handoffs
+        let old = handoff::Registry::default();
+        let listener =
+            handoff::listen_http(Some(&old), "prometheus_exporter:export", "127.0.0.1:0").unwrap();
+        let config = config::processor::PrometheusExporter {
+            bind: listener.local_addr().unwrap().to_string(),
+            expire_after_seconds: None,
+            route: vec![],
+        };
+        let _running = Exporter::with_listener(scope.clone(), &config, listener).unwrap();
+        let handoff = old.clone();
+        let serve_path = path.clone();
+        let serving = tokio::spawn(async move { handoff::serve(&serve_path, &handoff).await });
+        while std::fs::metadata(&path).is_err() {
+            tokio::time::sleep(std::time::Duration::from_millis(1)).await;
+        }
+
+        // Its address is still bound, so a new process can only serve it on
+        // the inherited listener
+        assert!(Exporter::new(scope.clone(), &config).is_err());
+        let new = handoff::Registry::default();
+        let inherit_path = path.clone();
+        let inherit_registry = new.clone();
+        let predecessor = tokio::task::spawn_blocking(move || {
+            handoff::inherit(&inherit_path, &inherit_registry)
+                .unwrap()
+                .unwrap()
+        })
+        .await
+        .unwrap();
+        let listener =
+            handoff::listen_http(Some(&new), "prometheus_exporter:export", &config.bind).unwrap();
+        assert_eq!(listener.local_addr().unwrap().to_string(), config.bind);
+        let _replacement = Exporter::with_listener(scope, &config, listener).unwrap();
+        std::net::TcpStream::connect(&config.bind).unwrap();
+
+        predecessor.ready().unwrap();
+        serving.await.unwrap().unwrap();
+        assert!(old.handed_off());
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    fn record(exporter: &Exporter, line: &'static [u8]) {
+        let pdu = Pdu::parse(Bytes::from_static(line)).unwrap();
+        assert!(exporter.provide_statsd(&Event::Pdu(pdu)).is_none());
+    }
+
+    fn render(exporter: &Exporter) -> String {
+        String::from_utf8(exporter.state.render()).unwrap()
+    }
+
+    #[test]
+    fn export_kinds() {
+        let exporter = make_exporter(None);
+        record(&exporter, b"requests.count:1|c|#code:200,method:get");
+        record(&exporter, b"requests.count:2|c|@0.5|#method:get,code:200");
+        record(&exporter, b"queue-depth:7|g");
+        record(&exporter, b"queue-depth:-2|g");
+        record(&exporter, b"latency:10|ms");
+        record(&exporter, b"latency:30|ms");
+        record(&exporter, b"users:alice|s");
+
+        let output = render(&exporter);
+        assert!(output.contains(
+            "# TYPE requests_count counter\nrequests_count{code=\"200\",method=\"get\"} 5\n"
+        ));
+        assert!(output.contains("# TYPE queue_depth gauge\nqueue_depth 5\n"));
+        assert!(output.contains("# TYPE latency summary\nlatency_sum 40\nlatency_count 2\n"));
+        assert!(!output.contains("users"));
+        assert_eq!(exporter.state.series.get(), 3_f64);
+        assert_eq!(exporter.state.unsupported.get(), 1_f64);
+    }
+
+    #[test]
+    fn incremental_render() {
+        let exporter = make_exporter(None);
+        record(&exporter, b"a:1|c|#x:\"y\"");
+        record(&exporter, b"b:1|c");
+        let first = render(&exporter);
+        assert!(first.contains("a{x=\"\\\"y\\\"\"} 1\n"));
+        assert_eq!(render(&exporter), first);
+        assert!(exporter.state.shards.iter().all(|shard| shard
+            .lock()
+            .borrow()
+            .values()
+            .all(|family| !family.dirty)));
+
+        record(&exporter, b"b:2|c");
+        let second = render(&exporter);
+        assert!(second.contains("b 3\n"));
+        assert!(second.contains("a{x=\"\\\"y\\\"\"} 1\n"));
+    }
+
+    #[test]
+    fn type_conflicts() {
+        let exporter = make_exporter(None);
+        record(&exporter, b"a:1|c");
+        record(&exporter, b"a:1|g");
+        assert_eq!(exporter.state.type_conflicts.get(), 1_f64);
+        assert!(render(&exporter).contains("# TYPE a counter\na 1\n"));
+    }
+
+    #[test]
+    fn sanitized_collisions() {
+        let exporter = make_exporter(None);
+        // Names exposed alike share a family, even across kinds
+        record(&exporter, b"queue-depth:1|c");
+        record(&exporter, b"queue_depth:2|c");
+        record(&exporter, b"queue.depth:1|g");
+        // Labels exposed alike share a series, and collide at most once
+        record(&exporter, b"hits:1|c|#a.b:1,a_b:2");
+        record(&exporter, b"hits:1|c|#a_b:1,a-b:3");
+
+        let output = render(&exporter);
+        assert_eq!(output.matches("# TYPE queue_depth").count(), 1);
+        assert!(output.contains("# TYPE queue_depth counter\nqueue_depth 3\n"));
+        assert_eq!(exporter.state.type_conflicts.get(), 1_f64);
+        assert!(output.contains("# TYPE hits counter\nhits{a_b=\"1\"} 2\n"));
+        assert_eq!(exporter.state.series.get(), 2_f64);
+    }
+
+    #[test]
+    fn expire_series() {
+        let exporter = make_exporter(Some(60));
+        let backends = Backends::new(crate::stats::Collector::default().scope("prefix"));
+        let start = SystemTime::now();
+        exporter.tick(start, &backends);
+        record(&exporter, b"old:1|c");
+        record(&exporter, b"kept:1|c|#a:b");
+        exporter.tick(start + std::time::Duration::from_secs(30), &backends);
+        record(&exporter, b"kept:1|c|#a:b");
+        exporter.tick(start + std::time::Duration::from_secs(61), &backends);
+
+        let output = render(&exporter);
+        assert!(!output.contains("old"));
+        assert!(output.contains("kept{a=\"b\"} 2\n"));
+        assert_eq!(exporter.state.series.get(), 1_f64);
+    }
+}
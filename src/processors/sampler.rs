@@ -1,34 +1,86 @@
 use super::Output;
 use crate::backends::Backends;
 use crate::processors;
+use crate::stats;
 use crate::statsd_proto::Id;
-use crate::statsd_proto::{Event, Owned, Type};
+use crate::statsd_proto::{write_number, Event, Owned, Type, MAX_NUMBER_LENGTH};
 use crate::{config, statsd_proto::Parsed};
 
 use ahash::RandomState;
-use parking_lot::Mutex;
+use hyperloglog::HyperLogLog;
+use parking_lot::{Condvar, Mutex};
+use std::any::Any;
 use std::cell::RefCell;
 use thiserror::Error;
 
 use std::collections::HashMap;
 use std::convert::TryInto;
+use std::fmt;
+use std::hash::Hash;
+use std::io::Cursor;
+use std::panic::AssertUnwindSafe;
+use std::sync::{mpsc, Arc};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use log::warn;
 
 const DEFAULT_RESERVOIR: u32 = 100;
+const DEFAULT_SET_ERROR_RATE: f64 = 0.01;
+const DEFAULT_FLUSH_THREADS: usize = 4;
+const DEFAULT_FLUSH_BATCH_SIZE: usize = 1024;
+// Flush timing histogram buckets, in seconds, from 1ms to ~65s
+const FLUSH_BUCKETS: [f64; 17] = [
+    0.001, 0.002, 0.004, 0.008, 0.016, 0.032, 0.064, 0.128, 0.256, 0.512, 1.024, 2.048, 4.096,
+    8.192, 16.384, 32.768, 65.536,
+];
 
 fn scale(value: f64, sample_rate: Option<f64>) -> (f64, f64) {
     match sample_rate {
         None => (value, 1_f64),
-        Some(rate) => {
+        // A line sampled at a rate stands for 1/rate lines
+        Some(rate) if rate > 0_f64 && rate <= 1_f64 => {
             let scale = 1_f64 / rate;
-            if scale > 0_f64 && scale <= 1_f64 {
-                (value * scale, scale)
-            } else {
-                (value, 1_f64)
-            }
+            (value * scale, scale)
         }
+        Some(_) => (value, 1_f64),
     }
 }
 
+/// Return the first wall-clock boundary strictly after the given time, where
+/// boundaries fall on multiples of the window since the epoch, shifted by the
+/// given offset.
+fn next_boundary(after: SystemTime, window: Duration, offset: Duration) -> SystemTime {
+    let since_epoch = match after.duration_since(UNIX_EPOCH) {
+        Ok(since_epoch) => since_epoch.as_millis(),
+        Err(_) => return after + window,
+    };
+    let window = window.as_millis().max(1);
+    let offset = offset.as_millis() % window;
+    let boundary = if since_epoch < offset {
+        offset
+    } else {
+        ((since_epoch - offset) / window + 1) * window + offset
+    };
+    UNIX_EPOCH + Duration::from_millis(boundary as u64)
+}
+
+/// Derive a stable per-instance flush offset below the configured jitter bound
+/// by hashing the jitter key, or the hostname if none is configured.
+fn instance_offset(config: &config::processor::Sampler) -> Duration {
+    let max = match config.align_jitter_ms {
+        None | Some(0) => return Duration::from_secs(0),
+        Some(max) => max,
+    };
+    let key = config.align_jitter_key.clone().unwrap_or_else(|| {
+        std::fs::read_to_string("/proc/sys/kernel/hostname")
+            .map(|hostname| hostname.trim().to_owned())
+            .or_else(|_| std::env::var("HOSTNAME"))
+            .unwrap_or_default()
+    });
+    let hash = murmur3::murmur3_32(&mut Cursor::new(key.as_bytes()), 0).unwrap_or(0);
+    Duration::from_millis(hash as u64 % max)
+}
+
 #[derive(Error, Debug)]
 pub enum Error {
     #[error("invalid sampler configuration")]
@@ -86,16 +138,277 @@ impl Timer {
         self.sum += sum;
         self.filled_count += 1;
     }
+
+    /// Fold in the timer of an earlier part of the window. Its values only
+    /// fill what room the reservoir has left, while the count and sum stay
+    /// exact.
+    fn merge(&mut self, earlier: Timer) {
+        let room = (self.reservoir_size as usize).saturating_sub(self.values.len());
+        self.values.extend(earlier.values.into_iter().take(room));
+        self.count += earlier.count;
+        self.sum += earlier.sum;
+        self.filled_count += earlier.filled_count;
+    }
 }
 
 #[derive(Debug, Default)]
 struct Gauge {
     value: f64,
+    /// Only relative updates were seen this window, so the value is a delta
+    /// against whatever the downstream gauge holds
+    relative: bool,
 }
 
 impl Gauge {
+    /// Fold in the gauge of an earlier part of the window, which an absolute
+    /// value since overrides
+    fn merge(&mut self, earlier: Gauge) {
+        if self.relative {
+            self.value += earlier.value;
+            self.relative = earlier.relative;
+        }
+    }
+
+    fn add(&mut self, owned: &Owned) {
+        if owned.is_relative() {
+            self.value += owned.value();
+        } else {
+            self.value = owned.value();
+            self.relative = false;
+        }
+    }
+
+    /// Append the gauge's events to the output batch. A signed statsd gauge
+    /// is a relative update, so an absolute value below zero is sent as a
+    /// reset to zero followed by its decrement.
+    fn emit(&self, id: &Id, out: &mut Vec<Event>) {
+        if self.relative {
+            out.push(Event::Parsed(Owned::new_gauge_delta(
+                id.clone(),
+                self.value,
+            )));
+            return;
+        }
+        if self.value.is_sign_negative() {
+            out.push(Event::Parsed(Owned::new(id.clone(), 0_f64, None)));
+        }
+        out.push(Event::Parsed(Owned::new(id.clone(), self.value, None)));
+    }
+}
+
+struct Set {
+    members: HyperLogLog,
+}
+
+impl Set {
+    /// Emit the estimated number of distinct members seen in the window. As
+    /// statsd has no way to carry a sketch, the estimate is sent as a gauge.
     fn to_event(&self, id: &Id) -> Event {
-        Event::Parsed(Owned::new(id.clone(), self.value, None))
+        let id = Id {
+            name: id.name.clone(),
+            mtype: Type::Gauge,
+            tags: id.tags.clone(),
+        };
+        Event::Parsed(Owned::new(id, self.members.len().round(), None))
+    }
+}
+
+impl fmt::Debug for Set {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Set")
+            .field("estimate", &self.members.len())
+            .finish()
+    }
+}
+
+/// A single series' aggregate taken out of the sampler at the end of a window
+#[derive(Debug)]
+enum Aggregate {
+    Counter(Counter),
+    Gauge(Gauge),
+    Timer(Timer),
+    Set(Set),
+}
+
+impl Aggregate {
+    /// Append the events representing this aggregate to the output batch
+    fn emit(self, id: Id, out: &mut Vec<Event>) {
+        match self {
+            Aggregate::Counter(counter) => out.push(counter.to_event(&id)),
+            Aggregate::Gauge(gauge) => gauge.emit(&id, out),
+            Aggregate::Set(set) => out.push(set.to_event(&id)),
+            Aggregate::Timer(timer) => {
+                let sample_rate = timer.values.len() as f64 / timer.count;
+                for value in timer.values {
+                    out.push(Event::Parsed(Owned::new(
+                        id.clone(),
+                        value,
+                        Some(sample_rate),
+                    )));
+                }
+            }
+        }
+    }
+}
+
+/// Emit one partition of a window's aggregates to the backends in batches.
+/// When a smear duration is given, batches are paced so that the partition is
+/// spread evenly over that duration from the start of the flush.
+fn flush_partition(
+    work: Vec<(Id, Aggregate)>,
+    backends: &Backends,
+    route: &[config::Route],
+    batch_size: usize,
+    smear: Duration,
+    start: Instant,
+) {
+    let total = work.len();
+    let mut batch: Vec<Event> = Vec::with_capacity(batch_size);
+    for (done, (id, aggregate)) in work.into_iter().enumerate() {
+        aggregate.emit(id, &mut batch);
+        if batch.len() < batch_size {
+            continue;
+        }
+        backends.provide_statsd_batch(&batch, route);
+        batch.clear();
+        if smear > Duration::from_secs(0) {
+            let deadline = start + smear.mul_f64((done + 1) as f64 / total as f64);
+            let now = Instant::now();
+            if deadline > now {
+                std::thread::sleep(deadline - now);
+            }
+        }
+    }
+    if !batch.is_empty() {
+        backends.provide_statsd_batch(&batch, route);
+    }
+}
+
+type FlushJob = Box<dyn FnOnce() + Send>;
+
+/// Count of the partitions of a flush still being emitted, which later
+/// flushes wait on
+#[derive(Debug, Default)]
+struct Flushing {
+    pending: Mutex<usize>,
+    done: Condvar,
+}
+
+impl Flushing {
+    fn active(&self) -> bool {
+        *self.pending.lock() > 0
+    }
+
+    /// Block until every partition handed out has been emitted
+    fn wait(&self) {
+        let mut pending = self.pending.lock();
+        while *pending > 0 {
+            self.done.wait(&mut pending);
+        }
+    }
+}
+
+/// Marks one partition of a flush emitted when dropped, so a panicking
+/// worker can't leave the sampler waiting on it forever
+struct PartitionDone {
+    flushing: Arc<Flushing>,
+    start: Instant,
+    flush_duration: stats::Histogram,
+}
+
+impl Drop for PartitionDone {
+    fn drop(&mut self) {
+        let mut pending = self.flushing.pending.lock();
+        *pending -= 1;
+        // The last partition out records the duration of the flush
+        if *pending == 0 {
+            self.flush_duration
+                .observe(self.start.elapsed().as_secs_f64());
+            self.flushing.done.notify_all();
+        }
+    }
+}
+
+/// Worker threads emitting flush partitions, started as flushes first need
+/// them and kept for the life of the sampler
+#[derive(Debug)]
+struct FlushPool {
+    jobs: Mutex<mpsc::Sender<FlushJob>>,
+    queue: Arc<Mutex<mpsc::Receiver<FlushJob>>>,
+    workers: Mutex<usize>,
+}
+
+impl FlushPool {
+    fn new() -> Self {
+        let (jobs, queue) = mpsc::channel();
+        FlushPool {
+            jobs: Mutex::new(jobs),
+            queue: Arc::new(Mutex::new(queue)),
+            workers: Mutex::new(0),
+        }
+    }
+
+    /// Start workers up to the given count, returning how many run
+    fn grow(&self, count: usize) -> usize {
+        let mut workers = self.workers.lock();
+        while *workers < count {
+            let queue = self.queue.clone();
+            let spawned = std::thread::Builder::new()
+                .name("sampler-flush".to_owned())
+                .spawn(move || flush_worker(queue));
+            match spawned {
+                Ok(_) => *workers += 1,
+                Err(e) => {
+                    warn!("unable to spawn sampler flush worker {:?}", e);
+                    break;
+                }
+            }
+        }
+        *workers
+    }
+
+    /// Queue a job for the workers, handing it back if none are left
+    fn submit(&self, job: FlushJob) -> Result<(), FlushJob> {
+        self.jobs.lock().send(job).map_err(|e| e.0)
+    }
+}
+
+/// Run flush jobs until the pool is dropped
+fn flush_worker(queue: Arc<Mutex<mpsc::Receiver<FlushJob>>>) {
+    loop {
+        let job = queue.lock().recv();
+        match job {
+            Ok(job) => {
+                if std::panic::catch_unwind(AssertUnwindSafe(job)).is_err() {
+                    warn!("sampler flush worker panicked");
+                }
+            }
+            Err(_) => return,
+        }
+    }
+}
+
+/// The window a sampler replaced by a reload was aggregating, handed to its
+/// replacement
+struct Window {
+    config: config::processor::Sampler,
+    counters: HashMap<Id, Counter, RandomState>,
+    timers: HashMap<Id, Timer, RandomState>,
+    gauges: HashMap<Id, Gauge, RandomState>,
+    sets: HashMap<Id, Set, RandomState>,
+    next_flush: SystemTime,
+}
+
+/// Return when the window following the given time should be flushed
+fn schedule_after(
+    config: &config::processor::Sampler,
+    align_offset: Option<Duration>,
+    time: SystemTime,
+) -> SystemTime {
+    let window = Duration::from_secs(config.window as u64);
+    match align_offset {
+        Some(offset) => next_boundary(time, window, offset),
+        None => time + window,
     }
 }
 
@@ -105,27 +418,114 @@ pub struct Sampler {
     counters: Mutex<RefCell<HashMap<Id, Counter, RandomState>>>,
     timers: Mutex<RefCell<HashMap<Id, Timer, RandomState>>>,
     gauges: Mutex<RefCell<HashMap<Id, Gauge, RandomState>>>,
+    sets: Mutex<RefCell<HashMap<Id, Set, RandomState>>>,
+    /// Empty sketch new sets are created from, sharing its hash keys
+    set_template: Set,
 
-    last_flush: Mutex<RefCell<std::time::SystemTime>>,
+    next_flush: Mutex<RefCell<SystemTime>>,
+    /// Offset of aligned flush times from wall-clock window multiples, None
+    /// when flushes are relative to the previous flush
+    align_offset: Option<Duration>,
+    /// Partitions of the previous window still being emitted
+    flushing: Arc<Flushing>,
+    flush_pool: FlushPool,
+
+    flush_duration: stats::Histogram,
+    flush_lag: stats::Histogram,
 
     route_to: Vec<config::Route>,
 }
 
 impl Sampler {
-    pub fn new(config: &config::processor::Sampler) -> Result<Self, Error> {
+    pub fn new(scope: stats::Scope, config: &config::processor::Sampler) -> Result<Self, Error> {
+        match config.flush_smear {
+            Some(smear) if !(0_f64..1_f64).contains(&smear) => return Err(Error::InvalidConfig),
+            _ => (),
+        }
+        if config.window == 0
+            || config.flush_threads == Some(0)
+            || config.flush_batch_size == Some(0)
+        {
+            return Err(Error::InvalidConfig);
+        }
+        let set_error_rate = config.set_error_rate.unwrap_or(DEFAULT_SET_ERROR_RATE);
+        if !(set_error_rate > 0_f64 && set_error_rate < 1_f64) {
+            return Err(Error::InvalidConfig);
+        }
+        let align_offset = match config.align_window {
+            Some(true) => Some(instance_offset(config)),
+            _ => None,
+        };
         let counters: RefCell<HashMap<Id, Counter, RandomState>> = RefCell::new(HashMap::default());
         let timers: RefCell<HashMap<Id, Timer, RandomState>> = RefCell::new(HashMap::default());
         let gauges: RefCell<HashMap<Id, Gauge, RandomState>> = RefCell::new(HashMap::default());
+        let sets: RefCell<HashMap<Id, Set, RandomState>> = RefCell::new(HashMap::default());
         Ok(Sampler {
             config: config.clone(),
             counters: Mutex::new(counters),
             timers: Mutex::new(timers),
             gauges: Mutex::new(gauges),
+            sets: Mutex::new(sets),
+            set_template: Set {
+                members: HyperLogLog::new(set_error_rate),
+            },
             route_to: config.route.clone(),
-            last_flush: Mutex::new(RefCell::new(std::time::SystemTime::now())),
+            next_flush: Mutex::new(RefCell::new(schedule_after(
+                config,
+                align_offset,
+                SystemTime::now(),
+            ))),
+            align_offset,
+            flushing: Arc::new(Flushing::default()),
+            flush_pool: FlushPool::new(),
+            flush_duration: scope
+                .histogram("flush_duration_seconds", &FLUSH_BUCKETS)
+                .unwrap(),
+            flush_lag: scope
+                .histogram("flush_lag_seconds", &FLUSH_BUCKETS)
+                .unwrap(),
         })
     }
 
+    /// Swap out the current window's aggregates and split them round-robin
+    /// into at most `partitions` non-empty work lists.
+    fn take_window(&self, partitions: usize) -> Vec<Vec<(Id, Aggregate)>> {
+        let gauges = self.gauges.lock().replace(HashMap::default());
+        let counters = self.counters.lock().replace(HashMap::default());
+        let timers = self.timers.lock().replace(HashMap::default());
+        let sets = self.sets.lock().replace(HashMap::default());
+
+        let total = gauges.len() + counters.len() + timers.len() + sets.len();
+        let batch_size = self
+            .config
+            .flush_batch_size
+            .unwrap_or(DEFAULT_FLUSH_BATCH_SIZE);
+        // Don't bother spinning up more workers than there are batches
+        let partitions = partitions.min((total + batch_size - 1) / batch_size);
+        let mut work: Vec<Vec<(Id, Aggregate)>> = (0..partitions)
+            .map(|_| Vec::with_capacity(total / partitions + 1))
+            .collect();
+
+        let aggregates = gauges
+            .into_iter()
+            .map(|(id, gauge)| (id, Aggregate::Gauge(gauge)))
+            .chain(
+                counters
+                    .into_iter()
+                    .map(|(id, counter)| (id, Aggregate::Counter(counter))),
+            )
+            .chain(
+                timers
+                    .into_iter()
+                    .map(|(id, timer)| (id, Aggregate::Timer(timer))),
+            )
+            .chain(sets.into_iter().map(|(id, set)| (id, Aggregate::Set(set))));
+        for (index, entry) in aggregates.enumerate() {
+            work[index % partitions].push(entry);
+        }
+        work
+    }
+
     fn record_timer(&self, owned: &Owned) {
         let lock = self.timers.lock();
         let mut hm = lock.borrow_mut();
@@ -154,18 +554,55 @@ impl Sampler {
         // clone the Id as the entry API does not allow for trait Clone
         // key references and supporting lazy-cloning.
         match hm.get_mut(owned.id()) {
-            Some(v) => v.value = owned.value(),
+            Some(v) => v.add(owned),
             None => {
                 hm.insert(
                     owned.id().clone(),
                     Gauge {
                         value: owned.value(),
+                        relative: owned.is_relative(),
                     },
                 );
             }
         };
     }
 
+    fn record_set<V: Hash>(&self, id: &Id, member: &V) {
+        let lock = self.sets.lock();
+        let mut hm = lock.borrow_mut();
+
+        match hm.get_mut(id) {
+            Some(v) => v.members.insert(member),
+            None => {
+                let mut members = HyperLogLog::new_from_template(&self.set_template.members);
+                members.insert(member);
+                hm.insert(id.clone(), Set { members });
+            }
+        }
+    }
+
+    /// Record a set member. Set members are not numeric in general, so PDUs
+    /// are handled without parsing their value, and parsed members are
+    /// hashed as the text they are written as, so both forms of a member
+    /// count once.
+    fn record_set_sample(&self, sample: &Event) {
+        match sample {
+            Event::Pdu(pdu) => {
+                let id: Result<Id, _> = pdu.try_into();
+                if let Ok(id) = id {
+                    self.record_set(&id, &pdu.value());
+                }
+            }
+            Event::Parsed(owned) => {
+                let mut text = [0_u8; MAX_NUMBER_LENGTH];
+                let mut rest = &mut text[..];
+                write_number(&mut rest, owned.value());
+                let length = MAX_NUMBER_LENGTH - rest.len();
+                self.record_set(owned.id(), &&text[..length]);
+            }
+        }
+    }
+
     fn record_counter(&self, owned: &Owned) {
         // Adjust values based on sample rate. In the end, emission will
         // re-scale everything back to the sample rate.
@@ -194,6 +631,20 @@ impl Sampler {
 
 impl processors::Processor for Sampler {
     fn provide_statsd(&self, sample: &Event) -> Option<processors::Output> {
+        let is_set = match sample {
+            Event::Pdu(pdu) => pdu.pdu_type() == b"s",
+            Event::Parsed(owned) => owned.metric_type() == &Type::Set,
+        };
+        if is_set {
+            if !self.config.aggregate_sets.unwrap_or(false) {
+                return Some(Output {
+                    route: &self.route_to,
+                    new_events: None,
+                });
+            }
+            self.record_set_sample(sample);
+            return None;
+        }
         let owned: Result<Owned, _> = sample.try_into();
         match owned {
             Err(_) => None,
@@ -216,48 +667,558 @@ impl processors::Processor for Sampler {
         }
     }
 
+    fn take_state(&self) -> Option<Box<dyn Any + Send>> {
+        // The flush lock keeps a tick from flushing half the window
+        let flush_lock = self.next_flush.lock();
+        let next_flush = *flush_lock.borrow();
+        let window = Window {
+            config: self.config.clone(),
+            counters: self.counters.lock().replace(HashMap::default()),
+            timers: self.timers.lock().replace(HashMap::default()),
+            gauges: self.gauges.lock().replace(HashMap::default()),
+            sets: self.sets.lock().replace(HashMap::default()),
+            next_flush,
+        };
+        Some(Box::new(window))
+    }
+
+    /// Merge the window of the replaced sampler into the current one, so a
+    /// reload loses no aggregates. The flush schedule carries over unless
+    /// the window changed.
+    fn adopt_state(&self, state: Box<dyn Any + Send>) {
+        let window = match state.downcast::<Window>() {
+            Ok(window) => *window,
+            Err(_) => return,
+        };
+        let flush_lock = self.next_flush.lock();
+        {
+            let lock = self.counters.lock();
+            let mut counters = lock.borrow_mut();
+            for (id, earlier) in window.counters {
+                let counter = counters.entry(id).or_default();
+                counter.value += earlier.value;
+                counter.samples += earlier.samples;
+            }
+        }
+        {
+            let lock = self.timers.lock();
+            let mut timers = lock.borrow_mut();
+            for (id, earlier) in window.timers {
+                match timers.get_mut(&id) {
+                    Some(timer) => timer.merge(earlier),
+                    None => {
+                        timers.insert(id, earlier);
+                    }
+                }
+            }
+        }
+        {
+            let lock = self.gauges.lock();
+            let mut gauges = lock.borrow_mut();
+            for (id, earlier) in window.gauges {
+                match gauges.get_mut(&id) {
+                    Some(gauge) => gauge.merge(earlier),
+                    None => {
+                        gauges.insert(id, earlier);
+                    }
+                }
+            }
+        }
+        {
+            // Sketches with different hash keys can't be merged, so a set
+            // seen on both sides of the reload keeps the larger estimate
+            let lock = self.sets.lock();
+            let mut sets = lock.borrow_mut();
+            for (id, earlier) in window.sets {
+                match sets.get_mut(&id) {
+                    Some(set) if set.members.len() >= earlier.members.len() => (),
+                    Some(set) => *set = earlier,
+                    None => {
+                        sets.insert(id, earlier);
+                    }
+                }
+            }
+        }
+        let same_schedule = window.config.window == self.config.window
+            && window.config.align_window == self.config.align_window
+            && window.config.align_jitter_ms == self.config.align_jitter_ms
+            && window.config.align_jitter_key == self.config.align_jitter_key;
+        if same_schedule {
+            flush_lock.replace(window.next_flush);
+        }
+    }
+
     fn tick(&self, time: std::time::SystemTime, backends: &Backends) {
-        // Take a lock on the last flush, which guards all other flushes.
-        let flush_lock = self.last_flush.lock();
-        let earlier = *flush_lock.borrow();
-        match time.duration_since(earlier) {
-            Err(_) => {
+        // Take a lock on the next flush time, which guards all other flushes.
+        let flush_lock = self.next_flush.lock();
+        let scheduled = *flush_lock.borrow();
+        match scheduled.duration_since(time) {
+            // The clock stepped backwards by more than a window, reschedule
+            Ok(remaining) if remaining > Duration::from_secs(self.config.window as u64) => {
+                flush_lock.replace(schedule_after(&self.config, self.align_offset, time));
                 return;
             }
-            Ok(duration) if duration.as_secs() < self.config.window as u64 => {
+            Ok(remaining) if remaining > Duration::from_secs(0) => {
                 return;
             }
-            Ok(_) => (),
+            _ => (),
         }
 
-        let mut gauges = self.gauges.lock().replace(HashMap::default());
-        for (id, gauge) in gauges.drain() {
-            let pdu = gauge.to_event(&id);
-            backends.provide_statsd(&pdu, self.route_to.as_ref())
+        // A smeared flush of the previous window may still be running. Keep
+        // aggregating into the current window and retry on the next tick
+        // rather than overlapping two flushes.
+        if self.flushing.active() {
+            return;
         }
 
-        let mut counters = self.counters.lock().replace(HashMap::default());
-        for (id, counter) in counters.drain() {
-            let pdu = counter.to_event(&id);
-            backends.provide_statsd(&pdu, self.route_to.as_ref());
+        self.flush_lag.observe(
+            time.duration_since(scheduled)
+                .unwrap_or_default()
+                .as_secs_f64(),
+        );
+        flush_lock.replace(schedule_after(&self.config, self.align_offset, time));
+        let smear = Duration::from_secs(self.config.window as u64)
+            .mul_f64(self.config.flush_smear.unwrap_or_default());
+        self.flush_window(backends, smear);
+    }
+
+    /// Flush the current window ahead of its boundary, after any smeared
+    /// flush of the previous window has finished, and without smearing.
+    fn flush(&self, backends: &Backends) {
+        let flush_lock = self.next_flush.lock();
+        self.flushing.wait();
+        flush_lock.replace(schedule_after(
+            &self.config,
+            self.align_offset,
+            SystemTime::now(),
+        ));
+        self.flush_window(backends, Duration::from_secs(0));
+    }
+}
+
+impl Sampler {
+    /// Emit the current window's aggregates to the backends. Emission runs
+    /// on the flush pool, each worker handing batches of events to the
+    /// backends. Without smearing this waits for the workers to finish.
+    fn flush_window(&self, backends: &Backends, smear: Duration) {
+        let start = Instant::now();
+        let work = self.take_window(self.config.flush_threads.unwrap_or(DEFAULT_FLUSH_THREADS));
+        if work.is_empty() {
+            self.flush_duration.observe(start.elapsed().as_secs_f64());
+            return;
         }
 
-        let mut timers = self.timers.lock().replace(HashMap::default());
-        for (id, timer) in timers.drain() {
-            let sample_rate = timer.values.len() as f64 / timer.count;
-            for value in timer.values {
-                let pdu = Event::Parsed(Owned::new(id.clone(), value, Some(sample_rate)));
-                backends.provide_statsd(&pdu, self.route_to.as_ref());
+        let batch_size = self
+            .config
+            .flush_batch_size
+            .unwrap_or(DEFAULT_FLUSH_BATCH_SIZE);
+        let workers = self.flush_pool.grow(work.len());
+        *self.flushing.pending.lock() += work.len();
+        for partition in work {
+            let backends = backends.clone();
+            let route = self.route_to.clone();
+            let done = PartitionDone {
+                flushing: self.flushing.clone(),
+                start,
+                flush_duration: self.flush_duration.clone(),
+            };
+            let job = move |smear| {
+                let _done = done;
+                flush_partition(partition, &backends, &route, batch_size, smear, start);
+            };
+            // Without workers the partition is emitted right away, unpaced
+            if workers == 0 {
+                job(Duration::from_secs(0));
+                continue;
+            }
+            if let Err(job) = self.flush_pool.submit(Box::new(move || job(smear))) {
+                job();
             }
         }
-
-        flush_lock.replace(time);
+        if smear == Duration::from_secs(0) {
+            self.flushing.wait();
+        }
     }
 }
 
 #[cfg(test)]
 pub mod test {
     use super::*;
+    use crate::processors::Processor;
+    use crate::statsd_proto::Pdu;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    struct CountingProc {
+        count: Arc<AtomicUsize>,
+        last: Arc<Mutex<Option<Event>>>,
+    }
+
+    impl Processor for CountingProc {
+        fn provide_statsd(&self, sample: &Event) -> Option<Output> {
+            self.count.fetch_add(1, Ordering::Relaxed);
+            self.last.lock().replace(sample.clone());
+            None
+        }
+    }
+
+    fn make_config(flush_smear: Option<f64>) -> config::processor::Sampler {
+        config::processor::Sampler {
+            window: 10,
+            timer_reservoir_size: Some(2),
+            flush_threads: Some(3),
+            flush_batch_size: Some(7),
+            flush_smear,
+            align_window: None,
+            align_jitter_ms: None,
+            align_jitter_key: None,
+            aggregate_sets: None,
+            set_error_rate: None,
+            route: vec![config::Route {
+                route_type: config::RouteType::Processor,
+                route_to: "count".to_owned(),
+            }],
+        }
+    }
+
+    fn make_sampler_with(
+        config: &config::processor::Sampler,
+    ) -> (Sampler, Backends, Arc<AtomicUsize>) {
+        let (sampler, backends, count, _) = make_capturing_sampler(config);
+        (sampler, backends, count)
+    }
+
+    fn make_capturing_sampler(
+        config: &config::processor::Sampler,
+    ) -> (
+        Sampler,
+        Backends,
+        Arc<AtomicUsize>,
+        Arc<Mutex<Option<Event>>>,
+    ) {
+        let backends = Backends::new(crate::stats::Collector::default().scope("test"));
+        let count = Arc::new(AtomicUsize::new(0));
+        let last = Arc::new(Mutex::new(None));
+        backends
+            .replace_processor(
+                "count",
+                Box::new(CountingProc {
+                    count: count.clone(),
+                    last: last.clone(),
+                }),
+            )
+            .unwrap();
+        let scope = crate::stats::Collector::default().scope("sampler");
+        (Sampler::new(scope, config).unwrap(), backends, count, last)
+    }
+
+    fn make_sampler(flush_smear: Option<f64>) -> (Sampler, Backends, Arc<AtomicUsize>) {
+        make_sampler_with(&make_config(flush_smear))
+    }
+
+    fn record(sampler: &Sampler, line: String) {
+        let pdu = Pdu::parse(bytes::Bytes::from(line)).unwrap();
+        assert!(sampler.provide_statsd(&Event::Pdu(pdu)).is_none());
+    }
+
+    #[test]
+    fn invalid_flush_config() {
+        let (sampler, _, _) = make_sampler(None);
+        let scope = crate::stats::Collector::default().scope("sampler");
+        let mut config = sampler.config.clone();
+        config.flush_smear = Some(1.0);
+        assert!(Sampler::new(scope.clone(), &config).is_err());
+        config.flush_smear = None;
+        config.flush_threads = Some(0);
+        assert!(Sampler::new(scope, &config).is_err());
+    }
+
+    fn flush_series(lines: &[&str]) -> Owned {
+        let (sampler, backends, count, last) = make_capturing_sampler(&make_config(None));
+        for line in lines {
+            record(&sampler, line.to_string());
+        }
+        sampler.tick(
+            std::time::SystemTime::now() + Duration::from_secs(11),
+            &backends,
+        );
+        assert_eq!(count.load(Ordering::Relaxed), 1);
+        let event = last.lock().take().unwrap();
+        event.try_into().unwrap()
+    }
+
+    #[test]
+    fn gauge_deltas() {
+        let folded = flush_series(&["gauge:+5|g", "gauge:-3|g"]);
+        assert!(folded.is_relative());
+        assert_eq!(folded.value(), 2_f64);
+
+        let folded = flush_series(&["gauge:10|g", "gauge:+5|g"]);
+        assert!(!folded.is_relative());
+        assert_eq!(folded.value(), 15_f64);
+
+        let folded = flush_series(&["gauge:-3|g", "gauge:7|g", "gauge:+1|g"]);
+        assert!(!folded.is_relative());
+        assert_eq!(folded.value(), 8_f64);
+    }
+
+    #[test]
+    fn negative_gauges() {
+        let (sampler, _, _) = make_sampler(None);
+        record(&sampler, "gauge:0|g".to_owned());
+        record(&sampler, "gauge:-5|g".to_owned());
+        let mut events = Vec::new();
+        for (id, aggregate) in sampler.take_window(1).into_iter().flatten() {
+            aggregate.emit(id, &mut events);
+        }
+        assert_eq!(events.len(), 2);
+
+        // Applied downstream after a round trip through statsd lines, the
+        // gauge ends up at the absolute value whatever it held before
+        let mut downstream = Gauge {
+            value: 42_f64,
+            relative: false,
+        };
+        for event in events {
+            let owned: Owned = event.try_into().unwrap();
+            let pdu: Pdu = (&owned).try_into().unwrap();
+            let parsed: Owned = (&pdu).try_into().unwrap();
+            downstream.add(&parsed);
+        }
+        assert!(!downstream.relative);
+        assert_eq!(downstream.value, -5_f64);
+    }
+
+    #[test]
+    fn counter_sample_rates() {
+        // Each line sampled at 1/4 stands for 4 lines
+        let folded = flush_series(&["counter:1|c|@0.25", "counter:2|c|@0.25"]);
+        assert_eq!(folded.value() / folded.sample_rate().unwrap(), 12_f64);
+        let folded = flush_series(&["counter:1|c|@0.5", "counter:1|c"]);
+        assert_eq!(folded.value() / folded.sample_rate().unwrap(), 3_f64);
+    }
+
+    #[test]
+    fn window_handoff() {
+        let (previous, _, _) = make_sampler(None);
+        record(&previous, "counter:3|c".to_owned());
+        record(&previous, "gauge:10|g".to_owned());
+        let next_flush = *previous.next_flush.lock().borrow();
+
+        let mut config = make_config(None);
+        config.timer_reservoir_size = Some(10);
+        let (replacement, _, _) = make_sampler_with(&config);
+        record(&replacement, "counter:2|c".to_owned());
+        record(&replacement, "gauge:+5|g".to_owned());
+        replacement.adopt_state(previous.take_state().unwrap());
+        assert_eq!(*replacement.next_flush.lock().borrow(), next_flush);
+
+        let mut series = 0;
+        for (_, aggregate) in replacement.take_window(1).into_iter().flatten() {
+            series += 1;
+            match aggregate {
+                Aggregate::Counter(counter) => assert_eq!(counter.value, 5_f64),
+                Aggregate::Gauge(gauge) => {
+                    assert!(!gauge.relative);
+                    assert_eq!(gauge.value, 15_f64);
+                }
+                other => panic!("unexpected aggregate {:?}", other),
+            }
+        }
+        assert_eq!(series, 2);
+        assert!(previous.take_window(1).is_empty());
+    }
+
+    #[test]
+    fn set_passthrough() {
+        let (sampler, _, _) = make_sampler(None);
+        let pdu = Pdu::parse(bytes::Bytes::from_static(b"users:alice|s")).unwrap();
+        assert!(sampler.provide_statsd(&Event::Pdu(pdu)).is_some());
+    }
+
+    #[test]
+    fn set_aggregation() {
+        let mut config = make_config(None);
+        config.aggregate_sets = Some(true);
+        let (sampler, backends, count, last) = make_capturing_sampler(&config);
+        for _ in 0..3 {
+            for x in 0..100 {
+                record(&sampler, format!("users:user-{}|s|#env:test", x));
+            }
+        }
+        sampler.tick(
+            std::time::SystemTime::now() + Duration::from_secs(11),
+            &backends,
+        );
+        assert_eq!(count.load(Ordering::Relaxed), 1);
+
+        let event = last.lock().take().unwrap();
+        let owned: Owned = event.try_into().unwrap();
+        assert_eq!(owned.name(), b"users");
+        assert_eq!(owned.metric_type(), &Type::Gauge);
+        assert_eq!(owned.tags().len(), 1);
+        assert!(
+            (owned.value() - 100_f64).abs() < 10_f64,
+            "estimate {}",
+            owned.value()
+        );
+    }
+
+    #[test]
+    fn set_member_forms() {
+        let mut config = make_config(None);
+        config.aggregate_sets = Some(true);
+        let (sampler, backends, _, last) = make_capturing_sampler(&config);
+        for x in 0..100 {
+            let pdu = Pdu::parse(bytes::Bytes::from(format!("users:{}|s", x))).unwrap();
+            let owned: Owned = (&pdu).try_into().unwrap();
+            assert!(sampler.provide_statsd(&Event::Pdu(pdu)).is_none());
+            assert!(sampler.provide_statsd(&Event::Parsed(owned)).is_none());
+        }
+        sampler.tick(
+            std::time::SystemTime::now() + Duration::from_secs(11),
+            &backends,
+        );
+        let owned: Owned = last.lock().take().unwrap().try_into().unwrap();
+        assert!(
+            (owned.value() - 100_f64).abs() < 10_f64,
+            "estimate {}",
+            owned.value()
+        );
+    }
+
+    #[test]
+    fn aligned_boundaries() {
+        let window = Duration::from_secs(10);
+        let at = |ms: u64| UNIX_EPOCH + Duration::from_millis(ms);
+        let zero = Duration::from_secs(0);
+        assert_eq!(next_boundary(at(0), window, zero), at(10_000));
+        assert_eq!(next_boundary(at(9_999), window, zero), at(10_000));
+        assert_eq!(next_boundary(at(10_000), window, zero), at(20_000));
+        let offset = Duration::from_millis(2_500);
+        assert_eq!(next_boundary(at(1_000), window, offset), at(2_500));
+        assert_eq!(next_boundary(at(2_500), window, offset), at(12_500));
+        assert_eq!(next_boundary(at(13_000), window, offset), at(22_500));
+        // Offsets wrap around the window
+        let offset = Duration::from_millis(12_500);
+        assert_eq!(next_boundary(at(13_000), window, offset), at(22_500));
+    }
+
+    #[test]
+    fn instance_offsets() {
+        let mut config = make_config(None);
+        assert_eq!(instance_offset(&config), Duration::from_secs(0));
+        config.align_jitter_ms = Some(5_000);
+        config.align_jitter_key = Some("relay-a".to_owned());
+        let offset = instance_offset(&config);
+        assert!(offset < Duration::from_secs(5));
+        assert_eq!(offset, instance_offset(&config));
+    }
+
+    #[test]
+    fn aligned_flush() {
+        let mut config = make_config(None);
+        config.align_window = Some(true);
+        let (sampler, backends, count) = make_sampler_with(&config);
+        let boundary = *sampler.next_flush.lock().borrow();
+        let since_epoch = boundary.duration_since(UNIX_EPOCH).unwrap();
+        assert_eq!(since_epoch.as_millis() % 10_000, 0);
+
+        record(&sampler, "counter:1|c".to_owned());
+        sampler.tick(boundary - Duration::from_millis(1), &backends);
+        assert_eq!(count.load(Ordering::Relaxed), 0);
+        sampler.tick(boundary + Duration::from_millis(300), &backends);
+        assert_eq!(count.load(Ordering::Relaxed), 1);
+        assert_eq!(
+            *sampler.next_flush.lock().borrow(),
+            boundary + Duration::from_secs(10)
+        );
+        assert_eq!(sampler.flush_lag.count(), 1);
+        assert!((sampler.flush_lag.sum() - 0.3).abs() < 1e-9);
+        assert_eq!(sampler.flush_duration.count(), 1);
+    }
+
+    #[test]
+    fn parallel_flush() {
+        let (sampler, backends, count) = make_sampler(None);
+        for x in 0..100 {
+            record(&sampler, format!("counter.{}:1|c", x));
+            record(&sampler, format!("gauge.{}:1|g", x));
+            for _ in 0..5 {
+                record(&sampler, format!("timer.{}:1|ms", x));
+            }
+        }
+        let now = std::time::SystemTime::now();
+        // Nothing is emitted before the window ends
+        sampler.tick(now, &backends);
+        assert_eq!(count.load(Ordering::Relaxed), 0);
+
+        sampler.tick(now + Duration::from_secs(11), &backends);
+        // One event per counter and gauge, a full reservoir per timer
+        assert_eq!(count.load(Ordering::Relaxed), 100 + 100 + 200);
+        assert!(!sampler.flushing.active());
+    }
+
+    #[test]
+    fn forced_flush() {
+        let (sampler, backends, count) = make_sampler(Some(0.01));
+        for x in 0..10 {
+            record(&sampler, format!("counter.{}:1|c", x));
+        }
+        let now = std::time::SystemTime::now();
+        sampler.tick(now + Duration::from_secs(11), &backends);
+        for x in 0..5 {
+            record(&sampler, format!("late.{}:1|c", x));
+        }
+        // Waits for the smeared flush, then emits the window held until the
+        // next boundary without waiting for it
+        sampler.flush(&backends);
+        assert_eq!(count.load(Ordering::Relaxed), 15);
+        assert!(!sampler.flushing.active());
+        assert!(*sampler.next_flush.lock().borrow() > now + Duration::from_secs(5));
+    }
+
+    #[test]
+    fn smeared_flush() {
+        let (sampler, backends, count) = make_sampler(Some(0.01));
+        for x in 0..100 {
+            record(&sampler, format!("counter.{}:1|c", x));
+        }
+        let now = std::time::SystemTime::now();
+        sampler.tick(now + Duration::from_secs(11), &backends);
+        // Smeared output is emitted in the background over 100ms
+        sampler.flushing.wait();
+        assert_eq!(count.load(Ordering::Relaxed), 100);
+        // The workers are kept for the next window
+        assert_eq!(*sampler.flush_pool.workers.lock(), 3);
+    }
+
+    #[test]
+    fn panicking_flush_worker() {
+        let flushing = Arc::new(Flushing::default());
+        let pool = FlushPool::new();
+        assert_eq!(pool.grow(1), 1);
+        *flushing.pending.lock() += 2;
+        for _ in 0..2 {
+            let done = PartitionDone {
+                flushing: flushing.clone(),
+                start: Instant::now(),
+                flush_duration: crate::stats::Collector::default()
+                    .scope("test")
+                    .histogram("flush", &FLUSH_BUCKETS)
+                    .unwrap(),
+            };
+            pool.submit(Box::new(move || {
+                let _done = done;
+                panic!("flush failed");
+            }))
+            .ok()
+            .unwrap();
+        }
+        // Both partitions count as done, and the worker survives them
+        flushing.wait();
+        assert!(!flushing.active());
+        assert_eq!(*pool.workers.lock(), 1);
+    }
 
     #[test]
     fn fill_timer() {
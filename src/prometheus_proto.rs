@@ -0,0 +1,351 @@
+use bytes::{BufMut, Bytes, BytesMut};
+use memchr::{memchr, memrchr};
+use smallvec::SmallVec;
+use thiserror::Error;
+
+use crate::statsd_proto::{is_number, MAX_PDU_LENGTH};
+
+#[derive(Error, Debug)]
+pub enum ExpositionError {
+    #[error("invalid sample line")]
+    InvalidSample,
+    #[error("sample value can't be represented in statsd")]
+    UnsupportedValue,
+    #[error("line longer than the maximum PDU length")]
+    LineTooLong,
+}
+
+/// Incremental converter from the Prometheus text exposition format to statsd
+/// lines.
+///
+/// Request bodies are pushed in as they arrive, in chunks split at arbitrary
+/// points. Every complete sample line is rewritten straight into a shared
+/// output buffer as a statsd gauge, with labels as tags, so the samples of a
+/// batch share a single allocation and can be tokenized with
+/// [`Pdu::parse_lines`](crate::statsd_proto::Pdu::parse_lines).
+///
+/// Prometheus samples are absolute values, so every sample becomes a gauge,
+/// including counters, and timestamps are dropped. A negative value is
+/// preceded by a zero sample, as a signed statsd gauge is a relative update.
+/// NaN and infinite values have no statsd representation and are skipped.
+#[derive(Debug, Default)]
+pub struct Converter {
+    partial: BytesMut,
+    out: BytesMut,
+    batch_lines: usize,
+    /// Samples converted so far
+    pub samples: usize,
+    /// Samples skipped as their value can't be represented in statsd
+    pub skipped: usize,
+    /// Sample lines which could not be parsed
+    pub invalid: usize,
+}
+
+impl Converter {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Convert the complete lines in a chunk of the body, keeping any trailing
+    /// partial line until the next chunk.
+    pub fn push(&mut self, chunk: &[u8]) -> Result<(), ExpositionError> {
+        let complete = match memrchr(b'\n', chunk) {
+            None => {
+                self.partial.extend_from_slice(chunk);
+                return self.check_partial();
+            }
+            Some(newline) => newline + 1,
+        };
+        let mut lines = &chunk[..complete];
+        if !self.partial.is_empty() {
+            // Finish the line carried over from the last chunk
+            let end = memchr(b'\n', lines).unwrap() + 1;
+            self.partial.extend_from_slice(&lines[..end - 1]);
+            let line = self.partial.split();
+            self.convert_line(&line);
+            lines = &lines[end..];
+        }
+        while let Some(newline) = memchr(b'\n', lines) {
+            self.convert_line(&lines[..newline]);
+            lines = &lines[newline + 1..];
+        }
+        self.partial.extend_from_slice(&chunk[complete..]);
+        self.check_partial()
+    }
+
+    /// Convert a final line which was not newline terminated
+    pub fn finish(&mut self) {
+        let line = self.partial.split();
+        self.convert_line(&line);
+    }
+
+    /// Number of statsd lines converted since the last [`take`](Converter::take)
+    pub fn batch_len(&self) -> usize {
+        self.batch_lines
+    }
+
+    /// Take the statsd lines converted so far, newline separated
+    pub fn take(&mut self) -> Bytes {
+        self.batch_lines = 0;
+        self.out.split().freeze()
+    }
+
+    fn check_partial(&self) -> Result<(), ExpositionError> {
+        if self.partial.len() > MAX_PDU_LENGTH {
+            return Err(ExpositionError::LineTooLong);
+        }
+        Ok(())
+    }
+
+    fn convert_line(&mut self, line: &[u8]) {
+        let start = self.out.len();
+        match write_sample(line, &mut self.out) {
+            Ok(0) => (),
+            Ok(written) => {
+                self.samples += 1;
+                self.batch_lines += written;
+            }
+            Err(ExpositionError::UnsupportedValue) => {
+                self.out.truncate(start);
+                self.skipped += 1;
+            }
+            Err(_) => {
+                self.out.truncate(start);
+                self.invalid += 1;
+            }
+        }
+    }
+}
+
+fn trim_start(input: &[u8]) -> &[u8] {
+    let ws = input
+        .iter()
+        .take_while(|b| **b == b' ' || **b == b'\t')
+        .count();
+    &input[ws..]
+}
+
+/// Split a `name="value",...}` label set into label names and raw, still
+/// escaped, values, returning the rest of the line after the closing brace.
+fn split_labels<'a>(
+    mut scan: &'a [u8],
+    labels: &mut SmallVec<[(&'a [u8], &'a [u8]); 8]>,
+) -> Result<&'a [u8], ExpositionError> {
+    loop {
+        scan = trim_start(scan);
+        match scan.first() {
+            Some(b'}') => return Ok(&scan[1..]),
+            Some(_) => (),
+            None => return Err(ExpositionError::InvalidSample),
+        }
+        let eq = memchr(b'=', scan).ok_or(ExpositionError::InvalidSample)?;
+        let name = &scan[..eq];
+        let name_len = name.iter().take_while(|b| **b != b' ').count();
+        scan = trim_start(&scan[eq + 1..]);
+        if scan.first() != Some(&b'"') {
+            return Err(ExpositionError::InvalidSample);
+        }
+        scan = &scan[1..];
+        let mut end = 0;
+        loop {
+            match scan.get(end) {
+                Some(b'"') => break,
+                Some(b'\\') => end += 2,
+                Some(_) => end += 1,
+                None => return Err(ExpositionError::InvalidSample),
+            }
+        }
+        labels.push((&name[..name_len], &scan[..end]));
+        scan = trim_start(&scan[end + 1..]);
+        if let Some(b',') = scan.first() {
+            scan = &scan[1..];
+        }
+    }
+}
+
+/// Write a label name or value as a statsd tag component, unescaping it and
+/// replacing the characters which delimit statsd tags.
+fn write_tag_component(out: &mut BytesMut, input: &[u8]) {
+    let mut escaped = false;
+    for b in input {
+        let b = match (escaped, *b) {
+            (false, b'\\') => {
+                escaped = true;
+                continue;
+            }
+            (true, b'n') | (_, b',') | (_, b'|') | (_, b'\n') => b'_',
+            (_, b) => b,
+        };
+        escaped = false;
+        out.put_u8(b);
+    }
+}
+
+/// Rewrite one exposition line as statsd gauge lines, returning the number of
+/// lines written. Comments, including `# TYPE` and `# HELP`, and blank lines
+/// write nothing.
+fn write_sample(line: &[u8], out: &mut BytesMut) -> Result<usize, ExpositionError> {
+    let line = trim_start(line);
+    let line = match line.last() {
+        Some(b'\r') => &line[..line.len() - 1],
+        _ => line,
+    };
+    match line.first() {
+        None | Some(b'#') => return Ok(0),
+        _ => (),
+    }
+    let name_len = line
+        .iter()
+        .take_while(|b| !matches!(b, b'{' | b' ' | b'\t'))
+        .count();
+    let name = &line[..name_len];
+    let mut labels: SmallVec<[(&[u8], &[u8]); 8]> = SmallVec::new();
+    let mut rest = &line[name_len..];
+    if let Some(b'{') = rest.first() {
+        rest = split_labels(&rest[1..], &mut labels)?;
+    }
+    let rest = trim_start(rest);
+    let value_len = rest
+        .iter()
+        .take_while(|b| !matches!(b, b' ' | b'\t'))
+        .count();
+    let value = &rest[..value_len];
+    if name.is_empty() || value.is_empty() {
+        return Err(ExpositionError::InvalidSample);
+    }
+    if !is_number(value) {
+        // NaN and +/-Inf are valid exposition values, but not statsd ones
+        return Err(ExpositionError::UnsupportedValue);
+    }
+    let mut written = 1;
+    if value[0] == b'-' {
+        write_gauge(out, name, b"0", &labels)?;
+        written += 1;
+    }
+    let value = match value[0] {
+        b'+' => &value[1..],
+        _ => value,
+    };
+    write_gauge(out, name, value, &labels)?;
+    Ok(written)
+}
+
+fn write_gauge(
+    out: &mut BytesMut,
+    name: &[u8],
+    value: &[u8],
+    labels: &[(&[u8], &[u8])],
+) -> Result<(), ExpositionError> {
+    let start = out.len();
+    out.reserve(name.len() + value.len() + 8);
+    out.put_slice(name);
+    out.put_u8(b':');
+    out.put_slice(value);
+    out.put_slice(b"|g");
+    let mut sep: &[u8] = b"|#";
+    for (label, label_value) in labels {
+        out.put_slice(sep);
+        write_tag_component(out, label);
+        out.put_u8(b':');
+        write_tag_component(out, label_value);
+        sep = b",";
+    }
+    if out.len() - start > MAX_PDU_LENGTH {
+        return Err(ExpositionError::LineTooLong);
+    }
+    out.put_u8(b'\n');
+    Ok(())
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use crate::statsd_proto::{Owned, Parsed, Pdu};
+    use std::convert::TryInto;
+
+    const EXPOSITION: &[u8] = b"# HELP http_requests_total The total number of HTTP requests.
+# TYPE http_requests_total counter
+http_requests_total{method=\"post\",code=\"200\"} 1027 1395066363000
+http_requests_total{method=\"post\",code=\"400\"}    3 1395066363000
+
+msdos_file_access_time_seconds{path=\"C:\\\\DIR\\\\FILE.TXT\",error=\"Cannot find file:\\n\\\"FILE.TXT\\\"\"} 1.458255915e9
+metric_without_timestamp_and_labels 12.47
+something_weird{problem=\"division by zero\"} +Inf -3982045
+temperature{room=\"a,b|c\"} -3.5
+rpc_duration_seconds{quantile=\"0.5\",} 4773
+";
+
+    fn convert_all(chunk_size: usize) -> (Converter, Vec<Owned>) {
+        let mut converter = Converter::new();
+        for chunk in EXPOSITION.chunks(chunk_size) {
+            converter.push(chunk).unwrap();
+        }
+        converter.finish();
+        let lines = converter.take();
+        let mut samples = Vec::new();
+        Pdu::parse_lines(&lines, |_, pdu| {
+            samples.push(pdu.unwrap().try_into().unwrap());
+        });
+        (converter, samples)
+    }
+
+    #[test]
+    fn convert_exposition() {
+        let (converter, samples) = convert_all(EXPOSITION.len());
+        assert_eq!(converter.samples, 6);
+        assert_eq!(converter.skipped, 1);
+        assert_eq!(converter.invalid, 0);
+        assert_eq!(converter.batch_len(), 0);
+
+        let names: Vec<&[u8]> = samples.iter().map(|s| s.name()).collect();
+        assert_eq!(
+            names,
+            vec![
+                &b"http_requests_total"[..],
+                b"http_requests_total",
+                b"msdos_file_access_time_seconds",
+                b"metric_without_timestamp_and_labels",
+                b"temperature",
+                b"temperature",
+                b"rpc_duration_seconds",
+            ]
+        );
+        assert_eq!(samples[0].value(), 1027_f64);
+        assert_eq!(samples[0].tags()[0].name, b"method");
+        assert_eq!(samples[0].tags()[1].value, b"200");
+        assert_eq!(samples[2].value(), 1.458255915e9);
+        assert_eq!(samples[2].tags()[0].value, b"C:\\DIR\\FILE.TXT");
+        assert_eq!(
+            samples[2].tags()[1].value,
+            b"Cannot find file:_\"FILE.TXT\""
+        );
+        // Negative values are set absolutely by zeroing the gauge first
+        assert!(!samples[4].is_relative());
+        assert_eq!(samples[4].value(), 0_f64);
+        assert_eq!(samples[5].value(), -3.5);
+        assert_eq!(samples[5].tags()[0].value, b"a_b_c");
+        assert_eq!(samples[6].tags().len(), 1);
+    }
+
+    #[test]
+    fn convert_split_chunks() {
+        let (_, whole) = convert_all(EXPOSITION.len());
+        for chunk_size in 1..64 {
+            let (converter, samples) = convert_all(chunk_size);
+            assert_eq!(converter.samples, 6);
+            assert_eq!(samples, whole);
+        }
+    }
+
+    #[test]
+    fn invalid_lines() {
+        let mut converter = Converter::new();
+        converter
+            .push(b"good 1\nbad{a=\"b\" 1\nbad{a=b} 1\nnovalue\n")
+            .unwrap();
+        assert_eq!(converter.samples, 1);
+        assert_eq!(converter.invalid, 3);
+        assert_eq!(converter.batch_len(), 1);
+        assert!(converter.push(&vec![b'a'; MAX_PDU_LENGTH + 1][..]).is_err());
+    }
+}
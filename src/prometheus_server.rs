@@ -0,0 +1,150 @@
+use hyper::body::HttpBody;
+use hyper::service::{make_service_fn, service_fn};
+use hyper::{Body, Method, Request, Response, Server, StatusCode};
+use stream_cancel::Tripwire;
+
+use std::convert::Infallible;
+
+use log::{info, warn};
+
+use crate::backends::Backends;
+use crate::config;
+use crate::config::PrometheusServerConfig;
+use crate::prometheus_proto::Converter;
+use crate::stats;
+use crate::statsd_proto::{Event, Pdu};
+
+const DEFAULT_BATCH_SIZE: usize = 1024;
+
+#[derive(Clone)]
+struct IngestState {
+    backends: Backends,
+    route: Vec<config::Route>,
+    batch_size: usize,
+    requests: stats::Counter,
+    request_errors: stats::Counter,
+    samples: stats::Counter,
+    skipped_samples: stats::Counter,
+    invalid_samples: stats::Counter,
+}
+
+impl IngestState {
+    /// Tokenize the lines converted so far and route them as one batch
+    fn dispatch(&self, converter: &mut Converter) {
+        let mut events = Vec::with_capacity(converter.batch_len());
+        let lines = converter.take();
+        Pdu::parse_lines(&lines, |_, pdu| {
+            if let Ok(pdu) = pdu {
+                events.push(Event::Pdu(pdu));
+            }
+        });
+        self.backends.provide_statsd_slice(&events, &self.route);
+    }
+}
+
+/// Convert a request body of Prometheus text exposition samples as it streams
+/// in, dispatching every `batch_size` samples.
+async fn ingest(state: IngestState, req: Request<Body>) -> Result<Response<Body>, Infallible> {
+    state.requests.inc();
+    let mut body = req.into_body();
+    let mut converter = Converter::new();
+    let mut result = Ok(());
+    while let Some(chunk) = body.data().await {
+        let pushed = match chunk {
+            Ok(chunk) => converter.push(&chunk).map_err(|e| e.to_string()),
+            Err(e) => Err(e.to_string()),
+        };
+        if let Err(e) = pushed {
+            result = Err(e);
+            break;
+        }
+        if converter.batch_len() >= state.batch_size {
+            state.dispatch(&mut converter);
+        }
+    }
+    if result.is_ok() {
+        converter.finish();
+    }
+    // Samples converted before any error are still valid
+    state.dispatch(&mut converter);
+    state.samples.inc_by(converter.samples as f64);
+    state.skipped_samples.inc_by(converter.skipped as f64);
+    state.invalid_samples.inc_by(converter.invalid as f64);
+
+    match result {
+        Ok(()) => Ok(Response::builder()
+            .status(StatusCode::NO_CONTENT)
+            .body(Body::empty())
+            .unwrap()),
+        Err(e) => {
+            state.request_errors.inc();
+            Ok(Response::builder()
+                .status(StatusCode::BAD_REQUEST)
+                .body(Body::from(e))
+                .unwrap())
+        }
+    }
+}
+
+async fn request_handler(
+    state: IngestState,
+    req: Request<Body>,
+) -> Result<Response<Body>, Infallible> {
+    match req.method() {
+        &Method::POST | &Method::PUT => ingest(state, req).await,
+        _ => Ok(Response::builder()
+            .status(StatusCode::METHOD_NOT_ALLOWED)
+            .body(Body::from("method not allowed"))
+            .unwrap()),
+    }
+}
+
+/// Run a Prometheus text exposition ingest server on a listener bound to its
+/// address until the tripwire is triggered. Samples pushed to it with a POST
+/// or PUT to any path are converted to statsd gauges and routed like statsd
+/// server lines.
+pub async fn run(
+    stats: stats::Scope,
+    tripwire: Tripwire,
+    config: PrometheusServerConfig,
+    listener: std::net::TcpListener,
+    backends: Backends,
+) {
+    let state = IngestState {
+        backends,
+        route: config.route.clone(),
+        batch_size: config.batch_size.unwrap_or(DEFAULT_BATCH_SIZE),
+        requests: stats.counter("requests").unwrap(),
+        request_errors: stats.counter("request_errors").unwrap(),
+        samples: stats.counter("samples").unwrap(),
+        skipped_samples: stats.counter("skipped_samples").unwrap(),
+        invalid_samples: stats.counter("invalid_samples").unwrap(),
+    };
+    let make_svc = make_service_fn(move |_conn| {
+        let service_capture = state.clone();
+        async {
+            Ok::<_, Infallible>(service_fn(move |req| {
+                request_handler(service_capture.clone(), req)
+            }))
+        }
+    });
+    info!("prometheus ingest server running on {}", config.bind);
+    if let Err(e) = listener.set_nonblocking(true) {
+        warn!("prometheus ingest server error {:?}", e);
+        return;
+    }
+    let server = match Server::from_tcp(listener) {
+        Ok(server) => server,
+        Err(e) => {
+            warn!("prometheus ingest server error {:?}", e);
+            return;
+        }
+    };
+    let server = server.serve(make_svc).with_graceful_shutdown(async move {
+        tripwire.await;
+    });
+    if let Err(e) = server.await {
+        warn!("prometheus ingest server error {:?}", e);
+    }
+    info!("terminating prometheus ingest server");
+}
@@ -0,0 +1,346 @@
+//! Per-peer token bucket rate limiting for the statsd listeners.
+//!
+//! A [`Limiter`](Limiter) keeps the bucket of each peer in a fixed size table
+//! of atomics, so admitting lines never allocates or takes a lock. A peer
+//! hashes to a short window of slots. When every slot of the window belongs to
+//! another peer, the peer takes over the slot refilled longest ago, so the
+//! table follows the active peers and forgets idle ones. Concurrent takeovers
+//! of a slot may briefly mix up the buckets or counts of two peers, which is
+//! an accepted imprecision for an admission control.
+
+use parking_lot::Mutex;
+
+use std::collections::HashMap;
+use std::fmt;
+use std::net::{IpAddr, Ipv6Addr};
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering::{AcqRel, Acquire, Relaxed, Release};
+use std::sync::Arc;
+use std::time::Instant;
+
+use crate::config::{RateLimitAction, RateLimitConfig};
+use crate::stats;
+
+/// Slots probed for a peer
+const WINDOW: usize = 8;
+/// Tokens are kept in thousandths of a line, which makes the refill of a
+/// millisecond a whole number of tokens
+const SCALE: u64 = 1000;
+const MAX_PEERS: usize = 4096;
+/// High word of a process peer, ffff:ffff:ffff:ffff::/64 never being the
+/// address of a peer
+const PROCESS_PEER: u64 = u64::MAX;
+
+/// The source a limit applies to
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Peer {
+    /// A TCP or UDP peer, by address
+    Ip(IpAddr),
+    /// A unix socket peer, by its process credentials
+    Process { uid: u32, pid: i32 },
+}
+
+impl Peer {
+    fn encode(&self) -> (u64, u64) {
+        match self {
+            Peer::Ip(addr) => {
+                let v6 = match addr {
+                    IpAddr::V4(v4) => v4.to_ipv6_mapped(),
+                    IpAddr::V6(v6) => *v6,
+                };
+                let bits = u128::from(v6);
+                ((bits >> 64) as u64, bits as u64)
+            }
+            Peer::Process { uid, pid } => (PROCESS_PEER, (*uid as u64) << 32 | *pid as u32 as u64),
+        }
+    }
+
+    fn decode(hi: u64, lo: u64) -> Self {
+        if hi == PROCESS_PEER {
+            return Peer::Process {
+                uid: (lo >> 32) as u32,
+                pid: lo as u32 as i32,
+            };
+        }
+        let v6 = Ipv6Addr::from((hi as u128) << 64 | lo as u128);
+        match v6.to_ipv4() {
+            Some(v4) if v6.segments()[5] == 0xffff => Peer::Ip(IpAddr::V4(v4)),
+            _ => Peer::Ip(IpAddr::V6(v6)),
+        }
+    }
+}
+
+impl fmt::Display for Peer {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Peer::Ip(addr) => write!(f, "{}", addr),
+            Peer::Process { uid, pid } => write!(f, "pid {} uid {}", pid, uid),
+        }
+    }
+}
+
+fn mix(mut x: u64) -> u64 {
+    x ^= x >> 33;
+    x = x.wrapping_mul(0xff51_afd7_ed55_8ccd);
+    x ^= x >> 33;
+    x = x.wrapping_mul(0xc4ce_b9fe_1a85_ec53);
+    x ^ (x >> 33)
+}
+
+#[derive(Default)]
+struct Slot {
+    /// Hash of the peer owning the slot, never 0 for an owned slot
+    hash: AtomicU64,
+    peer_hi: AtomicU64,
+    peer_lo: AtomicU64,
+    /// Tokens in the high half, and the millisecond of the last refill in
+    /// the low half
+    bucket: AtomicU64,
+    admitted: AtomicU64,
+    dropped: AtomicU64,
+}
+
+/// Lines admitted and dropped for one peer
+#[derive(Debug, Clone, PartialEq)]
+pub struct Talker {
+    pub peer: Peer,
+    pub admitted: u64,
+    pub dropped: u64,
+}
+
+pub struct Limiter {
+    slots: Box<[Slot]>,
+    mask: usize,
+    /// Tokens refilled per millisecond
+    rate: u64,
+    capacity: u64,
+    action: RateLimitAction,
+    epoch: Instant,
+    evictions: stats::Counter,
+}
+
+impl Limiter {
+    pub fn new(stats: stats::Scope, config: &RateLimitConfig) -> Self {
+        let size = config
+            .max_peers
+            .unwrap_or(MAX_PEERS)
+            .max(WINDOW)
+            .next_power_of_two();
+        let burst = config.burst.unwrap_or(config.lines_per_second).max(1) as u64;
+        Limiter {
+            slots: (0..size).map(|_| Slot::default()).collect(),
+            mask: size - 1,
+            rate: config.lines_per_second as u64,
+            // The token count has to fit the high half of a bucket
+            capacity: (burst * SCALE).min(u32::MAX as u64),
+            action: config.action,
+            epoch: Instant::now(),
+            evictions: stats.counter("evictions").unwrap(),
+        }
+    }
+
+    pub fn action(&self) -> RateLimitAction {
+        self.action
+    }
+
+    /// Milliseconds since the limiter was created, wrapping after 49 days.
+    /// A peer idle for that long may be refilled short of a full bucket.
+    fn now(&self) -> u32 {
+        self.epoch.elapsed().as_millis() as u32
+    }
+
+    fn slot(&self, peer: Peer, now: u32) -> &Slot {
+        let (hi, lo) = peer.encode();
+        let hash = mix(hi ^ mix(lo)) | 1;
+        let start = hash as usize;
+        let mut oldest = start & self.mask;
+        let mut oldest_age = 0;
+        for probe in 0..WINDOW {
+            let index = start.wrapping_add(probe) & self.mask;
+            let slot = &self.slots[index];
+            let owner = match slot.hash.load(Acquire) {
+                0 => match slot.hash.compare_exchange(0, hash, AcqRel, Acquire) {
+                    Ok(_) => return self.claim(slot, hi, lo, now),
+                    Err(owner) => owner,
+                },
+                owner => owner,
+            };
+            if owner == hash {
+                return slot;
+            }
+            let age = now.wrapping_sub(slot.bucket.load(Relaxed) as u32);
+            if age >= oldest_age {
+                oldest = index;
+                oldest_age = age;
+            }
+        }
+        // Take over the least recently refilled slot of the window
+        self.evictions.inc();
+        let slot = &self.slots[oldest];
+        slot.hash.store(hash, Release);
+        self.claim(slot, hi, lo, now)
+    }
+
+    fn claim<'a>(&self, slot: &'a Slot, hi: u64, lo: u64, now: u32) -> &'a Slot {
+        slot.peer_hi.store(hi, Relaxed);
+        slot.peer_lo.store(lo, Relaxed);
+        slot.admitted.store(0, Relaxed);
+        slot.dropped.store(0, Relaxed);
+        slot.bucket.store(self.capacity << 32 | now as u64, Release);
+        slot
+    }
+
+    /// Take the tokens for up to `lines` lines from the bucket of a peer,
+    /// returning how many of the lines are admitted
+    pub fn admit(&self, peer: Peer, lines: usize) -> usize {
+        let now = self.now();
+        let slot = self.slot(peer, now);
+        let mut current = slot.bucket.load(Acquire);
+        loop {
+            // Another thread may have refilled the bucket at a later
+            // millisecond than this one read the clock
+            let last = current as u32;
+            let (elapsed, refilled) = match now.wrapping_sub(last) {
+                behind if behind > u32::MAX / 2 => (0, last),
+                elapsed => (elapsed as u64, now),
+            };
+            let tokens = (current >> 32)
+                .saturating_add(elapsed.saturating_mul(self.rate))
+                .min(self.capacity);
+            let admitted = (tokens / SCALE).min(lines as u64);
+            let next = (tokens - admitted * SCALE) << 32 | refilled as u64;
+            match slot
+                .bucket
+                .compare_exchange_weak(current, next, AcqRel, Acquire)
+            {
+                Ok(_) => {
+                    slot.admitted.fetch_add(admitted, Relaxed);
+                    slot.dropped.fetch_add(lines as u64 - admitted, Relaxed);
+                    return admitted as usize;
+                }
+                Err(actual) => current = actual,
+            }
+        }
+    }
+
+    /// The peers which sent the most lines since they were last taken into
+    /// the table, most first
+    pub fn top_talkers(&self, count: usize) -> Vec<Talker> {
+        let mut talkers: Vec<Talker> = self
+            .slots
+            .iter()
+            .filter(|slot| slot.hash.load(Acquire) != 0)
+            .map(|slot| Talker {
+                peer: Peer::decode(slot.peer_hi.load(Relaxed), slot.peer_lo.load(Relaxed)),
+                admitted: slot.admitted.load(Relaxed),
+                dropped: slot.dropped.load(Relaxed),
+            })
+            .collect();
+        talkers.sort_by_key(|t| std::cmp::Reverse(t.admitted + t.dropped));
+        talkers.truncate(count);
+        talkers
+    }
+}
+
+/// The limiters of every server by name. The copies of a server running on
+/// different cores share one limiter, so a peer gets the configured rate in
+/// total rather than per core.
+#[derive(Clone, Default)]
+pub struct Registry {
+    limiters: Arc<Mutex<HashMap<String, Arc<Limiter>>>>,
+}
+
+impl Registry {
+    /// The limiter of a server, created from the config on first use
+    pub fn limiter(
+        &self,
+        stats: stats::Scope,
+        server: &str,
+        config: &RateLimitConfig,
+    ) -> Arc<Limiter> {
+        self.limiters
+            .lock()
+            .entry(server.to_owned())
+            .or_insert_with(|| Arc::new(Limiter::new(stats, config)))
+            .clone()
+    }
+
+    /// The top talkers of every server, by server name
+    pub fn top_talkers(&self, count: usize) -> Vec<(String, Vec<Talker>)> {
+        let mut servers: Vec<_> = self
+            .limiters
+            .lock()
+            .iter()
+            .map(|(name, limiter)| (name.clone(), limiter.top_talkers(count)))
+            .collect();
+        servers.sort_by(|a, b| a.0.cmp(&b.0));
+        servers
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+
+    fn make_limiter(lines_per_second: u32, burst: u32, max_peers: usize) -> Limiter {
+        Limiter::new(
+            stats::Collector::default().scope("test"),
+            &RateLimitConfig {
+                lines_per_second,
+                burst: Some(burst),
+                action: RateLimitAction::Drop,
+                max_peers: Some(max_peers),
+            },
+        )
+    }
+
+    #[test]
+    fn peer_encoding() {
+        let peers = vec![
+            Peer::Ip("10.1.2.3".parse().unwrap()),
+            Peer::Ip("2001:db8::1".parse().unwrap()),
+            Peer::Process { uid: 1000, pid: -1 },
+        ];
+        for peer in peers {
+            let (hi, lo) = peer.encode();
+            assert_eq!(Peer::decode(hi, lo), peer);
+        }
+    }
+
+    #[test]
+    fn burst_then_refill() {
+        let limiter = make_limiter(1000, 10, 64);
+        let peer = Peer::Ip("10.0.0.1".parse().unwrap());
+        let other = Peer::Ip("10.0.0.2".parse().unwrap());
+        assert_eq!(limiter.admit(peer, 6), 6);
+        assert_eq!(limiter.admit(peer, 6), 4);
+        // Buckets are per peer
+        assert_eq!(limiter.admit(other, 6), 6);
+        std::thread::sleep(std::time::Duration::from_millis(20));
+        assert_eq!(limiter.admit(peer, 100), 10);
+
+        let talkers = limiter.top_talkers(1);
+        assert_eq!(
+            talkers,
+            vec![Talker {
+                peer,
+                admitted: 20,
+                dropped: 92,
+            }]
+        );
+    }
+
+    #[test]
+    fn full_table_evicts() {
+        let limiter = make_limiter(1, 1, WINDOW);
+        for i in 0..(WINDOW as u32 * 4) {
+            let peer = Peer::Process {
+                uid: 0,
+                pid: i as i32,
+            };
+            // Every new peer gets a bucket, taking over an old one when full
+            assert_eq!(limiter.admit(peer, 1), 1);
+        }
+        assert_eq!(limiter.top_talkers(usize::MAX).len(), WINDOW);
+    }
+}
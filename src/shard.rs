@@ -6,7 +6,13 @@ use crate::statsd_proto::Pdu;
 const HASHLIB_SEED: u32 = 0xaccd3d34;
 
 pub fn statsrelay_compat_hash(pdu: &Pdu) -> u32 {
-    murmur3::murmur3_32(&mut Cursor::new(pdu.name()), HASHLIB_SEED).unwrap_or(0)
+    statsrelay_compat_hash_name(pdu.name())
+}
+
+/// Hash a statsd name the way [`statsrelay_compat_hash`](statsrelay_compat_hash)
+/// hashes the name of a PDU
+pub fn statsrelay_compat_hash_name(name: &[u8]) -> u32 {
+    murmur3::murmur3_32(&mut Cursor::new(name), HASHLIB_SEED).unwrap_or(0)
 }
 
 pub struct Ring<C: Send + Sync + 'static> {
@@ -1,5 +1,6 @@
 use std::sync::Arc;
 
+use dashmap::mapref::entry::Entry;
 use dashmap::DashMap;
 use prometheus::{Encoder, Registry, TextEncoder};
 
@@ -21,6 +22,7 @@ pub struct Collector {
     registry: Registry,
     counters: Arc<DashMap<String, Counter>>,
     gauges: Arc<DashMap<String, Gauge>>,
+    histograms: Arc<DashMap<String, Histogram>>,
 }
 
 impl Default for Collector {
@@ -29,6 +31,7 @@ impl Default for Collector {
             registry: Registry::new(),
             counters: Arc::new(DashMap::new()),
             gauges: Arc::new(DashMap::new()),
+            histograms: Arc::new(DashMap::new()),
         }
     }
 }
@@ -54,13 +57,14 @@ impl Collector {
 
     /// Attempt to register a new counter. If the counter already exists, it
     /// will return the previously registered counter instead of the one passed
-    /// in.
+    /// in. The entry stays locked while registering, so threads racing to
+    /// create the same counter all get the one registered.
     fn register_counter(&self, c: Counter) -> anyhow::Result<Counter> {
-        let counter = match self.counters.get(&c.name) {
-            Some(counter) => counter.clone(),
-            None => {
+        let counter = match self.counters.entry(c.name.clone()) {
+            Entry::Occupied(entry) => entry.get().clone(),
+            Entry::Vacant(entry) => {
                 self.registry.register(Box::new(c.clone().counter))?;
-                self.counters.insert(c.name.clone(), c.clone());
+                entry.insert(c.clone());
                 c
             }
         };
@@ -69,16 +73,28 @@ impl Collector {
     }
 
     fn register_gauge(&self, g: Gauge) -> anyhow::Result<Gauge> {
-        let gauge = match self.gauges.get(&g.name) {
-            Some(gauge) => gauge.clone(),
-            None => {
+        let gauge = match self.gauges.entry(g.name.clone()) {
+            Entry::Occupied(entry) => entry.get().clone(),
+            Entry::Vacant(entry) => {
                 self.registry.register(Box::new(g.clone().gauge))?;
-                self.gauges.insert(g.name.clone(), g.clone());
+                entry.insert(g.clone());
                 g
             }
         };
         Ok(gauge)
     }
+
+    fn register_histogram(&self, h: Histogram) -> anyhow::Result<Histogram> {
+        let histogram = match self.histograms.entry(h.name.clone()) {
+            Entry::Occupied(entry) => entry.get().clone(),
+            Entry::Vacant(entry) => {
+                self.registry.register(Box::new(h.clone().histogram))?;
+                entry.insert(h.clone());
+                h
+            }
+        };
+        Ok(histogram)
+    }
 }
 
 #[derive(Clone, Debug)]
@@ -110,6 +126,14 @@ impl Scope {
         let gauge = Gauge::new(name.as_str())?;
         self.collector.register_gauge(gauge)
     }
+
+    /// Create a new histogram with the given scope and bucket upper bounds, or
+    /// return the existing histogram with the same name
+    pub fn histogram(&self, name: &str, buckets: &[f64]) -> anyhow::Result<Histogram> {
+        let name = format!("{}{}{}", self.scope, SEP, name);
+        let histogram = Histogram::new(name.as_str(), buckets)?;
+        self.collector.register_histogram(histogram)
+    }
 }
 
 #[derive(Clone, Debug)]
@@ -136,6 +160,38 @@ impl Gauge {
     }
 }
 
+#[derive(Clone, Debug)]
+pub struct Histogram {
+    name: String,
+    histogram: prometheus::Histogram,
+}
+
+impl Histogram {
+    fn new(name: &str, buckets: &[f64]) -> anyhow::Result<Self> {
+        let opts = prometheus::HistogramOpts::new(name.to_owned(), "a histogram")
+            .buckets(buckets.to_vec());
+        Ok(Self {
+            name: name.to_owned(),
+            histogram: prometheus::Histogram::with_opts(opts)?,
+        })
+    }
+
+    /// Record an observation
+    pub fn observe(&self, value: f64) {
+        self.histogram.observe(value)
+    }
+
+    /// Return the number of observations recorded
+    pub fn count(&self) -> u64 {
+        self.histogram.get_sample_count()
+    }
+
+    /// Return the sum of all observations recorded
+    pub fn sum(&self) -> f64 {
+        self.histogram.get_sample_sum()
+    }
+}
+
 #[derive(Clone, Debug)]
 pub struct Counter {
     name: String,
@@ -183,6 +239,35 @@ pub mod test {
         assert_eq!(ctr1.get(), 2_f64);
     }
 
+    #[test]
+    pub fn test_concurrent_registration() {
+        let collector = Collector::default();
+        let threads: Vec<_> = (0..8)
+            .map(|_| {
+                let scope = collector.scope("prefix");
+                std::thread::spawn(move || {
+                    for x in 0..100 {
+                        scope.counter(&format!("counter{}", x)).unwrap().inc();
+                        scope.gauge(&format!("gauge{}", x)).unwrap();
+                        scope
+                            .histogram(&format!("histogram{}", x), &[1_f64])
+                            .unwrap();
+                    }
+                })
+            })
+            .collect();
+        for thread in threads {
+            thread.join().unwrap();
+        }
+        let scope = collector.scope("prefix");
+        for x in 0..100 {
+            assert_eq!(
+                scope.counter(&format!("counter{}", x)).unwrap().get(),
+                8_f64
+            );
+        }
+    }
+
     #[test]
     pub fn test_gauge() {
         let collector = Collector::default();
@@ -195,4 +280,18 @@ pub mod test {
         ctr2.set(13_f64);
         assert_eq!(ctr1.get(), 13_f64);
     }
+
+    #[test]
+    pub fn test_histogram() {
+        let collector = Collector::default();
+        let scope = collector.scope("prefix");
+        let h1 = scope.histogram("histogram", &[1_f64, 10_f64]).unwrap();
+        h1.observe(2_f64);
+        let h2 = scope.histogram("histogram", &[1_f64, 10_f64]).unwrap();
+        // Ensure we have the same histogram object
+        assert_eq!(h2.count(), 1);
+        h2.observe(3_f64);
+        assert_eq!(h1.count(), 2);
+        assert_eq!(h1.sum(), 5_f64);
+    }
 }
@@ -5,21 +5,97 @@ use regex::bytes::RegexSet;
 
 use crate::config;
 use crate::discovery;
-use crate::shard::{statsrelay_compat_hash, Ring};
+use crate::shard::{statsrelay_compat_hash_name, Ring};
 use crate::stats;
-use crate::statsd_client::StatsdClient;
+use crate::statsd_client::{StatsdClient, WireFormat};
 use crate::statsd_proto;
-use crate::statsd_proto::Event;
+use crate::statsd_proto::{Event, Parsed};
 
 use log::warn;
 
+const SAMPLING_QUEUE_FILL: f64 = 0.5;
+const SAMPLING_MIN_RATE: f64 = 0.01;
+
+/// Samples counters and timers bound for a client in proportion to how full
+/// its send queue is. Forwarded lines carry their sample rate multiplied by
+/// the rate applied, so downstream estimates stay unbiased.
+struct AdaptiveSampler {
+    queue_fill: f64,
+    min_rate: f64,
+}
+
+impl AdaptiveSampler {
+    fn new(config: &config::AdaptiveSampling) -> Self {
+        AdaptiveSampler {
+            queue_fill: config
+                .queue_fill
+                .unwrap_or(SAMPLING_QUEUE_FILL)
+                .max(0_f64)
+                .min(1_f64),
+            min_rate: config
+                .min_rate
+                .unwrap_or(SAMPLING_MIN_RATE)
+                .max(f64::MIN_POSITIVE)
+                .min(1_f64),
+        }
+    }
+
+    /// Sample rate for a queue this full, falling geometrically from 1 where
+    /// sampling starts to the minimum rate for a full queue
+    fn rate(&self, queue_fill: f64) -> f64 {
+        if queue_fill <= self.queue_fill {
+            return 1_f64;
+        }
+        let pressure = ((queue_fill - self.queue_fill) / (1_f64 - self.queue_fill)).min(1_f64);
+        self.min_rate.powf(pressure)
+    }
+
+    /// Decide whether to forward an event, returning it with its sample rate
+    /// adjusted, or none if it is sampled out
+    fn sample(&self, event: Event, queue_fill: f64) -> Option<Event> {
+        let rate = self.rate(queue_fill);
+        if rate >= 1_f64 {
+            return Some(event);
+        }
+        // Gauges and sets can't be scaled back up downstream
+        let (mtype, sample_rate): (&[u8], f64) = match &event {
+            Event::Pdu(pdu) => (pdu.pdu_type(), pdu.sample_rate_value()),
+            Event::Parsed(owned) => (
+                owned.metric_type().into(),
+                owned.sample_rate().unwrap_or(1_f64),
+            ),
+        };
+        match mtype {
+            b"c" | b"ms" => (),
+            _ => return Some(event),
+        }
+        // A line without room for its adjusted rate is never sampled, as it
+        // couldn't be forwarded with a rate standing for the lines dropped
+        if let Event::Pdu(pdu) = &event {
+            if pdu.len() + statsd_proto::MAX_NUMBER_LENGTH + 2 > statsd_proto::MAX_PDU_LENGTH {
+                return Some(event);
+            }
+        }
+        if fastrand::f64() >= rate {
+            return None;
+        }
+        let sample_rate = sample_rate * rate;
+        Some(match event {
+            Event::Pdu(pdu) => Event::Pdu(pdu.with_sample_rate(sample_rate).ok()?),
+            Event::Parsed(owned) => Event::Parsed(owned.with_sample_rate(sample_rate)),
+        })
+    }
+}
+
 pub struct StatsdBackend {
-    conf: config::StatsdBackendConfig,
     ring: Ring<StatsdClient>,
     input_filter: Option<RegexSet>,
+    sampler: Option<AdaptiveSampler>,
     warning_log: AtomicU64,
     backend_sends: stats::Counter,
     backend_fails: stats::Counter,
+    backend_oversize: stats::Counter,
+    backend_sampled: stats::Counter,
 }
 
 impl StatsdBackend {
@@ -53,30 +129,62 @@ impl StatsdBackend {
         let use_endpoints = discovery_update
             .map(|u| u.sources())
             .unwrap_or(&conf.shard_map);
+        let prefix = conf
+            .prefix
+            .as_ref()
+            .map(|p| p.as_bytes())
+            .unwrap_or_default();
+        let suffix = conf
+            .suffix
+            .as_ref()
+            .map(|s| s.as_bytes())
+            .unwrap_or_default();
+        let wire = WireFormat {
+            protocol: conf.protocol.unwrap_or_default(),
+            zstd_level: match conf.compression.unwrap_or_default() {
+                config::Compression::None => None,
+                config::Compression::Zstd => Some(
+                    conf.compression_level
+                        .unwrap_or(zstd::DEFAULT_COMPRESSION_LEVEL),
+                ),
+            },
+        };
         for endpoint in use_endpoints {
             if endpoint.is_empty() {
                 continue;
             }
-            if let Some(client) = memoize.get(endpoint) {
-                ring.push(client.clone())
-            } else {
-                let client = StatsdClient::new(
-                    stats.scope("statsd_client"),
-                    endpoint.as_str(),
-                    conf.max_queue.unwrap_or(100000) as usize,
-                );
-                memoize.insert(endpoint.clone(), client.clone());
-                ring.push(client);
+            // Clients attach the prefix and suffix while sending, so they
+            // can only be reused if those and the wire format are unchanged
+            match memoize.get(endpoint) {
+                Some(client)
+                    if client.affixes() == (prefix, suffix) && client.wire_format() == wire =>
+                {
+                    ring.push(client.clone());
+                }
+                _ => {
+                    let client = StatsdClient::new(
+                        stats.scope("statsd_client"),
+                        endpoint.as_str(),
+                        conf.max_queue.unwrap_or(100000) as usize,
+                        prefix,
+                        suffix,
+                        wire,
+                    );
+                    memoize.insert(endpoint.clone(), client.clone());
+                    ring.push(client);
+                }
             }
         }
 
         let backend = StatsdBackend {
-            conf: conf.clone(),
             ring,
             input_filter,
+            sampler: conf.adaptive_sampling.as_ref().map(AdaptiveSampler::new),
             warning_log: AtomicU64::new(0),
             backend_fails: stats.counter("backend_fails").unwrap(),
             backend_sends: stats.counter("backend_sends").unwrap(),
+            backend_oversize: stats.counter("backend_oversize").unwrap(),
+            backend_sampled: stats.counter("backend_sampled").unwrap(),
         };
 
         Ok(backend)
@@ -95,12 +203,28 @@ impl StatsdBackend {
         memoize
     }
 
+    /// Fraction in use of the fullest send queue of the backend
+    pub fn queue_fill(&self) -> f64 {
+        (0..self.ring.len())
+            .map(|i| self.ring.pick_from(i as u32).queue_fill())
+            .fold(0.0, f64::max)
+    }
+
     pub fn provide_statsd(&self, input: &Event) {
-        let pdu: statsd_proto::Pdu = input.into();
+        let name = match input {
+            Event::Pdu(pdu) => pdu.name(),
+            Event::Parsed(owned) => {
+                if owned.encoded_len() > statsd_proto::MAX_PDU_LENGTH {
+                    self.backend_oversize.inc();
+                    return;
+                }
+                owned.name()
+            }
+        };
         if !self
             .input_filter
             .as_ref()
-            .map_or(true, |inf| inf.is_match(pdu.name()))
+            .map_or(true, |inf| inf.is_match(name))
         {
             return;
         }
@@ -109,29 +233,24 @@ impl StatsdBackend {
         let code = match ring_read.len() {
             0 => return, // In case of nothing to send, do nothing
             1 => 1_u32,
-            _ => statsrelay_compat_hash(&pdu),
+            _ => statsrelay_compat_hash_name(name),
         };
         let client = ring_read.pick_from(code);
+        let event = match self.sampler.as_ref() {
+            None => input.clone(),
+            Some(sampler) => match sampler.sample(input.clone(), client.queue_fill()) {
+                Some(event) => event,
+                None => {
+                    self.backend_sampled.inc();
+                    return;
+                }
+            },
+        };
         let sender = client.sender();
 
-        // Assign prefix and/or suffix
-        let pdu_clone = if self.conf.prefix.is_some() || self.conf.suffix.is_some() {
-            pdu.with_prefix_suffix(
-                self.conf
-                    .prefix
-                    .as_ref()
-                    .map(|p| p.as_bytes())
-                    .unwrap_or_default(),
-                self.conf
-                    .suffix
-                    .as_ref()
-                    .map(|s| s.as_bytes())
-                    .unwrap_or_default(),
-            )
-        } else {
-            pdu
-        };
-        match sender.try_send(pdu_clone) {
+        // The client writes the event into its send buffer, attaching any
+        // prefix and suffix, so parsed events are serialized only there
+        match sender.try_send(event) {
             Err(_e) => {
                 self.backend_fails.inc();
                 let count = self
@@ -151,3 +270,53 @@ impl StatsdBackend {
         }
     }
 }
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use bytes::Bytes;
+    use statsd_proto::Pdu;
+    use std::convert::TryInto;
+
+    #[test]
+    fn adaptive_sampling() {
+        let sampler = AdaptiveSampler::new(&config::AdaptiveSampling {
+            queue_fill: Some(0.5),
+            min_rate: Some(0.01),
+        });
+        assert_eq!(sampler.rate(0.5), 1_f64);
+        assert!((sampler.rate(0.75) - 0.1).abs() < 1e-9);
+        assert!((sampler.rate(1_f64) - 0.01).abs() < 1e-9);
+
+        let counter = Pdu::parse(Bytes::from_static(b"hits:1|c|@0.5")).unwrap();
+        let parsed: statsd_proto::Owned = (&counter).try_into().unwrap();
+        let gauge = Event::Pdu(Pdu::parse(Bytes::from_static(b"level:1|g")).unwrap());
+        for counter in vec![Event::Pdu(counter), Event::Parsed(parsed)] {
+            let mut forwarded = 0;
+            let mut estimate = 0_f64;
+            for _ in 0..10000 {
+                if let Some(event) = sampler.sample(counter.clone(), 0.75) {
+                    let owned: statsd_proto::Owned = (&event).try_into().unwrap();
+                    forwarded += 1;
+                    estimate += 1_f64 / owned.sample_rate().unwrap();
+                }
+                // Gauges always pass
+                assert!(sampler.sample(gauge.clone(), 1_f64).is_some());
+            }
+            // About a tenth is forwarded, each standing for 20 original lines
+            assert!(forwarded > 800 && forwarded < 1200);
+            assert!(estimate > 16000_f64 && estimate < 24000_f64);
+        }
+
+        // A counter too long to take a rewritten rate passes unsampled
+        let mut line = vec![b'a'; statsd_proto::MAX_PDU_LENGTH - 10];
+        line.extend_from_slice(b":1|c|@0.5");
+        let long = Pdu::parse(Bytes::from(line)).unwrap();
+        for _ in 0..100 {
+            match sampler.sample(Event::Pdu(long.clone()), 1_f64) {
+                Some(Event::Pdu(pdu)) => assert_eq!(pdu.sample_rate_value(), 0.5),
+                _ => panic!("long counter was sampled"),
+            }
+        }
+    }
+}
@@ -7,58 +7,207 @@ use tokio::select;
 use tokio::sync::mpsc;
 use tokio::time::{sleep, timeout};
 
+use std::convert::TryFrom;
 use std::sync::Arc;
 use std::time::Duration;
 
+use crate::config::Protocol;
 use crate::stats;
-use crate::statsd_proto::Pdu;
+use crate::statsd_proto::binary;
+use crate::statsd_proto::compression::Compressor;
+use crate::statsd_proto::{Event, Pdu};
 
 use log::{info, warn};
 
 pub struct StatsdClient {
-    sender: mpsc::Sender<Pdu>,
+    sender: mpsc::Sender<Event>,
     inner: Arc<StatsdClientInner>,
 }
 
 struct StatsdClientInner {
     endpoint: String,
-    sender: mpsc::Sender<Pdu>,
+    prefix: Bytes,
+    suffix: Bytes,
+    wire: WireFormat,
+    sender: mpsc::Sender<Event>,
+    queue_size: usize,
     _trig: Trigger,
 }
 
+/// How a client encodes its output on the wire
+#[derive(Debug, Clone, Copy, PartialEq, Default)]
+pub struct WireFormat {
+    pub protocol: Protocol,
+    /// zstd compression level, if connections are compressed
+    pub zstd_level: Option<i32>,
+}
+
+impl WireFormat {
+    /// Preamble flags announcing the format, where plain text has none and is
+    /// sent without a preamble, so that any statsd server understands it
+    fn flags(&self) -> u8 {
+        let binary = match self.protocol {
+            Protocol::Text => 0,
+            Protocol::Binary => binary::FLAG_BINARY,
+        };
+        binary | self.zstd_level.map_or(0, |_| binary::FLAG_ZSTD)
+    }
+}
+
+/// Output handed from the client task to the sender task in one write
+enum Batch {
+    /// Newline terminated lines, with affixes already attached
+    Lines(Bytes),
+    /// PDUs to be encoded as a binary frame for the current connection
+    Pdus(Vec<Pdu>),
+}
+
+/// Accumulates output in the client's protocol until it is worth sending
+struct Batcher {
+    protocol: Protocol,
+    prefix: Bytes,
+    suffix: Bytes,
+    lines: BytesMut,
+    pdus: Vec<Pdu>,
+    pdu_bytes: usize,
+}
+
+impl Batcher {
+    fn new(protocol: Protocol, prefix: Bytes, suffix: Bytes) -> Self {
+        Batcher {
+            protocol,
+            prefix,
+            suffix,
+            lines: BytesMut::with_capacity(INITIAL_BUF_CAPACITY),
+            pdus: Vec::new(),
+            pdu_bytes: 0,
+        }
+    }
+
+    fn push(&mut self, event: Event) {
+        match (self.protocol, event) {
+            (Protocol::Text, Event::Pdu(pdu)) => {
+                let line_len = pdu.len() + self.prefix.len() + self.suffix.len() + 1;
+                if self.lines.remaining_mut() < line_len {
+                    self.lines.reserve(line_len + 10);
+                }
+                pdu.write_with_affixes(&mut self.lines, &self.prefix, &self.suffix);
+                self.lines.put(b"\n".as_ref());
+            }
+            // Parsed events are serialized straight into the send buffer,
+            // which grows as they are written
+            (Protocol::Text, Event::Parsed(owned)) => {
+                owned.write_with_affixes(&mut self.lines, &self.prefix, &self.suffix);
+                self.lines.put(b"\n".as_ref());
+            }
+            (Protocol::Binary, event) => {
+                // Backends drop parsed events too long for a PDU
+                if let Ok(pdu) = Pdu::try_from(&event) {
+                    self.pdu_bytes += pdu.len();
+                    self.pdus.push(pdu);
+                }
+            }
+        }
+    }
+
+    /// Approximate size of the pending output, in bytes
+    fn len(&self) -> usize {
+        self.lines.len() + self.pdu_bytes
+    }
+
+    fn is_empty(&self) -> bool {
+        self.lines.is_empty() && self.pdus.is_empty()
+    }
+
+    fn take(&mut self) -> Batch {
+        match self.protocol {
+            Protocol::Text => Batch::Lines(
+                std::mem::replace(
+                    &mut self.lines,
+                    BytesMut::with_capacity(INITIAL_BUF_CAPACITY),
+                )
+                .freeze(),
+            ),
+            Protocol::Binary => {
+                self.pdu_bytes = 0;
+                Batch::Pdus(std::mem::take(&mut self.pdus))
+            }
+        }
+    }
+}
+
 const RECONNECT_DELAY: Duration = Duration::from_secs(5);
 const CONNECT_TIMEOUT: Duration = Duration::from_secs(15);
-const SEND_DELAY: Duration = Duration::from_millis(500);
+pub(crate) const SEND_DELAY: Duration = Duration::from_millis(500);
 const SEND_THRESHOLD: usize = 10 * 1024;
 const INITIAL_BUF_CAPACITY: usize = SEND_THRESHOLD + 1024;
 
 impl StatsdClient {
-    pub fn new(stats: stats::Scope, endpoint: &str, channel_buffer: usize) -> Self {
+    /// Create a client sending to an endpoint in the given wire format. The
+    /// prefix and suffix are attached to the name of every PDU as it is copied
+    /// into the send buffer.
+    pub fn new(
+        stats: stats::Scope,
+        endpoint: &str,
+        channel_buffer: usize,
+        prefix: &[u8],
+        suffix: &[u8],
+        wire: WireFormat,
+    ) -> Self {
         // Currently, we need this tripwire to abort connection looping. This can probably be refactored
         let (trig, trip) = Tripwire::new();
-        let (sender, recv) = mpsc::channel::<Pdu>(channel_buffer);
+        let (sender, recv) = mpsc::channel::<Event>(channel_buffer);
+        let prefix = Bytes::copy_from_slice(prefix);
+        let suffix = Bytes::copy_from_slice(suffix);
         let inner = StatsdClientInner {
             endpoint: endpoint.to_string(),
+            prefix: prefix.clone(),
+            suffix: suffix.clone(),
+            wire,
             sender: sender.clone(),
+            queue_size: channel_buffer,
             _trig: trig,
         };
         let eps = String::from(endpoint);
         let (ticker_sender, ticker_recv) = mpsc::channel::<bool>(1);
         tokio::spawn(ticker(eps.clone(), ticker_sender));
-        tokio::spawn(client_task(stats, eps, trip, recv, ticker_recv));
+        tokio::spawn(client_task(
+            stats,
+            eps,
+            trip,
+            recv,
+            ticker_recv,
+            wire,
+            Batcher::new(wire.protocol, prefix, suffix),
+        ));
         StatsdClient {
             inner: Arc::new(inner),
             sender,
         }
     }
 
-    pub fn sender(&self) -> mpsc::Sender<Pdu> {
+    pub fn sender(&self) -> mpsc::Sender<Event> {
         self.sender.clone()
     }
 
     pub fn endpoint(&self) -> &str {
         self.inner.endpoint.as_str()
     }
+
+    /// The prefix and suffix this client attaches to every name
+    pub fn affixes(&self) -> (&[u8], &[u8]) {
+        (self.inner.prefix.as_ref(), self.inner.suffix.as_ref())
+    }
+
+    pub fn wire_format(&self) -> WireFormat {
+        self.inner.wire
+    }
+
+    /// Fraction of the send queue in use, from 0 to 1
+    pub fn queue_fill(&self) -> f64 {
+        let queued = self.inner.queue_size - self.sender.capacity();
+        queued as f64 / self.inner.queue_size.max(1) as f64
+    }
 }
 
 impl Clone for StatsdClient {
@@ -122,36 +271,128 @@ fn trim_to_next_newline(buf: &mut Bytes) {
     }
 }
 
+/// Encoding state of a single connection. Binary frames refer to
+/// dictionary entries defined earlier on the same connection, and a
+/// compressed stream can't be resumed, so every connection gets a new codec.
+struct Codec {
+    encoder: binary::Encoder,
+    compressor: Option<Compressor>,
+}
+
+impl Codec {
+    fn new(wire: WireFormat, prefix: &[u8], suffix: &[u8]) -> std::io::Result<Self> {
+        Ok(Codec {
+            encoder: binary::Encoder::new(prefix, suffix),
+            compressor: wire.zstd_level.map(Compressor::new).transpose()?,
+        })
+    }
+
+    /// Encode a batch for the connection, returning the bytes to write and
+    /// the length of the batch before compression
+    fn encode(&mut self, batch: &Batch) -> std::io::Result<(Bytes, usize)> {
+        let raw = match batch {
+            Batch::Lines(lines) => lines.clone(),
+            Batch::Pdus(pdus) => {
+                let mut frame = BytesMut::new();
+                self.encoder.encode_frame(pdus, &mut frame);
+                frame.freeze()
+            }
+        };
+        match self.compressor.as_mut() {
+            None => Ok((raw.clone(), raw.len())),
+            Some(compressor) => Ok((compressor.compress(&raw)?, raw.len())),
+        }
+    }
+}
+
+struct Connection {
+    stream: TcpStream,
+    codec: Codec,
+}
+
+/// Form a connection, announcing its wire format with a preamble unless it
+/// is plain text. If the tripwire is set, this returns none.
+async fn open_connection(
+    stats: stats::Scope,
+    endpoint: &str,
+    connect_tripwire: Tripwire,
+    wire: WireFormat,
+    prefix: &[u8],
+    suffix: &[u8],
+) -> Option<Connection> {
+    loop {
+        let mut stream = form_connection(stats.clone(), endpoint, connect_tripwire.clone()).await?;
+        let codec = match Codec::new(wire, prefix, suffix) {
+            Ok(codec) => codec,
+            Err(e) => {
+                warn!("codec setup error {} - {:?}", endpoint, e);
+                tokio::time::sleep(RECONNECT_DELAY).await;
+                continue;
+            }
+        };
+        if wire.flags() == 0 {
+            return Some(Connection { stream, codec });
+        }
+        match stream.write_all(&binary::preamble(wire.flags())).await {
+            Ok(()) => return Some(Connection { stream, codec }),
+            Err(e) => {
+                warn!("preamble write error {} - {:?}", endpoint, e);
+                tokio::time::sleep(RECONNECT_DELAY).await;
+            }
+        }
+    }
+}
+
 async fn client_sender(
     stats: stats::Scope,
     endpoint: String,
     connect_tripwire: Tripwire,
-    mut recv: mpsc::Receiver<bytes::Bytes>,
+    mut recv: mpsc::Receiver<Batch>,
+    wire: WireFormat,
+    prefix: Bytes,
+    suffix: Bytes,
 ) {
     let bytes_sent = stats.counter("bytes_sent").unwrap();
     let connections_aborted = stats.counter("connections_aborted").unwrap();
+    let batches_reencoded = stats.counter("batches_reencoded").unwrap();
+    let compression_input_bytes = stats.counter("compression_input_bytes").unwrap();
+    let compression_output_bytes = stats.counter("compression_output_bytes").unwrap();
+    let compression_ratio = stats.gauge("compression_ratio").unwrap();
 
     let first_connect_tripwire = connect_tripwire.clone();
-    let mut lazy_connect: Option<TcpStream> =
-        form_connection(stats.clone(), endpoint.as_str(), first_connect_tripwire).await;
+    let mut lazy_connect: Option<Connection> = open_connection(
+        stats.clone(),
+        endpoint.as_str(),
+        first_connect_tripwire,
+        wire,
+        &prefix,
+        &suffix,
+    )
+    .await;
 
     loop {
-        let mut buf = match recv.recv().await {
+        let batch = match recv.recv().await {
             None => {
                 info!("sender task {} exiting", endpoint);
                 return;
             }
             Some(p) => p,
         };
+        // The batch as encoded for the current connection
+        let mut encoded: Option<Bytes> = None;
         loop {
-            if buf.is_empty() {
-                break;
-            }
             let connect = match lazy_connect.as_mut() {
                 None => {
                     let reconnect_tripwire = connect_tripwire.clone();
-                    lazy_connect =
-                        form_connection(stats.clone(), endpoint.as_str(), reconnect_tripwire).await;
+                    lazy_connect = open_connection(
+                        stats.clone(),
+                        endpoint.as_str(),
+                        reconnect_tripwire,
+                        wire,
+                        &prefix,
+                        &suffix,
+                    )
+                    .await;
                     if lazy_connect.is_none() {
                         // Early check to see if the tripwire is set and bail
                         info!("sender task {} exiting", endpoint);
@@ -161,36 +402,71 @@ async fn client_sender(
                 }
                 Some(c) => c,
             };
+            if encoded.is_none() {
+                match connect.codec.encode(&batch) {
+                    Ok((bytes, raw_len)) => {
+                        if connect.codec.compressor.is_some() {
+                            compression_input_bytes.inc_by(raw_len as f64);
+                            compression_output_bytes.inc_by(bytes.len() as f64);
+                            compression_ratio.set(
+                                compression_input_bytes.get()
+                                    / compression_output_bytes.get().max(1_f64),
+                            );
+                        }
+                        encoded = Some(bytes);
+                    }
+                    Err(e) => {
+                        warn!(
+                            "encoding error {} - {:?}, reforming a connection",
+                            endpoint, e
+                        );
+                        lazy_connect = None;
+                        connections_aborted.inc();
+                        continue;
+                    }
+                }
+            }
+            let buf = encoded.as_mut().unwrap();
+            if buf.is_empty() {
+                break;
+            }
             // Write the buffer until success
-            let result = connect.write_buf(&mut buf).await;
-            match result {
+            let result = connect.stream.write_buf(buf).await;
+            let aborted = match result {
                 Ok(0) if !buf.is_empty() => {
                     // Write 0 error, abort the connection and try again
-                    lazy_connect = None;
-                    trim_to_next_newline(&mut buf);
-                    connections_aborted.inc();
-                    continue;
+                    true
                 }
                 Ok(bytes) if buf.is_empty() => {
                     bytes_sent.inc_by(bytes as f64);
-                    drop(buf);
                     break;
                 }
                 Ok(bytes) => {
                     bytes_sent.inc_by(bytes as f64);
-                    continue;
+                    false
                 }
                 Err(e) => {
                     warn!(
                         "write error {} - {:?}, reforming a connection with this buffer",
                         endpoint, e
                     );
-                    trim_to_next_newline(&mut buf);
-                    lazy_connect = None;
-                    connections_aborted.inc();
-                    continue;
+                    true
                 }
             };
+            if aborted {
+                lazy_connect = None;
+                connections_aborted.inc();
+                match batch {
+                    Batch::Lines(_) if wire.zstd_level.is_none() => trim_to_next_newline(buf),
+                    _ => {
+                        // The rest of a compressed stream or a binary frame
+                        // can't be resumed on a new connection, so the whole
+                        // batch is encoded again for it
+                        encoded = None;
+                        batches_reencoded.inc();
+                    }
+                }
+            }
         }
     }
 }
@@ -216,20 +492,24 @@ async fn client_task(
     stats: stats::Scope,
     endpoint: String,
     connect_tripwire: Tripwire,
-    mut recv: mpsc::Receiver<Pdu>,
+    mut recv: mpsc::Receiver<Event>,
     mut ticker_recv: mpsc::Receiver<bool>,
+    wire: WireFormat,
+    mut batcher: Batcher,
 ) {
     let backoff_send = stats.counter("send_backoff").unwrap();
     let delayed_sends = stats.counter("delayed_sends").unwrap();
     let messages_queued = stats.counter("messages_queued").unwrap();
 
-    let mut buf = BytesMut::with_capacity(INITIAL_BUF_CAPACITY);
     let (buf_sender, buf_recv) = mpsc::channel(10);
     tokio::spawn(client_sender(
         stats,
         endpoint.clone(),
         connect_tripwire,
         buf_recv,
+        wire,
+        batcher.prefix.clone(),
+        batcher.suffix.clone(),
     ));
 
     loop {
@@ -240,27 +520,22 @@ async fn client_task(
 
         match (pdu, timeout) {
             (Some(pdu), _) => {
-                let pdu_bytes = pdu.as_bytes();
-                if buf.remaining_mut() < pdu_bytes.len() {
-                    buf.reserve(pdu_bytes.len() + 10);
-                }
-                buf.put(pdu_bytes);
-                buf.put(b"\n".as_ref());
+                batcher.push(pdu);
                 messages_queued.inc();
-                if buf.len() < SEND_THRESHOLD {
+                if batcher.len() < SEND_THRESHOLD {
                     backoff_send.inc();
                     // Do not send now
                     continue;
                 }
             }
             (None, false) => {
-                if buf.is_empty() {
+                if batcher.is_empty() {
                     // No more queue, no more bytes, exit
                     info!("client task {} exiting", endpoint);
                     return;
                 }
             }
-            (None, true) if buf.is_empty() => {
+            (None, true) if batcher.is_empty() => {
                 continue;
             }
             (None, true) => {
@@ -268,10 +543,118 @@ async fn client_task(
                 // Timeout! Just go ahead and send whats in the buf now
             }
         };
-        if buf_sender.send(buf.freeze()).await.is_err() {
+        if buf_sender.send(batcher.take()).await.is_err() {
             info!("client task {} exiting", endpoint);
             return;
         }
-        buf = BytesMut::with_capacity(INITIAL_BUF_CAPACITY);
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+    use crate::statsd_proto::compression::Decompressor;
+    use bytes::Buf;
+    use tokio::io::AsyncReadExt;
+    use tokio::net::TcpListener;
+
+    #[tokio::test]
+    async fn affixes_applied_on_send() {
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let endpoint = listener.local_addr().unwrap().to_string();
+        let scope = crate::stats::Collector::default().scope("prefix");
+        let client = StatsdClient::new(
+            scope,
+            endpoint.as_str(),
+            10,
+            b"pre.",
+            b".suf",
+            WireFormat::default(),
+        );
+        assert_eq!(client.affixes(), (&b"pre."[..], &b".suf"[..]));
+
+        let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#tags:value|@1.0")).unwrap();
+        let parsed = crate::statsd_proto::Owned::try_from(&pdu).unwrap();
+        client.sender().send(Event::Pdu(pdu)).await.unwrap();
+        // Parsed events are serialized as they are written to the buffer
+        client.sender().send(Event::Parsed(parsed)).await.unwrap();
+
+        let (mut socket, _) = listener.accept().await.unwrap();
+        let expected =
+            b"pre.foo.bar.suf:3|c|#tags:value|@1.0\npre.foo.bar.suf:3|c|@1|#tags:value\n";
+        let mut received = vec![0_u8; expected.len()];
+        timeout(Duration::from_secs(5), socket.read_exact(&mut received))
+            .await
+            .unwrap()
+            .unwrap();
+        assert_eq!(&received[..], &expected[..]);
+    }
+
+    /// Send two PDUs through a binary client and decode what it wrote
+    async fn send_binary(zstd_level: Option<i32>) -> Vec<Pdu> {
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let endpoint = listener.local_addr().unwrap().to_string();
+        let scope = crate::stats::Collector::default().scope("prefix");
+        let wire = WireFormat {
+            protocol: Protocol::Binary,
+            zstd_level,
+        };
+        let client = StatsdClient::new(scope, endpoint.as_str(), 10, b"pre.", b"", wire);
+        assert_eq!(client.wire_format(), wire);
+
+        let line = Bytes::from_static(b"foo.bar:3|c|#tags:value|@1.0");
+        for _ in 0..2 {
+            let pdu = Pdu::parse(line.clone()).unwrap();
+            client.sender().send(Event::Pdu(pdu)).await.unwrap();
+        }
+
+        let (mut socket, _) = listener.accept().await.unwrap();
+        let mut buf = BytesMut::new();
+        let read_timeout = Duration::from_secs(5);
+        while buf.len() < binary::PREAMBLE_LENGTH {
+            timeout(read_timeout, socket.read_buf(&mut buf))
+                .await
+                .unwrap()
+                .unwrap();
+        }
+        let flags = binary::read_preamble(&buf[..binary::PREAMBLE_LENGTH]).unwrap();
+        assert_eq!(flags, wire.flags());
+        buf.advance(binary::PREAMBLE_LENGTH);
+
+        let mut decompressor =
+            zstd_level.map(|_| Decompressor::new(binary::MAX_FRAME_LENGTH).unwrap());
+        let mut decoder = binary::Decoder::new();
+        let mut received = Vec::new();
+        loop {
+            let frames = match decompressor.as_mut() {
+                None => &mut buf,
+                Some(decompressor) => {
+                    decompressor.decompress(&buf.split()).unwrap();
+                    decompressor.output()
+                }
+            };
+            decoder
+                .decode(frames, |pdu| received.push(pdu.unwrap()))
+                .unwrap();
+            if received.len() == 2 {
+                return received;
+            }
+            timeout(read_timeout, socket.read_buf(&mut buf))
+                .await
+                .unwrap()
+                .unwrap();
+        }
+    }
+
+    #[tokio::test]
+    async fn binary_protocol() {
+        let received = send_binary(None).await;
+        assert_eq!(received[1].as_bytes(), b"pre.foo.bar:3|c|@1.0|#tags:value");
+    }
+
+    #[tokio::test]
+    async fn compressed_binary_protocol() {
+        let received = send_binary(Some(3)).await;
+        assert_eq!(received[1].as_bytes(), b"pre.foo.bar:3|c|@1.0|#tags:value");
     }
 }
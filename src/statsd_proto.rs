@@ -1,6 +1,7 @@
 use bytes::BufMut;
 use bytes::Bytes;
-use memchr::memchr;
+use memchr::{memchr, memchr_iter};
+use smallvec::SmallVec;
 use thiserror::Error;
 
 use std::{
@@ -9,9 +10,14 @@ use std::{
     fmt,
     hash::Hash,
     hash::Hasher,
+    num::NonZeroU16,
     vec,
 };
 
+pub mod binary;
+pub mod compression;
+pub mod scan;
+
 /// An Owned identifier for a statsd message
 #[derive(Debug, Clone, Eq)]
 pub struct Id {
@@ -41,14 +47,27 @@ impl fmt::Display for Id {
 impl Hash for Id {
     fn hash<H: Hasher>(&self, state: &mut H) {
         self.name.hash(state);
-        for tag in self.tags.iter() {
-            tag.hash(state);
-        }
         self.tags.hash(state);
         self.mtype.hash(state);
     }
 }
 
+impl Id {
+    /// Hash the canonical series key of this identifier, see
+    /// [`hash_series`](hash_series). Equivalent [`Pdu`](Pdu) forms produce
+    /// the same hash.
+    pub fn hash_series<H: Hasher>(&self, state: &mut H) {
+        hash_series(
+            self.name.as_ref(),
+            (&self.mtype).into(),
+            self.tags
+                .iter()
+                .map(|tag| (tag.name.as_slice(), tag.value.as_slice())),
+            state,
+        );
+    }
+}
+
 impl PartialEq for Id {
     fn eq(&self, other: &Id) -> bool {
         self.name == other.name && self.mtype == other.mtype && self.tags == other.tags
@@ -153,6 +172,25 @@ pub enum ParseError {
     RepeatedTags,
     #[error("unsupported extension field")]
     UnsupportedExtensionField,
+    #[error("line longer than the maximum PDU length")]
+    LineTooLong,
+}
+
+impl ParseError {
+    /// Short name of the error kind, for labelling stats
+    pub fn kind(&self) -> &'static str {
+        match self {
+            ParseError::InvalidValue => "invalid_value",
+            ParseError::InvalidSampleRate => "invalid_sample_rate",
+            ParseError::InvalidType => "invalid_type",
+            ParseError::InvalidTag => "invalid_tag",
+            ParseError::InvalidLine => "invalid_line",
+            ParseError::RepeatedSampleRate => "repeated_sample_rate",
+            ParseError::RepeatedTags => "repeated_tags",
+            ParseError::UnsupportedExtensionField => "unsupported_extension_field",
+            ParseError::LineTooLong => "line_too_long",
+        }
+    }
 }
 
 /// Set of key/value fields for a tag.
@@ -210,10 +248,11 @@ impl PartialEq for Tag {
 /// use statsrelay::statsd_proto;
 /// use bytes::Bytes;
 /// use statsrelay::statsd_proto::Event;
+/// use std::convert::TryInto;
 ///
 /// let input = Bytes::from_static(b"foo.bar:3|c|#tags:value|@1.0");
 /// let sample = &Event::Pdu(statsd_proto::Pdu::parse(input).unwrap());
-/// let parsed: statsd_proto::Pdu = sample.into();
+/// let parsed: statsd_proto::Pdu = sample.try_into().unwrap();
 /// ```
 #[derive(Clone, Debug)]
 pub enum Event {
@@ -221,11 +260,13 @@ pub enum Event {
     Parsed(Owned),
 }
 
+/// Events hash by their canonical series key, so the tokenized and parsed
+/// forms of the same series always hash identically.
 impl Hash for Event {
     fn hash<H: Hasher>(&self, state: &mut H) {
         match self {
-            Event::Pdu(pdu) => pdu.hash(state),
-            Event::Parsed(parsed) => parsed.hash(state),
+            Event::Pdu(pdu) => pdu.hash_series(state),
+            Event::Parsed(parsed) => parsed.id.hash_series(state),
         }
     }
 }
@@ -250,20 +291,24 @@ impl TryFrom<Event> for Owned {
     }
 }
 
-impl From<Event> for Pdu {
-    fn from(inp: Event) -> Self {
+impl TryFrom<Event> for Pdu {
+    type Error = ParseError;
+
+    fn try_from(inp: Event) -> Result<Self, Self::Error> {
         match inp {
-            Event::Pdu(pdu) => pdu,
-            Event::Parsed(p) => p.into(),
+            Event::Pdu(pdu) => Ok(pdu),
+            Event::Parsed(p) => p.try_into(),
         }
     }
 }
 
-impl From<&Event> for Pdu {
-    fn from(inp: &Event) -> Self {
+impl TryFrom<&Event> for Pdu {
+    type Error = ParseError;
+
+    fn try_from(inp: &Event) -> Result<Self, Self::Error> {
         match inp {
-            Event::Pdu(pdu) => pdu.clone(),
-            Event::Parsed(p) => p.into(),
+            Event::Pdu(pdu) => Ok(pdu.clone()),
+            Event::Parsed(p) => p.try_into(),
         }
     }
 }
@@ -275,6 +320,9 @@ pub trait Parsed {
     fn value(&self) -> f64;
     fn sample_rate(&self) -> Option<f64>;
     fn tags(&self) -> &[Tag];
+    /// True for relative gauge updates (`+5|g`, `-3|g`), whose value adjusts
+    /// the current gauge value instead of replacing it
+    fn is_relative(&self) -> bool;
 }
 
 /// A structured and owned version of [`PDU`](PDU)
@@ -287,6 +335,7 @@ pub struct Owned {
     id: Id,
     value: f64,
     sample_rate: Option<f64>,
+    relative: bool,
 }
 
 impl Hash for Owned {
@@ -297,7 +346,10 @@ impl Hash for Owned {
 
 impl PartialEq for Owned {
     fn eq(&self, other: &Owned) -> bool {
-        self.id.eq(&other.id) && self.value == other.value && self.sample_rate == other.sample_rate
+        self.id.eq(&other.id)
+            && self.value == other.value
+            && self.sample_rate == other.sample_rate
+            && self.relative == other.relative
     }
 }
 
@@ -307,6 +359,19 @@ impl Owned {
             id,
             value,
             sample_rate,
+            relative: false,
+        }
+    }
+
+    /// Create a relative gauge update, adjusting the gauge by the given signed
+    /// amount rather than setting it
+    pub fn new_gauge_delta(id: Id, value: f64) -> Self {
+        debug_assert!(id.mtype == Type::Gauge);
+        Owned {
+            id,
+            value,
+            sample_rate: None,
+            relative: true,
         }
     }
 }
@@ -330,6 +395,9 @@ impl Parsed for Owned {
     fn tags(&self) -> &[Tag] {
         self.id.tags.as_slice()
     }
+    fn is_relative(&self) -> bool {
+        self.relative
+    }
 }
 
 impl TryFrom<Pdu> for Owned {
@@ -344,7 +412,14 @@ impl TryFrom<&Pdu> for Owned {
     type Error = ParseError;
 
     fn try_from(pdu: &Pdu) -> Result<Self, Self::Error> {
-        let value = match lexical::parse::<f64, _>(pdu.value()) {
+        // An explicit sign is what marks a gauge update as relative
+        let raw_value = pdu.value();
+        let signed = matches!(raw_value.first(), Some(b'+') | Some(b'-'));
+        let unsigned_value = match raw_value.first() {
+            Some(b'+') => &raw_value[1..],
+            _ => raw_value,
+        };
+        let value = match lexical::parse::<f64, _>(unsigned_value) {
             Ok(v) if v.is_finite() => v,
             _ => return Err(ParseError::InvalidValue),
         };
@@ -355,44 +430,249 @@ impl TryFrom<&Pdu> for Owned {
                 _ => Err(ParseError::InvalidSampleRate),
             })
             .transpose()?;
+        let id: Id = pdu.try_into()?;
+        let relative = signed && id.mtype == Type::Gauge;
+        Ok(Owned {
+            id,
+            value,
+            sample_rate,
+            relative,
+        })
+    }
+}
+
+/// Build the identifier of a PDU without parsing its value, for types whose
+/// values are not numeric (such as set members).
+impl TryFrom<&Pdu> for Id {
+    type Error = ParseError;
+
+    fn try_from(pdu: &Pdu) -> Result<Self, Self::Error> {
         let mtype: Type = pdu.pdu_type().try_into()?;
         let tags = pdu.tags().map(|v| parse_tags(v)).transpose()?;
-        let id = Id {
+        Ok(Id {
             name: pdu.name().to_vec(),
             mtype,
             tags: tags.unwrap_or_default(),
-        };
-        Ok(Owned {
-            id,
-            value,
-            sample_rate,
         })
     }
 }
 
-impl From<Owned> for Pdu {
-    fn from(input: Owned) -> Self {
-        (&input).into()
+impl TryFrom<Owned> for Pdu {
+    type Error = ParseError;
+
+    fn try_from(input: Owned) -> Result<Self, Self::Error> {
+        (&input).try_into()
+    }
+}
+
+/// Whole numbers below this magnitude are exactly representable as an i64
+const EXACT_INTEGER_LIMIT: f64 = 9_007_199_254_740_992_f64;
+
+/// Longest output of [`write_number`](write_number), which is ryu's worst case
+pub const MAX_NUMBER_LENGTH: usize = 24;
+
+/// Append the shortest representation of a finite number to `buf`, without
+/// allocating. Whole numbers, which most counters and gauges are, take an
+/// integer fast path and are written without a fraction.
+pub fn write_number<B: BufMut>(buf: &mut B, value: f64) {
+    if value.fract() == 0_f64 && value.abs() < EXACT_INTEGER_LIMIT {
+        buf.put_slice(itoa::Buffer::new().format(value as i64).as_bytes());
+    } else {
+        buf.put_slice(ryu::Buffer::new().format_finite(value).as_bytes());
+    }
+}
+
+/// True if all 8 bytes are ASCII digits, see
+/// <https://lemire.me/blog/2018/09/30/quickly-identifying-a-sequence-of-digits-in-a-string-of-characters/>
+#[inline(always)]
+fn is_eight_digits(chunk: &[u8]) -> bool {
+    let mut word = [0_u8; 8];
+    word.copy_from_slice(chunk);
+    let val = u64::from_le_bytes(word);
+    ((val & 0xF0F0_F0F0_F0F0_F0F0)
+        | (((val.wrapping_add(0x0606_0606_0606_0606)) & 0xF0F0_F0F0_F0F0_F0F0) >> 4))
+        == 0x3333_3333_3333_3333
+}
+
+/// Skip leading ASCII digits, eight at a time while possible
+#[inline(always)]
+fn skip_digits(input: &[u8]) -> &[u8] {
+    let mut scan = input;
+    while scan.len() >= 8 && is_eight_digits(&scan[..8]) {
+        scan = &scan[8..];
     }
+    let digits = scan.iter().take_while(|b| b.is_ascii_digit()).count();
+    &scan[digits..]
 }
 
-impl From<&Owned> for Pdu {
-    fn from(input: &Owned) -> Self {
-        let mut bytes = Vec::with_capacity(input.id.name.len() + (input.id.tags.len() * 64) + 64);
+/// Check the statsd number grammar, `[+-]digits[.digits][e[+-]digits]` with
+/// at least one mantissa digit, without parsing the value.
+pub fn is_number(input: &[u8]) -> bool {
+    let mut scan = match input.first() {
+        Some(b'+') | Some(b'-') => &input[1..],
+        _ => input,
+    };
+    let mantissa_len = scan.len();
+    scan = skip_digits(scan);
+    let mut digits = mantissa_len - scan.len();
+    if let Some(b'.') = scan.first() {
+        let fraction = &scan[1..];
+        scan = skip_digits(fraction);
+        digits += fraction.len() - scan.len();
+    }
+    if digits == 0 {
+        return false;
+    }
+    if let Some(b'e') | Some(b'E') = scan.first() {
+        let exponent = match scan.get(1) {
+            Some(b'+') | Some(b'-') => &scan[2..],
+            _ => &scan[1..],
+        };
+        scan = skip_digits(exponent);
+        if scan.len() == exponent.len() {
+            return false;
+        }
+    }
+    scan.is_empty()
+}
+
+/// A number formatted on the stack by [`write_number`](write_number)
+struct FormattedNumber {
+    buf: [u8; MAX_NUMBER_LENGTH],
+    len: usize,
+}
+
+impl FormattedNumber {
+    fn new(value: f64) -> Self {
+        let mut buf = [0_u8; MAX_NUMBER_LENGTH];
+        let mut cursor = &mut buf[..];
+        write_number(&mut cursor, value);
+        let len = MAX_NUMBER_LENGTH - cursor.len();
+        FormattedNumber { buf, len }
+    }
+
+    fn as_bytes(&self) -> &[u8] {
+        &self.buf[..self.len]
+    }
+}
+
+/// The numbers of a parsed event, formatted for its statsd line
+struct FormattedFields {
+    value: FormattedNumber,
+    sample_rate: Option<FormattedNumber>,
+    /// Relative gauge increments carry an explicit sign
+    sign: bool,
+}
+
+impl Owned {
+    fn format_fields(&self) -> FormattedFields {
+        FormattedFields {
+            value: FormattedNumber::new(self.value),
+            sample_rate: self.sample_rate.map(FormattedNumber::new),
+            sign: self.relative && self.value >= 0_f64,
+        }
+    }
+
+    fn line_len(&self, fields: &FormattedFields) -> usize {
+        let mtype: &[u8] = (&self.id.mtype).into();
+        let tags_len = match self.id.tags.is_empty() {
+            true => 0,
+            false => {
+                self.id
+                    .tags
+                    .iter()
+                    .map(|t| t.name.len() + t.value.len() + 2)
+                    .sum::<usize>()
+                    + 1
+            }
+        };
+        self.id.name.len()
+            + 2
+            + fields.sign as usize
+            + fields.value.as_bytes().len()
+            + mtype.len()
+            + fields
+                .sample_rate
+                .as_ref()
+                .map_or(0, |sr| sr.as_bytes().len() + 2)
+            + tags_len
+    }
+
+    /// Length of the statsd line of this event, without a trailing newline
+    pub fn encoded_len(&self) -> usize {
+        self.line_len(&self.format_fields())
+    }
+
+    /// Write the statsd line of this event to `buf` with a prefix and suffix
+    /// attached to its name, the same bytes
+    /// [`Pdu::write_with_affixes`](Pdu::write_with_affixes) writes for the
+    /// PDU serialized from it
+    pub fn write_with_affixes<B: BufMut>(&self, buf: &mut B, prefix: &[u8], suffix: &[u8]) {
+        let fields = self.format_fields();
+        buf.put_slice(prefix);
+        buf.put_slice(&self.id.name);
+        buf.put_slice(suffix);
+        buf.put_u8(b':');
+        if fields.sign {
+            buf.put_u8(b'+');
+        }
+        buf.put_slice(fields.value.as_bytes());
+        buf.put_u8(b'|');
+        buf.put_slice((&self.id.mtype).into());
+        if let Some(sr) = fields.sample_rate.as_ref() {
+            buf.put_slice(b"|@");
+            buf.put_slice(sr.as_bytes());
+        }
+        let mut sep: &[u8] = b"|#";
+        for tag in self.id.tags.iter() {
+            buf.put_slice(sep);
+            buf.put_slice(&tag.name);
+            buf.put_u8(b':');
+            buf.put_slice(&tag.value);
+            sep = b",";
+        }
+    }
+
+    /// Replace the sample rate of the event
+    pub fn with_sample_rate(mut self, sample_rate: f64) -> Self {
+        self.sample_rate = Some(sample_rate);
+        self
+    }
+}
+
+/// Serialize a parsed event, failing with
+/// [`LineTooLong`](ParseError::LineTooLong) if the line would not fit a PDU
+impl TryFrom<&Owned> for Pdu {
+    type Error = ParseError;
+
+    fn try_from(input: &Owned) -> Result<Self, Self::Error> {
+        // Format the numbers first so the line can be allocated at its exact
+        // size, as it is never appended to afterwards
+        let fields = input.format_fields();
+        let len = input.line_len(&fields);
+        let FormattedFields {
+            value,
+            sample_rate,
+            sign,
+        } = fields;
+        let mtype: &[u8] = (&input.id.mtype).into();
+        let mut bytes = Vec::with_capacity(len);
 
         bytes.extend(&input.id.name);
         bytes.push(b':');
         let value_index = bytes.len();
-        bytes.extend(lexical::to_string(input.value).as_bytes());
+        if sign {
+            bytes.push(b'+');
+        }
+        bytes.extend_from_slice(value.as_bytes());
         bytes.push(b'|');
         let type_index = bytes.len();
-        let mtype = &input.id.mtype;
-        bytes.extend_from_slice(mtype.into());
+        bytes.extend_from_slice(mtype);
         let type_index_end = bytes.len();
-        let sample_rate_index = if let Some(sr) = input.sample_rate {
+        let sample_rate_index = if let Some(sr) = sample_rate {
             bytes.extend_from_slice(b"|@");
             let start = bytes.len();
-            bytes.extend(lexical::to_string(sr).as_bytes());
+            bytes.extend_from_slice(sr.as_bytes());
             let end = bytes.len();
             Some((start, end))
         } else {
@@ -415,14 +695,15 @@ impl From<&Owned> for Pdu {
         } else {
             None
         };
-        Pdu {
-            underlying: Bytes::from(bytes),
+        debug_assert_eq!(bytes.len(), len);
+        Pdu::with_offsets(
+            Bytes::from(bytes),
             value_index,
             type_index,
             type_index_end,
             sample_rate_index,
             tags_index,
-        }
+        )
     }
 }
 
@@ -466,10 +747,69 @@ pub mod convert {
             id,
             value: input.value,
             sample_rate: input.sample_rate,
+            relative: input.relative,
+        }
+    }
+}
+
+/// Allocation free iterator over the `(name, value)` pairs of a raw DogStatsD
+/// tag field, splitting exactly as [`parse_tags`](parse_tags) does.
+#[derive(Clone)]
+struct RawTags<'a> {
+    scan: Option<&'a [u8]>,
+}
+
+impl<'a> RawTags<'a> {
+    fn new(input: &'a [u8]) -> Self {
+        RawTags {
+            scan: if input.is_empty() { None } else { Some(input) },
         }
     }
 }
 
+impl<'a> Iterator for RawTags<'a> {
+    type Item = (&'a [u8], &'a [u8]);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let scan = self.scan?;
+        let tag = match memchr(b',', scan) {
+            None => {
+                self.scan = None;
+                scan
+            }
+            Some(i) => {
+                self.scan = Some(&scan[i + 1..]);
+                &scan[0..i]
+            }
+        };
+        Some(match memchr(b':', tag) {
+            None => (tag, &tag[tag.len()..]),
+            Some(value_start) => (&tag[0..value_start], &tag[value_start + 1..]),
+        })
+    }
+}
+
+/// Hash a series key (name, type and the multiset of tags) independently of
+/// the order tags were written in.
+///
+/// Tags are sorted on the stack before being fed to the hasher, spilling to
+/// the heap only for unusually long tag sets.
+fn hash_series<'a, H, I>(name: &[u8], mtype: &[u8], tags: I, state: &mut H)
+where
+    H: Hasher,
+    I: Iterator<Item = (&'a [u8], &'a [u8])>,
+{
+    name.hash(state);
+    mtype.hash(state);
+    let mut sorted: SmallVec<[(&[u8], &[u8]); 8]> = tags.collect();
+    sorted.sort_unstable();
+    for (name, value) in sorted.iter() {
+        name.hash(state);
+        value.hash(state);
+    }
+    state.write_usize(sorted.len());
+}
+
 fn parse_tags(input: &[u8]) -> Result<Vec<Tag>, ParseError> {
     match input.len() {
         len if len == 0 => return Ok(vec![]),
@@ -508,42 +848,97 @@ fn parse_tags(input: &[u8]) -> Result<Vec<Tag>, ParseError> {
 /// line-delimitated message. This PDU type owns an incoming message and can
 /// offer references to protocol fields. It only performs limited parsing of the
 /// protocol unit.
+///
+/// Field offsets are stored as `u16`, which bounds a PDU to
+/// [`MAX_PDU_LENGTH`](MAX_PDU_LENGTH) bytes but keeps it small enough for
+/// millions to sit in client queues. Optional fields always start after a
+/// separator, so their start offset is never zero and the `Option` is free.
 #[derive(Debug, Clone)]
 pub struct Pdu {
     underlying: Bytes,
-    value_index: usize,
-    type_index: usize,
-    type_index_end: usize,
-    sample_rate_index: Option<(usize, usize)>,
-    tags_index: Option<(usize, usize)>,
+    value_index: u16,
+    type_index: u16,
+    type_index_end: u16,
+    sample_rate_index: Option<(NonZeroU16, u16)>,
+    tags_index: Option<(NonZeroU16, u16)>,
+}
+
+/// Longest line, in bytes, which can be represented as a [`Pdu`](Pdu)
+pub const MAX_PDU_LENGTH: usize = u16::MAX as usize;
+
+/// Narrow the range of an optional field, which starts after a separator
+#[inline]
+fn field_range(range: Option<(usize, usize)>) -> Option<(NonZeroU16, u16)> {
+    range.map(|(start, end)| {
+        (
+            NonZeroU16::new(start as u16).expect("fields start after a separator"),
+            end as u16,
+        )
+    })
+}
+
+#[inline]
+fn widen_range(range: (NonZeroU16, u16)) -> std::ops::Range<usize> {
+    range.0.get() as usize..range.1 as usize
 }
 
 impl Hash for Pdu {
     fn hash<H: Hasher>(&self, state: &mut H) {
-        self.name().hash(state);
-        self.pdu_type().hash(state);
+        self.hash_series(state);
     }
 }
 
 impl Pdu {
+    /// Hash the canonical series key of this PDU straight from the raw line,
+    /// see [`hash_series`](hash_series). The result matches the hash of the
+    /// equivalent parsed [`Id`](Id).
+    pub fn hash_series<H: Hasher>(&self, state: &mut H) {
+        let tags = self.tags().unwrap_or_default();
+        hash_series(self.name(), self.pdu_type(), RawTags::new(tags), state);
+    }
+
+    /// Build a PDU from field offsets into `underlying`, which must be no
+    /// longer than [`MAX_PDU_LENGTH`](MAX_PDU_LENGTH)
+    fn with_offsets(
+        underlying: Bytes,
+        value_index: usize,
+        type_index: usize,
+        type_index_end: usize,
+        sample_rate_index: Option<(usize, usize)>,
+        tags_index: Option<(usize, usize)>,
+    ) -> Result<Self, ParseError> {
+        if underlying.len() > MAX_PDU_LENGTH {
+            return Err(ParseError::LineTooLong);
+        }
+        Ok(Pdu {
+            underlying,
+            value_index: value_index as u16,
+            type_index: type_index as u16,
+            type_index_end: type_index_end as u16,
+            sample_rate_index: field_range(sample_rate_index),
+            tags_index: field_range(tags_index),
+        })
+    }
+
     pub fn name(&self) -> &[u8] {
-        &self.underlying[0..self.value_index - 1]
+        &self.underlying[0..self.value_index as usize - 1]
     }
 
     pub fn value(&self) -> &[u8] {
-        &self.underlying[self.value_index..self.type_index - 1]
+        &self.underlying[self.value_index as usize..self.type_index as usize - 1]
     }
 
     pub fn pdu_type(&self) -> &[u8] {
-        &self.underlying[self.type_index..self.type_index_end]
+        &self.underlying[self.type_index as usize..self.type_index_end as usize]
     }
 
     pub fn tags(&self) -> Option<&[u8]> {
-        self.tags_index.map(|v| &self.underlying[v.0..v.1])
+        self.tags_index.map(|v| &self.underlying[widen_range(v)])
     }
 
     pub fn sample_rate(&self) -> Option<&[u8]> {
-        self.sample_rate_index.map(|v| &self.underlying[v.0..v.1])
+        self.sample_rate_index
+            .map(|v| &self.underlying[widen_range(v)])
     }
 
     pub fn len(&self) -> usize {
@@ -558,26 +953,99 @@ impl Pdu {
         self.underlying.as_ref()
     }
 
-    /// Return a clone of the PDU with a prefix and suffix attached to the statsd name
-    pub fn with_prefix_suffix(&self, prefix: &[u8], suffix: &[u8]) -> Self {
+    /// Check the fields [`parse`](Pdu::parse) only located: the name must be
+    /// non-empty and the type a known statsd type.
+    pub fn validate_structure(&self) -> Result<(), ParseError> {
+        if self.name().is_empty() {
+            return Err(ParseError::InvalidLine);
+        }
+        Type::try_from(self.pdu_type()).map(|_| ())
+    }
+
+    /// Check that the value and sample rate are numbers, without converting
+    /// them. Set members are arbitrary strings and are not checked.
+    pub fn validate_values(&self) -> Result<(), ParseError> {
+        if self.pdu_type() != b"s" && !is_number(self.value()) {
+            return Err(ParseError::InvalidValue);
+        }
+        match self.sample_rate() {
+            Some(sr) if !is_number(sr) => Err(ParseError::InvalidSampleRate),
+            _ => Ok(()),
+        }
+    }
+
+    /// Write the PDU to `buf` with a prefix and suffix attached to the statsd
+    /// name, without building an intermediate PDU
+    pub fn write_with_affixes<B: BufMut>(&self, buf: &mut B, prefix: &[u8], suffix: &[u8]) {
+        if prefix.is_empty() && suffix.is_empty() {
+            buf.put_slice(self.as_bytes());
+            return;
+        }
+        buf.put_slice(prefix);
+        buf.put_slice(self.name());
+        buf.put_slice(suffix);
+        buf.put_slice(&self.underlying[self.value_index as usize - 1..]);
+    }
+
+    /// Return a clone of the PDU with a prefix and suffix attached to the
+    /// statsd name, failing if the result would exceed
+    /// [`MAX_PDU_LENGTH`](MAX_PDU_LENGTH)
+    pub fn with_prefix_suffix(&self, prefix: &[u8], suffix: &[u8]) -> Result<Self, ParseError> {
         let offset = suffix.len() + prefix.len();
+        if self.len() + offset > MAX_PDU_LENGTH {
+            return Err(ParseError::LineTooLong);
+        }
 
         let mut buf = bytes::BytesMut::with_capacity(self.len() + offset);
         buf.put(prefix);
         buf.put(self.name());
         buf.put(suffix);
-        buf.put(self.underlying[self.value_index - 1..].as_ref());
-
-        Pdu {
+        buf.put(self.underlying[self.value_index as usize - 1..].as_ref());
+
+        let offset = offset as u16;
+        let shift = |(b, e): (NonZeroU16, u16)| {
+            (
+                NonZeroU16::new(b.get() + offset).expect("fields start after a separator"),
+                e + offset,
+            )
+        };
+        Ok(Pdu {
             underlying: buf.freeze(),
             value_index: self.value_index + offset,
             type_index: self.type_index + offset,
             type_index_end: self.type_index_end + offset,
-            sample_rate_index: self
-                .sample_rate_index
-                .map(|(b, e)| (b + offset, e + offset)),
-            tags_index: self.tags_index.map(|(b, e)| (b + offset, e + offset)),
+            sample_rate_index: self.sample_rate_index.map(shift),
+            tags_index: self.tags_index.map(shift),
+        })
+    }
+
+    /// The sample rate of the PDU as a number, 1 when it has none or it is
+    /// not a number
+    pub fn sample_rate_value(&self) -> f64 {
+        self.sample_rate()
+            .and_then(|sr| lexical::parse::<f64, _>(sr).ok())
+            .filter(|sr| *sr > 0_f64 && *sr <= 1_f64)
+            .unwrap_or(1_f64)
+    }
+
+    /// Return a copy of the PDU with its sample rate field replaced, keeping
+    /// every other field in place
+    pub fn with_sample_rate(&self, sample_rate: f64) -> Result<Self, ParseError> {
+        let underlying = self.underlying.as_ref();
+        let type_end = self.type_index_end as usize;
+        let mut buf = bytes::BytesMut::with_capacity(self.len() + MAX_NUMBER_LENGTH + 2);
+        buf.put_slice(&underlying[..type_end]);
+        buf.put_slice(b"|@");
+        write_number(&mut buf, sample_rate);
+        match self.sample_rate_index.map(widen_range) {
+            // Drop the old field along with its "|@"
+            Some(old) => {
+                buf.put_slice(&underlying[type_end..old.start - 2]);
+                buf.put_slice(&underlying[old.end..]);
+            }
+            None => buf.put_slice(&underlying[type_end..]),
         }
+        Pdu::parse(buf.freeze())
     }
 
     /// Parse an incoming single protocol unit and capture internal field
@@ -585,7 +1053,9 @@ impl Pdu {
     /// later access. No parsing or validation of values is done, so at a low
     /// level this can be used to pass through unknown types and protocols.
     pub fn parse(line: Bytes) -> Result<Self, ParseError> {
-        let length = line.len();
+        if line.len() > MAX_PDU_LENGTH {
+            return Err(ParseError::LineTooLong);
+        }
         let mut value_index: usize = 0;
         // To support inner ':' symbols in a metric name (more common than you
         // think) we'll first find the index of the first type separator, and
@@ -601,46 +1071,134 @@ impl Pdu {
             }
             value_index = value_check_index.unwrap() + value_index + 1;
         }
-        let mut type_index_end = length;
-        let mut sample_rate_index: Option<(usize, usize)> = None;
-        let mut tags_index: Option<(usize, usize)> = None;
+        let pipes = memchr_iter(b'|', &line[type_index..]).map(|v| v + type_index);
+        let (type_index_end, sample_rate_index, tags_index) = extension_fields(&line, pipes)?;
+        Self::with_offsets(
+            line,
+            value_index,
+            type_index,
+            type_index_end,
+            sample_rate_index,
+            tags_index,
+        )
+    }
 
-        let mut scan_index = type_index;
-        loop {
-            let index = memchr(b'|', &line[scan_index..]).map(|v| v + scan_index);
-            match index {
-                None => break,
-                Some(x) if x + 2 >= length => break,
-                Some(x) if x < type_index_end => type_index_end = x,
-                _ => (),
+    /// Parse every newline separated line in `buf`, calling `f` with the raw
+    /// line (sans line terminator) and its parse result. A trailing line
+    /// without a newline is parsed as well, empty lines are skipped.
+    ///
+    /// This produces the same PDUs as splitting the buffer and calling
+    /// [`parse`](Pdu::parse) on each line, but finds the field separators of
+    /// all lines in a single structural scan, and each PDU shares `buf`'s
+    /// allocation.
+    pub fn parse_lines<F>(buf: &Bytes, mut f: F)
+    where
+        F: FnMut(&[u8], Result<Pdu, ParseError>),
+    {
+        let mut fields = LineFields::default();
+        scan::for_each_structural(buf, |pos, b| match b {
+            b'\n' => {
+                fields.finish(buf, pos, &mut f);
+                fields.start = pos + 1;
             }
-            match line[index.unwrap() + 1] {
-                b'@' => {
-                    if sample_rate_index.is_some() {
-                        return Err(ParseError::RepeatedSampleRate);
-                    }
-                    sample_rate_index = index.map(|v| (v + 2, length));
-                    tags_index = tags_index.map(|(v, _l)| (v, index.unwrap()));
+            b'|' if fields.first_pipe.is_none() => fields.first_pipe = Some(pos),
+            b'|' => fields.pipes.push(pos),
+            b':' if fields.first_pipe.is_none() => fields.last_colon = Some(pos),
+            _ => (),
+        });
+        fields.finish(buf, buf.len(), &mut f);
+    }
+}
+
+/// Find the end of the type field and the sample rate and tag fields of a
+/// line, given the positions of every `|` after the type separator.
+#[allow(clippy::type_complexity)]
+fn extension_fields<I>(
+    line: &[u8],
+    pipes: I,
+) -> Result<(usize, Option<(usize, usize)>, Option<(usize, usize)>), ParseError>
+where
+    I: Iterator<Item = usize>,
+{
+    let length = line.len();
+    let mut type_index_end = length;
+    let mut sample_rate_index: Option<(usize, usize)> = None;
+    let mut tags_index: Option<(usize, usize)> = None;
+
+    for index in pipes {
+        match index {
+            x if x + 2 >= length => break,
+            x if x < type_index_end => type_index_end = x,
+            _ => (),
+        }
+        match line[index + 1] {
+            b'@' => {
+                if sample_rate_index.is_some() {
+                    return Err(ParseError::RepeatedSampleRate);
                 }
-                b'#' => {
-                    if tags_index.is_some() {
-                        return Err(ParseError::RepeatedTags);
-                    }
-                    tags_index = index.map(|v| (v + 2, length));
-                    sample_rate_index = sample_rate_index.map(|(v, _l)| (v, index.unwrap()));
+                sample_rate_index = Some((index + 2, length));
+                tags_index = tags_index.map(|(v, _l)| (v, index));
+            }
+            b'#' => {
+                if tags_index.is_some() {
+                    return Err(ParseError::RepeatedTags);
                 }
-                _ => (),
+                tags_index = Some((index + 2, length));
+                sample_rate_index = sample_rate_index.map(|(v, _l)| (v, index));
             }
-            scan_index = index.unwrap() + 1;
+            _ => (),
         }
-        Ok(Pdu {
-            underlying: line,
-            value_index,
-            type_index,
-            type_index_end,
-            sample_rate_index,
-            tags_index,
-        })
+    }
+    Ok((type_index_end, sample_rate_index, tags_index))
+}
+
+/// Separator positions of the line currently being scanned by
+/// [`Pdu::parse_lines`], as absolute offsets into the scanned buffer.
+#[derive(Default)]
+struct LineFields {
+    start: usize,
+    first_pipe: Option<usize>,
+    last_colon: Option<usize>,
+    pipes: SmallVec<[usize; 4]>,
+}
+
+impl LineFields {
+    fn finish<F>(&mut self, buf: &Bytes, end: usize, f: &mut F)
+    where
+        F: FnMut(&[u8], Result<Pdu, ParseError>),
+    {
+        let start = self.start;
+        let mut end = end;
+        if end > start && buf[end - 1] == b'\r' {
+            end -= 1;
+        }
+        let first_pipe = self.first_pipe.take();
+        let last_colon = self.last_colon.take();
+        if end > start {
+            let result = match (first_pipe, last_colon) {
+                _ if end - start > MAX_PDU_LENGTH => Err(ParseError::LineTooLong),
+                (None, _) => Err(ParseError::InvalidLine),
+                (Some(_), None) => Err(ParseError::InvalidType),
+                (Some(pipe), Some(colon)) => {
+                    let (value_index, type_index) = (colon - start + 1, pipe - start + 1);
+                    let pipes = self.pipes.iter().map(|p| p - start);
+                    extension_fields(&buf[start..end], pipes).and_then(
+                        |(type_index_end, sample_rate_index, tags_index)| {
+                            Pdu::with_offsets(
+                                buf.slice(start..end),
+                                value_index,
+                                type_index,
+                                type_index_end,
+                                sample_rate_index,
+                                tags_index,
+                            )
+                        },
+                    )
+                }
+            };
+            f(&buf[start..end], result);
+        }
+        self.pipes.clear();
     }
 }
 
@@ -692,10 +1250,70 @@ pub mod test {
         assert_eq!(pdu.sample_rate().unwrap(), b"1.0");
     }
 
+    fn pdu_fields(
+        r: Result<Pdu, ParseError>,
+    ) -> Result<(Vec<u8>, Vec<u8>, Vec<u8>, Option<Vec<u8>>, Option<Vec<u8>>), String> {
+        r.map(|pdu| {
+            (
+                pdu.name().to_vec(),
+                pdu.value().to_vec(),
+                pdu.pdu_type().to_vec(),
+                pdu.tags().map(|t| t.to_vec()),
+                pdu.sample_rate().map(|t| t.to_vec()),
+            )
+        })
+        .map_err(|e| format!("{:?}", e))
+    }
+
+    #[test]
+    fn parse_lines_matches_parse() {
+        let alphabet = b"ab:|@#,.1";
+        fastrand::seed(31);
+        for _ in 0..500 {
+            let lines: Vec<Vec<u8>> = (0..fastrand::usize(1..20))
+                .map(|_| {
+                    (0..fastrand::usize(1..90))
+                        .map(|_| alphabet[fastrand::usize(..alphabet.len())])
+                        .collect()
+                })
+                .collect();
+            let mut buf = Vec::new();
+            for (i, line) in lines.iter().enumerate() {
+                buf.extend_from_slice(line);
+                if i + 1 < lines.len() || fastrand::bool() {
+                    buf.extend_from_slice(if fastrand::bool() { b"\r\n" } else { b"\n" });
+                }
+            }
+            let mut found = Vec::new();
+            Pdu::parse_lines(&Bytes::from(buf), |line, r| {
+                found.push((line.to_vec(), pdu_fields(r)))
+            });
+            let expected: Vec<_> = lines
+                .into_iter()
+                .map(|line| {
+                    let r = Pdu::parse(Bytes::from(line.clone()));
+                    (line, pdu_fields(r))
+                })
+                .collect();
+            assert_eq!(found, expected);
+        }
+    }
+
+    #[test]
+    fn parse_lines_skips_empty() {
+        let mut found = 0;
+        let buf = Bytes::from_static(b"\n\r\nfoo:1|c\n\nbar:2|c|#a:b|@0.5\n");
+        Pdu::parse_lines(&buf, |_, r| {
+            r.unwrap();
+            found += 1;
+        });
+        assert_eq!(found, 2);
+    }
+
     #[test]
     fn prefix_suffix_test() {
         let opdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#tags|@1.0")).unwrap();
-        let pdu = opdu.with_prefix_suffix(b"aa", b"bbb");
+        let pdu = opdu.with_prefix_suffix(b"aa", b"bbb").unwrap();
         assert_eq!(pdu.name(), b"aafoo.barbbb");
         assert_eq!(pdu.value(), b"3");
         assert_eq!(pdu.pdu_type(), b"c");
@@ -703,6 +1321,152 @@ pub mod test {
         assert_eq!(pdu.sample_rate().unwrap(), b"1.0");
     }
 
+    #[test]
+    fn sample_rate_rewrite() {
+        let cases: Vec<(&'static [u8], &[u8])> = vec![
+            (b"foo.bar:3|c", b"foo.bar:3|c|@0.25"),
+            (b"foo.bar:3|c|@0.5", b"foo.bar:3|c|@0.25"),
+            (b"foo.bar:3|c|#tags:a|@0.5", b"foo.bar:3|c|@0.25|#tags:a"),
+            (b"foo.bar:3|ms|@0.5|#tags:a", b"foo.bar:3|ms|@0.25|#tags:a"),
+        ];
+        for (line, expected) in cases {
+            let pdu = Pdu::parse(Bytes::from_static(line)).unwrap();
+            let sampled = pdu.with_sample_rate(0.25).unwrap();
+            assert_eq!(sampled.as_bytes(), expected);
+            assert_eq!(sampled.sample_rate_value(), 0.25);
+            assert_eq!(sampled.tags(), pdu.tags());
+        }
+        let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|@x")).unwrap();
+        assert_eq!(pdu.sample_rate_value(), 1_f64);
+    }
+
+    #[test]
+    fn pdu_size() {
+        assert!(std::mem::size_of::<Pdu>() <= 48);
+    }
+
+    #[test]
+    fn number_grammar() {
+        for valid in &[
+            &b"1"[..],
+            b"-1",
+            b"+1",
+            b"1234567890123456789",
+            b"0.5",
+            b".5",
+            b"5.",
+            b"1e10",
+            b"1.5E-7",
+            b"-12345678.87654321e+12",
+        ] {
+            assert!(is_number(valid), "{:?}", valid);
+            assert!(lexical::parse::<f64, _>(valid).is_ok());
+        }
+        for invalid in &[
+            &b""[..],
+            b"-",
+            b".",
+            b"1e",
+            b"1e+",
+            b"abc",
+            b"12345678a",
+            b"1.2.3",
+            b"1 ",
+            b"nan",
+            b"inf",
+            b"--1",
+        ] {
+            assert!(!is_number(invalid), "{:?}", invalid);
+        }
+    }
+
+    #[test]
+    fn validate_pdus() {
+        let check = |line: &'static [u8]| {
+            let pdu = Pdu::parse(Bytes::from_static(line)).unwrap();
+            pdu.validate_structure()
+                .and_then(|_| pdu.validate_values())
+                .map_err(|e| e.kind())
+        };
+        assert_eq!(check(b"foo.bar:3|c|@0.5|#a:b"), Ok(()));
+        assert_eq!(check(b"users:alice|s"), Ok(()));
+        assert_eq!(check(b"gauge:-3|g"), Ok(()));
+        assert_eq!(check(b":3|c"), Err("invalid_line"));
+        assert_eq!(check(b"foo:3|x"), Err("invalid_type"));
+        assert_eq!(check(b"foo:three|c"), Err("invalid_value"));
+        assert_eq!(check(b"foo:3|c|@half"), Err("invalid_sample_rate"));
+    }
+
+    #[test]
+    fn write_with_affixes() {
+        let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#tags|@1.0")).unwrap();
+        let mut buf = Vec::new();
+        pdu.write_with_affixes(&mut buf, b"aa", b"bbb");
+        assert_eq!(
+            &buf[..],
+            pdu.with_prefix_suffix(b"aa", b"bbb").unwrap().as_bytes()
+        );
+        buf.clear();
+        pdu.write_with_affixes(&mut buf, b"", b"");
+        assert_eq!(&buf[..], pdu.as_bytes());
+    }
+
+    #[test]
+    fn owned_write_with_affixes() {
+        let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3.5|ms|@0.25|#b:2,a")).unwrap();
+        let delta = Owned::new_gauge_delta(
+            Id {
+                name: b"level".to_vec(),
+                mtype: Type::Gauge,
+                tags: vec![],
+            },
+            4_f64,
+        );
+        for owned in vec![(&pdu).try_into().unwrap(), delta] {
+            let serialized: Pdu = (&owned).try_into().unwrap();
+            let mut expected = Vec::new();
+            serialized.write_with_affixes(&mut expected, b"aa.", b".z");
+            let mut buf = Vec::new();
+            owned.write_with_affixes(&mut buf, b"aa.", b".z");
+            assert_eq!(buf, expected);
+            assert_eq!(owned.encoded_len(), serialized.len());
+        }
+    }
+
+    #[test]
+    fn line_too_long() {
+        let mut line = b"foo.bar:3|c|#".to_vec();
+        line.resize(MAX_PDU_LENGTH, b'a');
+        let pdu = Pdu::parse(Bytes::from(line.clone())).unwrap();
+        assert_eq!(pdu.tags().unwrap().len(), MAX_PDU_LENGTH - 13);
+        assert!(matches!(
+            pdu.with_prefix_suffix(b"a", b""),
+            Err(ParseError::LineTooLong)
+        ));
+
+        line.push(b'a');
+        let line = Bytes::from(line);
+        assert!(matches!(
+            Pdu::parse(line.clone()),
+            Err(ParseError::LineTooLong)
+        ));
+        let mut results = Vec::new();
+        Pdu::parse_lines(&line, |_, r| results.push(r));
+        assert!(matches!(results[..], [Err(ParseError::LineTooLong)]));
+
+        let owned = Owned::new(
+            Id {
+                name: vec![b'a'; MAX_PDU_LENGTH],
+                mtype: Type::Counter,
+                tags: vec![],
+            },
+            1.0,
+            None,
+        );
+        let pdu: Result<Pdu, _> = owned.try_into();
+        assert!(matches!(pdu, Err(ParseError::LineTooLong)));
+    }
+
     #[test]
     fn test_parse_tag() {
         let tag_v = b"name:value";
@@ -798,11 +1562,88 @@ pub mod test {
         );
     }
 
+    #[test]
+    fn parsed_gauge_delta() {
+        let absolute: Owned = Pdu::parse(Bytes::from_static(b"foo.bar:3|g"))
+            .unwrap()
+            .try_into()
+            .unwrap();
+        assert!(!absolute.is_relative());
+        let increment: Owned = Pdu::parse(Bytes::from_static(b"foo.bar:+3|g"))
+            .unwrap()
+            .try_into()
+            .unwrap();
+        assert!(increment.is_relative());
+        assert_eq!(increment.value(), 3.0);
+        let decrement: Owned = Pdu::parse(Bytes::from_static(b"foo.bar:-3|g"))
+            .unwrap()
+            .try_into()
+            .unwrap();
+        assert!(decrement.is_relative());
+        assert_eq!(decrement.value(), -3.0);
+        // Signs carry no special meaning for other types
+        let counter: Owned = Pdu::parse(Bytes::from_static(b"foo.bar:-3|c"))
+            .unwrap()
+            .try_into()
+            .unwrap();
+        assert!(!counter.is_relative());
+    }
+
+    #[test]
+    fn convert_roundtrip_gauge_delta() {
+        for line in &[
+            &b"foo.bar:+3|g"[..],
+            &b"foo.bar:-3|g"[..],
+            &b"foo.bar:+0|g"[..],
+        ] {
+            let pdu = Pdu::parse(Bytes::from_static(line)).unwrap();
+            let parsed: Owned = (&pdu).try_into().unwrap();
+            let pdu2: Pdu = (&parsed).try_into().unwrap();
+            assert!(matches!(pdu2.value().first(), Some(b'+') | Some(b'-')));
+            let parsed2: Owned = (&pdu2).try_into().unwrap();
+            assert_eq!(parsed, parsed2);
+        }
+    }
+
+    #[test]
+    fn number_formatting() {
+        let cases: Vec<(f64, &[u8])> = vec![
+            (3.0, b"3"),
+            (-2.0, b"-2"),
+            (-0.0, b"0"),
+            (0.5, b"0.5"),
+            (1234.125, b"1234.125"),
+            (1e300, b"1e300"),
+            (9_007_199_254_740_992.0, b"9007199254740992.0"),
+        ];
+        for (value, expected) in cases {
+            let mut buf = Vec::new();
+            write_number(&mut buf, value);
+            assert_eq!(buf, expected);
+            assert_eq!(lexical::parse::<f64, _>(&buf).unwrap(), value);
+        }
+    }
+
+    #[test]
+    fn convert_roundtrip_numbers() {
+        for line in &[
+            &b"foo.bar:3.25|ms|@0.1"[..],
+            &b"foo.bar:-17|c|#a:b"[..],
+            &b"foo.bar:1e-7|g"[..],
+        ] {
+            let pdu = Pdu::parse(Bytes::from_static(line)).unwrap();
+            let parsed: Owned = (&pdu).try_into().unwrap();
+            let pdu2: Pdu = (&parsed).try_into().unwrap();
+            let parsed2: Owned = (&pdu2).try_into().unwrap();
+            assert_eq!(parsed, parsed2);
+        }
+    }
+
     #[test]
     fn convert_roundtrip() {
         let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#tags:value|@1.0")).unwrap();
         let parsed: Owned = (&pdu).try_into().unwrap();
-        let pdu2: Pdu = (&parsed).into();
+        let pdu2: Pdu = (&parsed).try_into().unwrap();
         let parsed2: Owned = (&pdu2).try_into().unwrap();
         assert_eq!(parsed, parsed2);
     }
@@ -827,6 +1668,60 @@ pub mod test {
         assert_eq!(map.get(&owned.id), Some(&true));
     }
 
+    fn series_hash(event: &Event) -> u64 {
+        let mut hasher = std::collections::hash_map::DefaultHasher::new();
+        event.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    #[test]
+    fn test_series_hash_pdu_owned_equivalent() {
+        let pdu = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#b:2,a:1,c|@0.5")).unwrap();
+        let owned: Owned = (&pdu).try_into().unwrap();
+        assert_eq!(
+            series_hash(&Event::Pdu(pdu)),
+            series_hash(&Event::Parsed(owned))
+        );
+    }
+
+    #[test]
+    fn test_series_hash_tag_order() {
+        let a = Pdu::parse(Bytes::from_static(b"foo.bar:3|c|#b:2,a:1,a:0")).unwrap();
+        let b = Pdu::parse(Bytes::from_static(b"foo.bar:4|c|#a:0,a:1,b:2")).unwrap();
+        assert_eq!(series_hash(&Event::Pdu(a)), series_hash(&Event::Pdu(b)));
+    }
+
+    #[test]
+    fn test_series_hash_many_tags() {
+        // Lines carrying thousands of distinct tags hash in n log n
+        let tags: Vec<String> = (0..4000).map(|i| format!("t{}:{}", i, i)).collect();
+        let forward = format!("foo.bar:1|c|#{}", tags.join(","));
+        let mut reversed = tags.clone();
+        reversed.reverse();
+        let backward = format!("foo.bar:1|c|#{}", reversed.join(","));
+        let a = Pdu::parse(Bytes::from(forward)).unwrap();
+        let b = Pdu::parse(Bytes::from(backward)).unwrap();
+        assert_eq!(series_hash(&Event::Pdu(a)), series_hash(&Event::Pdu(b)));
+    }
+
+    #[test]
+    fn test_series_hash_distinct() {
+        let lines: Vec<&'static [u8]> = vec![
+            b"foo.bar:3|c",
+            b"foo.bar:3|ms",
+            b"foo.bar:3|c|#a:1",
+            b"foo.bar:3|c|#a:2",
+            b"foo.bar:3|c|#a:1,a:1",
+            b"foo.bar:3|c|#a:1,b:1",
+            b"foo.baz:3|c|#a:1",
+        ];
+        let hashes: std::collections::HashSet<u64> = lines
+            .iter()
+            .map(|line| series_hash(&Event::Pdu(Pdu::parse(Bytes::from_static(line)).unwrap())))
+            .collect();
+        assert_eq!(lines.len(), hashes.len());
+    }
+
     #[test]
     fn test_fmt_id() {
         let id1 = Id {
@@ -0,0 +1,655 @@
+//! Compact binary framing for relaying statsd between statsrelay instances.
+//!
+//! A binary connection starts with a four byte preamble, [`MAGIC`](MAGIC)
+//! followed by a flags byte. No statsd line starts with a NUL byte, so a
+//! server can tell binary connections from text ones by their first byte.
+//!
+//! The preamble is followed by frames, each a little endian `u32` payload
+//! length and a payload holding a batch of records. A record carries the
+//! fields of one PDU already located, so the receiver never scans for
+//! separators:
+//!
+//! - a fields byte, flagging a sample rate, tags, or a raw extension tail
+//! - the name, as a string reference
+//! - the value, as a length prefixed literal
+//! - the type, as a string reference
+//! - the raw tail, when the PDU had extension fields other than a sample rate
+//!   and tags, or else the optional sample rate as a literal and the optional
+//!   tags as a count of (key reference, value) pairs
+//!
+//! Names, types and tag keys repeat heavily, so they are dictionary coded per
+//! connection. A string reference is a varint `k`: `0` is followed by a
+//! literal, `1` by a literal which also becomes the next dictionary entry, and
+//! anything else refers to entry `k - 2`. Names have their own dictionary,
+//! types and tag keys share the other. Dictionaries stop growing at
+//! [`DICTIONARY_LIMIT`](DICTIONARY_LIMIT) entries, after which new strings are
+//! sent as plain literals. All lengths and counts are LEB128 varints.
+
+use ahash::RandomState;
+use bytes::{Buf, BufMut, Bytes, BytesMut};
+use memchr::{memchr, memchr_iter};
+use thiserror::Error;
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+
+use super::{extension_fields, ParseError, Pdu, MAX_PDU_LENGTH};
+
+/// First bytes of the preamble of a connection using statsrelay framing
+pub const MAGIC: &[u8; 3] = b"\0SR";
+pub const PREAMBLE_LENGTH: usize = 4;
+/// Preamble flag for connections sending binary frames
+pub const FLAG_BINARY: u8 = 0x01;
+/// Preamble flag for connections compressed with zstd after the preamble,
+/// see [`compression`](super::compression)
+pub const FLAG_ZSTD: u8 = 0x02;
+const KNOWN_FLAGS: u8 = FLAG_BINARY | FLAG_ZSTD;
+
+/// Longest frame payload a decoder accepts
+pub const MAX_FRAME_LENGTH: usize = 16 * 1024 * 1024;
+/// Most entries each dictionary of a connection holds
+pub const DICTIONARY_LIMIT: usize = 1 << 16;
+/// Most text the records of one frame may rebuild to. Dictionary references
+/// expand, so this bounds what a frame of them costs the decoder.
+pub const MAX_FRAME_TEXT: usize = 4 * MAX_FRAME_LENGTH;
+
+const FRAME_HEADER_LENGTH: usize = 4;
+
+const FIELD_SAMPLE_RATE: u8 = 0x01;
+const FIELD_TAGS: u8 = 0x02;
+const FIELD_RAW_TAIL: u8 = 0x04;
+
+const REF_LITERAL: u64 = 0;
+const REF_DEFINE: u64 = 1;
+const REF_BASE: u64 = 2;
+
+#[derive(Error, Debug)]
+pub enum FrameError {
+    #[error("invalid connection preamble")]
+    InvalidPreamble,
+    #[error("unsupported protocol flags {0:#x}")]
+    UnsupportedFlags(u8),
+    #[error("frame longer than the maximum frame length")]
+    FrameTooLong,
+    #[error("record extends past the end of its frame")]
+    Truncated,
+    #[error("reference to an undefined dictionary entry")]
+    UnknownReference,
+    #[error("dictionary entry defined past the dictionary limit")]
+    DictionaryFull,
+    #[error("record longer than the maximum PDU length")]
+    RecordTooLong,
+    #[error("frame rebuilds to more text than the frame text limit")]
+    FrameTextTooLong,
+    #[error("decompression failed: {0}")]
+    Decompression(#[from] std::io::Error),
+    #[error("decompressed data past the buffer limit")]
+    DecompressedTooLong,
+}
+
+/// The preamble announcing a connection with the given flags
+pub fn preamble(flags: u8) -> [u8; PREAMBLE_LENGTH] {
+    [MAGIC[0], MAGIC[1], MAGIC[2], flags]
+}
+
+/// Check a connection preamble, returning its flags
+pub fn read_preamble(input: &[u8]) -> Result<u8, FrameError> {
+    if input.len() < PREAMBLE_LENGTH || &input[..MAGIC.len()] != MAGIC {
+        return Err(FrameError::InvalidPreamble);
+    }
+    let flags = input[MAGIC.len()];
+    if flags & !KNOWN_FLAGS != 0 {
+        return Err(FrameError::UnsupportedFlags(flags));
+    }
+    Ok(flags)
+}
+
+fn put_varint(buf: &mut BytesMut, mut value: u64) {
+    while value >= 0x80 {
+        buf.put_u8(value as u8 | 0x80);
+        value >>= 7;
+    }
+    buf.put_u8(value as u8);
+}
+
+fn put_literal(buf: &mut BytesMut, literal: &[u8]) {
+    put_varint(buf, literal.len() as u64);
+    buf.put_slice(literal);
+}
+
+/// Sending half of a connection dictionary
+#[derive(Default)]
+struct EncoderDictionary {
+    ids: HashMap<Vec<u8>, u64, RandomState>,
+}
+
+impl EncoderDictionary {
+    /// Write a reference to `key`, defining it if it is new and there is
+    /// room. The string itself is the concatenation of `parts`.
+    fn put(&mut self, buf: &mut BytesMut, key: &[u8], parts: &[&[u8]]) {
+        if let Some(id) = self.ids.get(key) {
+            put_varint(buf, id + REF_BASE);
+            return;
+        }
+        if self.ids.len() < DICTIONARY_LIMIT {
+            self.ids.insert(key.to_vec(), self.ids.len() as u64);
+            put_varint(buf, REF_DEFINE);
+        } else {
+            put_varint(buf, REF_LITERAL);
+        }
+        put_varint(buf, parts.iter().map(|p| p.len() as u64).sum());
+        for part in parts {
+            buf.put_slice(part);
+        }
+    }
+}
+
+/// Encodes batches of PDUs as frames for a single connection. A new encoder
+/// must be used for every connection, as frames refer to the dictionary
+/// entries defined by the frames sent before them.
+pub struct Encoder {
+    prefix: Bytes,
+    suffix: Bytes,
+    names: EncoderDictionary,
+    keys: EncoderDictionary,
+}
+
+impl Encoder {
+    /// Create an encoder attaching a prefix and suffix to every name
+    pub fn new(prefix: &[u8], suffix: &[u8]) -> Self {
+        Encoder {
+            prefix: Bytes::copy_from_slice(prefix),
+            suffix: Bytes::copy_from_slice(suffix),
+            names: EncoderDictionary::default(),
+            keys: EncoderDictionary::default(),
+        }
+    }
+
+    /// Append a frame holding `pdus` to `buf`
+    pub fn encode_frame(&mut self, pdus: &[Pdu], buf: &mut BytesMut) {
+        let start = buf.len();
+        buf.reserve(FRAME_HEADER_LENGTH + pdus.iter().map(|p| p.len() + 4).sum::<usize>());
+        buf.put_u32_le(0);
+        let affixes = self.prefix.len() + self.suffix.len();
+        for pdu in pdus {
+            // Decoders reject records rebuilding to lines longer than a PDU
+            if pdu.len() + affixes > MAX_PDU_LENGTH {
+                continue;
+            }
+            self.encode_record(pdu, buf);
+        }
+        let length = (buf.len() - start - FRAME_HEADER_LENGTH) as u32;
+        buf[start..start + FRAME_HEADER_LENGTH].copy_from_slice(&length.to_le_bytes());
+    }
+
+    fn encode_record(&mut self, pdu: &Pdu, buf: &mut BytesMut) {
+        let tail = &pdu.as_bytes()[pdu.type_index_end as usize..];
+        let sample_rate = pdu.sample_rate();
+        let tags = pdu.tags();
+        // The tail is rebuilt from the sample rate and tags, unless it holds
+        // anything else
+        let known_len = sample_rate.map_or(0, |s| s.len() + 2) + tags.map_or(0, |t| t.len() + 2);
+        let fields = if tail.len() != known_len {
+            FIELD_RAW_TAIL
+        } else {
+            sample_rate.map_or(0, |_| FIELD_SAMPLE_RATE) | tags.map_or(0, |_| FIELD_TAGS)
+        };
+        buf.put_u8(fields);
+        let name = pdu.name();
+        self.names
+            .put(buf, name, &[&self.prefix, name, &self.suffix]);
+        put_literal(buf, pdu.value());
+        let mtype = pdu.pdu_type();
+        self.keys.put(buf, mtype, &[mtype]);
+        if fields & FIELD_RAW_TAIL != 0 {
+            put_literal(buf, tail);
+            return;
+        }
+        if let Some(sample_rate) = sample_rate {
+            put_literal(buf, sample_rate);
+        }
+        if let Some(tags) = tags {
+            put_varint(buf, tags.split(|b| *b == b',').count() as u64);
+            for tag in tags.split(|b| *b == b',') {
+                let (key, value) = match memchr(b':', tag) {
+                    Some(colon) => (&tag[..colon], Some(&tag[colon + 1..])),
+                    None => (tag, None),
+                };
+                self.keys.put(buf, key, &[key]);
+                // Zero marks a tag without a value, as distinct from an
+                // empty one
+                match value {
+                    None => put_varint(buf, 0),
+                    Some(value) => {
+                        put_varint(buf, value.len() as u64 + 1);
+                        buf.put_slice(value);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Cursor over the payload of a frame
+struct Reader<'a> {
+    payload: &'a Bytes,
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn is_empty(&self) -> bool {
+        self.pos >= self.payload.len()
+    }
+
+    fn u8(&mut self) -> Result<u8, FrameError> {
+        let b = *self.payload.get(self.pos).ok_or(FrameError::Truncated)?;
+        self.pos += 1;
+        Ok(b)
+    }
+
+    fn varint(&mut self) -> Result<u64, FrameError> {
+        let mut value = 0_u64;
+        for shift in (0..64).step_by(7) {
+            let b = self.u8()?;
+            value |= ((b & 0x7f) as u64) << shift;
+            if b & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(FrameError::Truncated)
+    }
+
+    fn range(&mut self, len: u64) -> Result<std::ops::Range<usize>, FrameError> {
+        let start = self.pos;
+        let end = (len as usize)
+            .checked_add(start)
+            .filter(|end| *end <= self.payload.len())
+            .ok_or(FrameError::Truncated)?;
+        self.pos = end;
+        Ok(start..end)
+    }
+
+    fn literal(&mut self) -> Result<&'a [u8], FrameError> {
+        let len = self.varint()?;
+        let range = self.range(len)?;
+        Ok(&self.payload[range])
+    }
+
+    /// Read a string reference, copying the string into `out`
+    fn string(
+        &mut self,
+        dictionary: &mut Vec<Bytes>,
+        out: &mut BytesMut,
+    ) -> Result<(), FrameError> {
+        match self.varint()? {
+            REF_LITERAL => out.put_slice(self.literal()?),
+            REF_DEFINE => {
+                if dictionary.len() >= DICTIONARY_LIMIT {
+                    return Err(FrameError::DictionaryFull);
+                }
+                let len = self.varint()?;
+                if len > MAX_PDU_LENGTH as u64 {
+                    return Err(FrameError::RecordTooLong);
+                }
+                let range = self.range(len)?;
+                out.put_slice(&self.payload[range.clone()]);
+                dictionary.push(self.payload.slice(range));
+            }
+            id => {
+                let entry = (id - REF_BASE)
+                    .try_into()
+                    .ok()
+                    .and_then(|id: usize| dictionary.get(id))
+                    .ok_or(FrameError::UnknownReference)?;
+                out.put_slice(entry);
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Field offsets of a line rebuilt from a record, relative to its start
+struct Layout {
+    start: usize,
+    end: usize,
+    value_index: usize,
+    type_index: usize,
+    type_index_end: usize,
+    sample_rate_index: Option<(usize, usize)>,
+    tags_index: Option<(usize, usize)>,
+}
+
+/// Decodes the frames of a single connection back into PDUs
+#[derive(Default)]
+pub struct Decoder {
+    names: Vec<Bytes>,
+    keys: Vec<Bytes>,
+}
+
+impl Decoder {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Decode every complete frame at the start of `buf`, calling `f` with
+    /// each PDU, and leave any trailing partial frame in place. The PDUs of a
+    /// frame share a single allocation holding their rebuilt text lines.
+    /// The buffer is not grown for a partial frame, its reader grows it as
+    /// the bytes arrive.
+    pub fn decode<F>(&mut self, buf: &mut BytesMut, mut f: F) -> Result<(), FrameError>
+    where
+        F: FnMut(Result<Pdu, ParseError>),
+    {
+        while buf.len() >= FRAME_HEADER_LENGTH {
+            let length = u32::from_le_bytes(buf[..FRAME_HEADER_LENGTH].try_into().unwrap());
+            let length = length as usize;
+            if length > MAX_FRAME_LENGTH {
+                return Err(FrameError::FrameTooLong);
+            }
+            if buf.len() < FRAME_HEADER_LENGTH + length {
+                break;
+            }
+            buf.advance(FRAME_HEADER_LENGTH);
+            let payload = buf.split_to(length).freeze();
+            self.decode_frame(&payload, &mut f)?;
+        }
+        Ok(())
+    }
+
+    fn decode_frame<F>(&mut self, payload: &Bytes, f: &mut F) -> Result<(), FrameError>
+    where
+        F: FnMut(Result<Pdu, ParseError>),
+    {
+        let mut reader = Reader { payload, pos: 0 };
+        let mut text = BytesMut::with_capacity(payload.len() * 2);
+        let mut layouts = Vec::new();
+        while !reader.is_empty() {
+            layouts.push(self.decode_record(&mut reader, &mut text)?);
+            if text.len() > MAX_FRAME_TEXT {
+                return Err(FrameError::FrameTextTooLong);
+            }
+        }
+        let text = text.freeze();
+        for layout in layouts {
+            f(Pdu::with_offsets(
+                text.slice(layout.start..layout.end),
+                layout.value_index,
+                layout.type_index,
+                layout.type_index_end,
+                layout.sample_rate_index,
+                layout.tags_index,
+            ));
+        }
+        Ok(())
+    }
+
+    /// Rebuild the text line of one record into `text`, failing as soon as
+    /// the line grows longer than a PDU
+    fn decode_record(
+        &mut self,
+        reader: &mut Reader,
+        text: &mut BytesMut,
+    ) -> Result<Layout, FrameError> {
+        let start = text.len();
+        let check = |text: &BytesMut| match text.len() - start > MAX_PDU_LENGTH {
+            true => Err(FrameError::RecordTooLong),
+            false => Ok(()),
+        };
+        let fields = reader.u8()?;
+        reader.string(&mut self.names, text)?;
+        text.put_u8(b':');
+        let value_index = text.len() - start;
+        text.put_slice(reader.literal()?);
+        text.put_u8(b'|');
+        let type_index = text.len() - start;
+        check(text)?;
+        reader.string(&mut self.keys, text)?;
+        let type_index_end = text.len() - start;
+        check(text)?;
+        let mut layout = Layout {
+            start,
+            end: 0,
+            value_index,
+            type_index,
+            type_index_end,
+            sample_rate_index: None,
+            tags_index: None,
+        };
+        if fields & FIELD_RAW_TAIL != 0 {
+            text.put_slice(reader.literal()?);
+            check(text)?;
+            layout.end = text.len();
+            let line = &text[start..];
+            let pipes = memchr_iter(b'|', &line[type_index..]).map(|p| p + type_index);
+            // A raw tail only holds what an earlier parse already accepted
+            if let Ok((type_index_end, sample_rate_index, tags_index)) =
+                extension_fields(line, pipes)
+            {
+                layout.type_index_end = type_index_end;
+                layout.sample_rate_index = sample_rate_index;
+                layout.tags_index = tags_index;
+            }
+            return Ok(layout);
+        }
+        if fields & FIELD_SAMPLE_RATE != 0 {
+            text.put_slice(b"|@");
+            let sample_start = text.len() - start;
+            text.put_slice(reader.literal()?);
+            check(text)?;
+            layout.sample_rate_index = Some((sample_start, text.len() - start));
+        }
+        if fields & FIELD_TAGS != 0 {
+            text.put_slice(b"|#");
+            let tags_start = text.len() - start;
+            for i in 0..reader.varint()? {
+                if i > 0 {
+                    text.put_u8(b',');
+                }
+                reader.string(&mut self.keys, text)?;
+                match reader.varint()? {
+                    0 => (),
+                    len => {
+                        let range = reader.range(len - 1)?;
+                        text.put_u8(b':');
+                        text.put_slice(&reader.payload[range]);
+                    }
+                }
+                check(text)?;
+            }
+            layout.tags_index = Some((tags_start, text.len() - start));
+        }
+        layout.end = text.len();
+        Ok(layout)
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+
+    const LINES: &[&[u8]] = &[
+        b"foo.bar:3|c",
+        b"foo.bar:3.5|ms|@0.1",
+        b"foo.bar:-1|g|#a:b,c,d:,e:f:g",
+        b"with:colon:1|c|#k:v|@0.5",
+        b"set:member|s|@1|#,k:v",
+        b"ext:1|c|T1612345678|#a:b",
+        b"trailing:1|c|",
+    ];
+
+    fn pdus() -> Vec<Pdu> {
+        LINES
+            .iter()
+            .map(|l| Pdu::parse(Bytes::from_static(l)).unwrap())
+            .collect()
+    }
+
+    fn decode_all(decoder: &mut Decoder, buf: &mut BytesMut) -> Vec<Pdu> {
+        let mut out = Vec::new();
+        decoder.decode(buf, |pdu| out.push(pdu.unwrap())).unwrap();
+        out
+    }
+
+    fn assert_same(decoded: &Pdu, expected: &Pdu) {
+        assert_eq!(decoded.name(), expected.name());
+        assert_eq!(decoded.value(), expected.value());
+        assert_eq!(decoded.pdu_type(), expected.pdu_type());
+        assert_eq!(decoded.sample_rate(), expected.sample_rate());
+        assert_eq!(decoded.tags(), expected.tags());
+    }
+
+    #[test]
+    fn roundtrip() {
+        let pdus = pdus();
+        let mut encoder = Encoder::new(b"", b"");
+        let mut decoder = Decoder::new();
+        let mut buf = BytesMut::new();
+        encoder.encode_frame(&pdus, &mut buf);
+        let first_len = buf.len();
+        encoder.encode_frame(&pdus, &mut buf);
+        // The second frame refers to the names and keys the first defined
+        assert!(buf.len() - first_len < first_len);
+
+        let decoded = decode_all(&mut decoder, &mut buf);
+        assert_eq!(decoded.len(), pdus.len() * 2);
+        for (decoded, expected) in decoded.iter().zip(pdus.iter().cycle()) {
+            assert_same(decoded, expected);
+        }
+        assert!(buf.is_empty());
+    }
+
+    #[test]
+    fn affixes() {
+        let pdus = pdus();
+        let mut buf = BytesMut::new();
+        Encoder::new(b"pre.", b".suf").encode_frame(&pdus, &mut buf);
+        let decoded = decode_all(&mut Decoder::new(), &mut buf);
+        for (decoded, expected) in decoded.iter().zip(pdus.iter()) {
+            let expected = expected.with_prefix_suffix(b"pre.", b".suf").unwrap();
+            assert_same(decoded, &expected);
+        }
+    }
+
+    #[test]
+    fn split_frames() {
+        let pdus = pdus();
+        let mut encoder = Encoder::new(b"", b"");
+        let mut encoded = BytesMut::new();
+        encoder.encode_frame(&pdus[..3], &mut encoded);
+        encoder.encode_frame(&pdus[3..], &mut encoded);
+        for chunk_size in 1..32 {
+            let mut decoder = Decoder::new();
+            let mut buf = BytesMut::new();
+            let mut decoded = Vec::new();
+            for chunk in encoded.chunks(chunk_size) {
+                buf.put_slice(chunk);
+                decoded.extend(decode_all(&mut decoder, &mut buf));
+            }
+            assert_eq!(decoded.len(), pdus.len());
+            for (decoded, expected) in decoded.iter().zip(pdus.iter()) {
+                assert_same(decoded, expected);
+            }
+        }
+    }
+
+    #[test]
+    fn invalid_frames() {
+        let mut decoder = Decoder::new();
+        let mut buf = BytesMut::new();
+        // A reference to entry 0 of an empty name dictionary
+        buf.put_u32_le(2);
+        buf.put_slice(&[0, 2]);
+        assert!(matches!(
+            decoder.decode(&mut buf, |_| ()),
+            Err(FrameError::UnknownReference)
+        ));
+
+        let mut buf = BytesMut::new();
+        buf.put_u32_le(3);
+        buf.put_slice(&[0, 0, 9]);
+        assert!(matches!(
+            decoder.decode(&mut buf, |_| ()),
+            Err(FrameError::Truncated)
+        ));
+
+        let mut buf = BytesMut::new();
+        buf.put_u32_le(MAX_FRAME_LENGTH as u32 + 1);
+        assert!(matches!(
+            decoder.decode(&mut buf, |_| ()),
+            Err(FrameError::FrameTooLong)
+        ));
+
+        // A header alone doesn't make the decoder reserve the frame
+        let mut buf = BytesMut::new();
+        buf.put_u32_le(MAX_FRAME_LENGTH as u32);
+        decoder.decode(&mut buf, |_| ()).unwrap();
+        assert!(buf.capacity() < 1024);
+    }
+
+    /// A frame defining one name of `len` bytes, then referring to it from
+    /// `count` records, each tagged with `tags` references to it as a key
+    fn expanding_frame(len: usize, count: usize, tags: u64) -> BytesMut {
+        let mut payload = BytesMut::new();
+        for i in 0..count {
+            payload.put_u8(FIELD_TAGS);
+            match i {
+                0 => {
+                    put_varint(&mut payload, REF_DEFINE);
+                    put_literal(&mut payload, &vec![b'a'; len]);
+                }
+                _ => put_varint(&mut payload, REF_BASE),
+            }
+            put_literal(&mut payload, b"1");
+            put_varint(&mut payload, REF_LITERAL);
+            put_literal(&mut payload, b"c");
+            put_varint(&mut payload, tags);
+            for _ in 0..tags {
+                put_varint(&mut payload, REF_LITERAL);
+                put_literal(&mut payload, b"k");
+                put_varint(&mut payload, 0);
+            }
+        }
+        let mut buf = BytesMut::new();
+        buf.put_u32_le(payload.len() as u32);
+        buf.put_slice(&payload);
+        buf
+    }
+
+    #[test]
+    fn expansion_limits() {
+        // Dictionary entries can't outgrow a line
+        let mut buf = expanding_frame(MAX_PDU_LENGTH + 1, 1, 0);
+        assert!(matches!(
+            Decoder::new().decode(&mut buf, |_| ()),
+            Err(FrameError::RecordTooLong)
+        ));
+        // Neither can the records rebuilt around them
+        let mut buf = expanding_frame(MAX_PDU_LENGTH - 16, 1, 16);
+        assert!(matches!(
+            Decoder::new().decode(&mut buf, |_| ()),
+            Err(FrameError::RecordTooLong)
+        ));
+        // And references to a large entry can't rebuild a frame past its
+        // text limit
+        let mut buf = expanding_frame(MAX_PDU_LENGTH - 16, MAX_FRAME_TEXT / MAX_PDU_LENGTH + 2, 0);
+        assert!(matches!(
+            Decoder::new().decode(&mut buf, |_| ()),
+            Err(FrameError::FrameTextTooLong)
+        ));
+    }
+
+    #[test]
+    fn preambles() {
+        assert_eq!(read_preamble(&preamble(FLAG_BINARY)).unwrap(), FLAG_BINARY);
+        assert_eq!(
+            read_preamble(&preamble(FLAG_BINARY | FLAG_ZSTD)).unwrap(),
+            FLAG_BINARY | FLAG_ZSTD
+        );
+        assert!(matches!(
+            read_preamble(b"\0SR\x80"),
+            Err(FrameError::UnsupportedFlags(0x80))
+        ));
+        assert!(read_preamble(b"\0XY\x01").is_err());
+        assert!(read_preamble(b"\0SR").is_err());
+    }
+}
@@ -0,0 +1,152 @@
+//! Streaming zstd compression of relay connections.
+//!
+//! A connection announcing [`FLAG_ZSTD`](super::binary::FLAG_ZSTD) in its
+//! preamble carries a single zstd stream after the preamble, holding either
+//! text lines or binary frames. The sender flushes the stream after every
+//! batch it writes, so the receiver can decode each batch as it arrives
+//! instead of waiting for the connection to close.
+
+use bytes::buf::Writer;
+use bytes::{Buf, BufMut, Bytes, BytesMut};
+use zstd::stream::raw::{InBuffer, Operation, OutBuffer};
+
+use std::io::{self, Write};
+
+/// Decompressed bytes produced per decoder step
+const DECOMPRESS_STEP: usize = 64 * 1024;
+
+/// Compresses the batches written to one connection
+pub struct Compressor {
+    encoder: zstd::stream::write::Encoder<'static, Writer<BytesMut>>,
+}
+
+impl Compressor {
+    pub fn new(level: i32) -> io::Result<Self> {
+        Ok(Compressor {
+            encoder: zstd::stream::write::Encoder::new(BytesMut::new().writer(), level)?,
+        })
+    }
+
+    /// Compress a batch, returning the compressed bytes which complete it
+    pub fn compress(&mut self, input: &[u8]) -> io::Result<Bytes> {
+        self.encoder.write_all(input)?;
+        self.encoder.flush()?;
+        Ok(self.encoder.get_mut().get_mut().split().freeze())
+    }
+}
+
+/// Decompresses the stream read from one connection, holding at most about
+/// `limit` bytes of decompressed data not yet consumed
+pub struct Decompressor {
+    decoder: zstd::stream::raw::Decoder<'static>,
+    input: BytesMut,
+    output: BytesMut,
+    limit: usize,
+    stalled: bool,
+}
+
+impl Decompressor {
+    pub fn new(limit: usize) -> io::Result<Self> {
+        Ok(Decompressor {
+            decoder: zstd::stream::raw::Decoder::new()?,
+            input: BytesMut::new(),
+            output: BytesMut::new(),
+            limit,
+            stalled: false,
+        })
+    }
+
+    /// Decompress a chunk of the stream, split at any point, appending what
+    /// it completes to [`output`](Decompressor::output). Decompression
+    /// proceeds in steps and stops once the output passes the limit, keeping
+    /// the rest of the input, so a small input can't expand without bound.
+    /// Call again, with more input or none, once output has been consumed.
+    pub fn decompress(&mut self, input: &[u8]) -> io::Result<()> {
+        self.input.extend_from_slice(input);
+        self.stalled = false;
+        loop {
+            if self.output.len() > self.limit {
+                self.stalled = true;
+                return Ok(());
+            }
+            let start = self.output.len();
+            self.output.resize(start + DECOMPRESS_STEP, 0);
+            let mut src = InBuffer::around(&self.input);
+            let mut dst = OutBuffer::around(&mut self.output[start..]);
+            let result = self.decoder.run(&mut src, &mut dst);
+            let (consumed, produced) = (src.pos(), dst.pos());
+            self.output.truncate(start + produced);
+            self.input.advance(consumed);
+            result?;
+            // A step which filled its space may have more output buffered
+            if produced < DECOMPRESS_STEP && (self.input.is_empty() || consumed == 0) {
+                return Ok(());
+            }
+        }
+    }
+
+    /// Whether decompression stopped at the limit with more of the stream
+    /// left to decompress
+    pub fn stalled(&self) -> bool {
+        self.stalled
+    }
+
+    /// Decompressed data not yet consumed
+    pub fn output(&mut self) -> &mut BytesMut {
+        &mut self.output
+    }
+}
+
+#[cfg(test)]
+pub mod test {
+    use super::*;
+
+    #[test]
+    fn stream_roundtrip() {
+        let mut compressor = Compressor::new(3).unwrap();
+        let mut decompressor = Decompressor::new(1 << 20).unwrap();
+        let batch: Vec<u8> = (0..200)
+            .flat_map(|i| format!("relay.tier.metric_{}:1|c|#az:a\n", i % 10).into_bytes())
+            .collect();
+        for _ in 0..3 {
+            let compressed = compressor.compress(&batch).unwrap();
+            assert!(compressed.len() < batch.len() / 4);
+            // Every flushed batch decodes fully, even fed a byte at a time
+            for b in compressed.iter() {
+                decompressor.decompress(&[*b]).unwrap();
+            }
+            assert_eq!(&decompressor.output().split()[..], &batch[..]);
+        }
+    }
+
+    #[test]
+    fn bounded_output() {
+        let mut compressor = Compressor::new(3).unwrap();
+        let mut decompressor = Decompressor::new(1 << 20).unwrap();
+        // Highly compressible input far past the limit
+        let batch = vec![b'a'; 64 << 20];
+        let compressed = compressor.compress(&batch).unwrap();
+        assert!(compressed.len() < 64 * 1024);
+        decompressor.decompress(&compressed).unwrap();
+        assert!(decompressor.stalled());
+        assert!(decompressor.output().len() <= (1 << 20) + DECOMPRESS_STEP);
+
+        // Consuming the output lets it resume, a bounded step at a time
+        let mut total = 0;
+        loop {
+            total += decompressor.output().split().len();
+            if !decompressor.stalled() {
+                break;
+            }
+            decompressor.decompress(&[]).unwrap();
+            assert!(decompressor.output().len() <= (1 << 20) + DECOMPRESS_STEP);
+        }
+        assert_eq!(total, batch.len());
+    }
+
+    #[test]
+    fn corrupt_stream() {
+        let mut decompressor = Decompressor::new(1 << 20).unwrap();
+        assert!(decompressor.decompress(b"definitely not zstd").is_err());
+    }
+}
@@ -1,5 +1,5 @@
-use bytes::{BufMut, BytesMut};
-use memchr::memchr;
+use bytes::{Buf, BufMut, Bytes, BytesMut};
+use memchr::memrchr;
 use stream_cancel::Tripwire;
 use tokio::io::{AsyncRead, AsyncWrite};
 use tokio::io::{AsyncReadExt, AsyncWriteExt};
@@ -8,112 +8,590 @@ use tokio::net::{TcpListener, UnixListener, UnixStream};
 use tokio::select;
 use tokio::time::timeout;
 
+use std::collections::HashMap;
 use std::io::ErrorKind;
 use std::net::UdpSocket;
-use std::sync::atomic::AtomicBool;
+use std::os::unix::io::{AsFd, AsRawFd, OwnedFd};
+use std::os::unix::net::UnixDatagram;
 use std::sync::atomic::Ordering::Relaxed;
+use std::sync::atomic::{AtomicBool, AtomicU64};
 use std::sync::Arc;
 use std::time::Duration;
 
 use log::{debug, info, warn};
+use thiserror::Error;
 
 use crate::backends::Backends;
 use crate::config;
 use crate::config::StatsdServerConfig;
+use crate::datagram::{self, BatchReceiver};
+use crate::handoff;
+use crate::overload::Controller;
+use crate::ratelimit::{Limiter, Peer};
 use crate::stats;
-use crate::statsd_proto::{Event, Pdu};
+use crate::statsd_proto::binary;
+use crate::statsd_proto::compression::Decompressor;
+use crate::statsd_proto::{Event, ParseError, Pdu};
 
 const TCP_READ_TIMEOUT: Duration = Duration::from_secs(62);
 const READ_BUFFER: usize = 8192;
+const LINES_PER_YIELD: usize = 1024;
+const MAX_LINE_LENGTH: usize = 65536;
+/// Most decompressed data a connection may hold without completing a line or
+/// frame
+const MAX_DECOMPRESSED_BUFFER: usize = 2 * binary::MAX_FRAME_LENGTH;
 
-struct UdpServer {
+/// How a server shares its addresses with the other copies of it running on
+/// other cores
+#[derive(Clone, Copy, Debug)]
+pub struct ListenOptions {
+    /// Bind the tcp and udp sockets with SO_REUSEPORT, so several copies of
+    /// the server listen on the same address and the kernel spreads
+    /// connections and datagrams between them
+    pub reuse_port: bool,
+    /// Listen on the configured unix socket, which only one copy can own
+    pub unix_socket: bool,
+}
+
+impl Default for ListenOptions {
+    fn default() -> Self {
+        ListenOptions {
+            reuse_port: false,
+            unix_socket: true,
+        }
+    }
+}
+
+fn bind_reuse_port(bind: &str, ty: socket2::Type) -> std::io::Result<socket2::Socket> {
+    let addr: std::net::SocketAddr = std::net::ToSocketAddrs::to_socket_addrs(bind)?
+        .next()
+        .ok_or_else(|| std::io::Error::new(ErrorKind::InvalidInput, "no address to bind"))?;
+    let socket = socket2::Socket::new(socket2::Domain::for_address(addr), ty, None)?;
+    socket.set_reuse_address(true)?;
+    socket.set_reuse_port(true)?;
+    socket.bind(&addr.into())?;
+    Ok(socket)
+}
+
+fn bind_tcp(bind: &str, listen: ListenOptions) -> std::io::Result<std::net::TcpListener> {
+    if !listen.reuse_port {
+        return std::net::TcpListener::bind(bind);
+    }
+    let socket = bind_reuse_port(bind, socket2::Type::STREAM)?;
+    socket.listen(1024)?;
+    Ok(socket.into())
+}
+
+fn bind_udp(bind: &str, listen: ListenOptions) -> std::io::Result<UdpSocket> {
+    if !listen.reuse_port {
+        return UdpSocket::bind(bind);
+    }
+    Ok(bind_reuse_port(bind, socket2::Type::DGRAM)?.into())
+}
+
+/// Take the socket of a kind handed over by the previous process, or bind a
+/// new one, and record it for the next process
+fn inherit_or_bind<S, F>(
+    handoff: Option<&handoff::Sockets>,
+    kind: handoff::Kind,
+    bind: F,
+) -> std::io::Result<S>
+where
+    S: From<OwnedFd> + AsFd,
+    F: FnOnce() -> std::io::Result<S>,
+{
+    let socket = match handoff.and_then(|handoff| handoff.inherit(kind)) {
+        Some(socket) => socket,
+        None => bind()?,
+    };
+    if let Some(handoff) = handoff {
+        handoff.serve(kind, &socket)?;
+    }
+    Ok(socket)
+}
+
+/// Admission controls applied to the lines a server receives, shared by the
+/// copies of the server on every core
+#[derive(Clone, Default)]
+pub struct Controls {
+    /// Per peer rate limit
+    pub limiter: Option<Arc<Limiter>>,
+    /// Load shedding for when backends fall behind
+    pub overload: Option<Arc<Controller>>,
+}
+
+/// Bind a unix datagram socket, replacing a socket file left behind by a
+/// previous process, but not one which is still being served
+fn bind_unix_datagram(path: &str) -> std::io::Result<UnixDatagram> {
+    match UnixDatagram::bind(path) {
+        Err(e) if e.kind() == ErrorKind::AddrInUse => {
+            let probe = UnixDatagram::unbound()?;
+            match probe.connect(path) {
+                Ok(()) => Err(e),
+                Err(_) => {
+                    info!("removing stale socket file {}", path);
+                    std::fs::remove_file(path)?;
+                    UnixDatagram::bind(path)
+                }
+            }
+        }
+        result => result,
+    }
+}
+
+/// Size the kernel receive buffer of a datagram socket. Forcing the size
+/// (`SO_RCVBUFFORCE`) goes past `net.core.rmem_max` but needs
+/// `CAP_NET_ADMIN`, without which the capped size is set instead.
+fn set_receive_buffer<S: AsFd + AsRawFd>(
+    socket: &S,
+    size: usize,
+    force: bool,
+) -> std::io::Result<()> {
+    #[cfg(target_os = "linux")]
+    if force {
+        let value = size.min(libc::c_int::MAX as usize) as libc::c_int;
+        // Safety: the option value is a c_int living for the duration of the
+        // call
+        let result = unsafe {
+            libc::setsockopt(
+                socket.as_raw_fd(),
+                libc::SOL_SOCKET,
+                libc::SO_RCVBUFFORCE,
+                &value as *const _ as *const libc::c_void,
+                std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+            )
+        };
+        if result == 0 {
+            return Ok(());
+        }
+        warn!(
+            "failed to force receive buffer size: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+    #[cfg(not(target_os = "linux"))]
+    if force {
+        warn!("receive buffer size can only be forced on Linux");
+    }
+    socket2::SockRef::from(socket).set_recv_buffer_size(size)
+}
+
+/// A blocking datagram socket which reader threads share
+trait DatagramSocket: AsFd + AsRawFd + Send + Sized + 'static {
+    fn try_clone(&self) -> std::io::Result<Self>;
+    fn set_read_timeout(&self, timeout: Option<Duration>) -> std::io::Result<()>;
+}
+
+impl DatagramSocket for UdpSocket {
+    fn try_clone(&self) -> std::io::Result<Self> {
+        UdpSocket::try_clone(self)
+    }
+    fn set_read_timeout(&self, timeout: Option<Duration>) -> std::io::Result<()> {
+        UdpSocket::set_read_timeout(self, timeout)
+    }
+}
+
+impl DatagramSocket for UnixDatagram {
+    fn try_clone(&self) -> std::io::Result<Self> {
+        UnixDatagram::try_clone(self)
+    }
+    fn set_read_timeout(&self, timeout: Option<Duration>) -> std::io::Result<()> {
+        UnixDatagram::set_read_timeout(self, timeout)
+    }
+}
+
+/// The blocking reader threads of a server's datagram sockets
+struct DatagramServer {
     shutdown_gate: Arc<AtomicBool>,
 }
 
-impl Drop for UdpServer {
+impl Drop for DatagramServer {
     fn drop(&mut self) {
         self.shutdown_gate.store(true, Relaxed);
     }
 }
 
-impl UdpServer {
+impl DatagramServer {
     fn new() -> Self {
-        UdpServer {
+        DatagramServer {
             shutdown_gate: Arc::new(AtomicBool::new(false)),
         }
     }
 
-    fn udp_worker(
+    /// Spawn the threads reading a datagram socket
+    fn readers<S: DatagramSocket>(
         &mut self,
         stats: stats::Scope,
-        bind: String,
+        name: &str,
+        socket: S,
+        config: &StatsdServerConfig,
         backends: Backends,
-        route: Vec<config::Route>,
-    ) -> std::thread::JoinHandle<()> {
-        let socket = UdpSocket::bind(bind.as_str()).unwrap();
-
+        controls: Controls,
+    ) -> Vec<std::thread::JoinHandle<()>> {
         let processed_lines = stats.counter("processed_lines").unwrap();
         let incoming_bytes = stats.counter("incoming_bytes").unwrap();
-        // We set a small timeout to allow aborting the UDP server if there is no
-        // incoming traffic.
+        let receive_calls = stats.counter("receive_calls").unwrap();
+        let rate_limited_lines = stats.counter("rate_limited_lines").unwrap();
+        let kernel_drops = stats.counter("kernel_drops").unwrap();
+        // Highest kernel drop count any reader has seen, so that the counter
+        // only advances by the drops since
+        let drops_seen = Arc::new(AtomicU64::new(0));
+        if let Some(size) = config.receive_buffer {
+            let force = config.receive_buffer_force.unwrap_or(false);
+            if let Err(e) = set_receive_buffer(&socket, size, force) {
+                warn!("failed to set receive buffer of {}: {}", name, e);
+            }
+        }
+        match socket2::SockRef::from(&socket).recv_buffer_size() {
+            Ok(size) => {
+                info!("receive buffer of {} is {} bytes", name, size);
+                stats
+                    .gauge("receive_buffer_bytes")
+                    .unwrap()
+                    .set(size as f64);
+            }
+            Err(e) => warn!("failed to read receive buffer of {}: {}", name, e),
+        }
+        if let Err(e) = datagram::enable_drop_count(&socket) {
+            warn!("kernel drops of {} are not counted: {}", name, e);
+        }
+        // We set a small timeout to allow aborting the datagram server if
+        // there is no incoming traffic.
         socket
             .set_read_timeout(Some(Duration::from_secs(1)))
             .unwrap();
-        info!("statsd udp server running on {}", bind);
-        let gate = self.shutdown_gate.clone();
-        std::thread::spawn(move || {
-            info!("started udp reader thread");
-            let mut buf = BytesMut::with_capacity(65535);
-            loop {
-                if gate.load(Relaxed) {
-                    break;
-                }
-                buf.resize(65535, 0_u8);
-                match socket.recv_from(buf.as_mut()) {
-                    Ok((size, _remote)) => {
-                        buf.truncate(size);
-                        incoming_bytes.inc_by(size as f64);
-                        let r = process_buffer_newlines(&mut buf);
-                        processed_lines.inc_by(r.len() as f64);
-                        backends.provide_statsd_slice(&r, &route);
-
-                        if let Ok(p) = Pdu::parse(buf.clone().freeze()) {
-                            backends.provide_statsd(&Event::Pdu(p), &route);
+        let batch = config.udp_batch.unwrap_or(1);
+        let validate = config.validate.unwrap_or_default();
+        // Readers share the socket, the kernel hands each datagram to one of
+        // the threads blocked on it
+        (0..config.udp_readers.unwrap_or(1).max(1))
+            .map(|_| {
+                let socket = socket.try_clone().unwrap();
+                let gate = self.shutdown_gate.clone();
+                let stats = stats.clone();
+                let backends = backends.clone();
+                let route = config.route.clone();
+                let processed_lines = processed_lines.clone();
+                let incoming_bytes = incoming_bytes.clone();
+                let receive_calls = receive_calls.clone();
+                let rate_limited_lines = rate_limited_lines.clone();
+                let kernel_drops = kernel_drops.clone();
+                let drops_seen = drops_seen.clone();
+                let controls = controls.clone();
+                std::thread::spawn(move || {
+                    info!("started datagram reader thread");
+                    let mut parser = LineParser::new(&stats, validate);
+                    let mut receiver = BatchReceiver::new(batch);
+                    let mut buf = BytesMut::new();
+                    loop {
+                        if gate.load(Relaxed) {
+                            break;
+                        }
+                        match receiver.recv(&socket) {
+                            Ok(count) => {
+                                receive_calls.inc();
+                                if let Some(dropped) = receiver.dropped() {
+                                    let seen = drops_seen.fetch_max(dropped as u64, Relaxed);
+                                    if dropped as u64 > seen {
+                                        kernel_drops.inc_by((dropped as u64 - seen) as f64);
+                                    }
+                                }
+                                // Copy the batch out of the receiver into a
+                                // single allocation, which the datagrams'
+                                // PDUs then share
+                                buf.reserve(
+                                    (0..count).map(|index| receiver.datagram(index).len()).sum(),
+                                );
+                                for index in 0..count {
+                                    let datagram = receiver.datagram(index);
+                                    incoming_bytes.inc_by(datagram.len() as f64);
+                                    let source = receiver.source(index);
+                                    buf.extend_from_slice(datagram);
+                                    let datagram = buf.split().freeze();
+                                    let mut r = process_datagram(&datagram, &mut parser);
+                                    // Like on streams, the sender is charged
+                                    // for the lines which parsed
+                                    if let (Some(limiter), Some(source)) =
+                                        (&controls.limiter, source)
+                                    {
+                                        let admitted =
+                                            limiter.admit(Peer::Ip(source.ip()), r.len());
+                                        rate_limited_lines.inc_by((r.len() - admitted) as f64);
+                                        r.truncate(admitted);
+                                    }
+                                    if let Some(overload) = controls.overload.as_ref() {
+                                        overload.shed(&mut r);
+                                    }
+                                    processed_lines.inc_by(r.len() as f64);
+                                    backends.provide_statsd_slice(&r, &route);
+                                }
+                            }
+                            Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => (),
+                            Err(e) => warn!("datagram receiver error {:?}", e),
                         }
                     }
-                    Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => (),
-                    Err(e) => warn!("udp receiver error {:?}", e),
+                    info!("terminating statsd datagram reader");
+                })
+            })
+            .collect()
+    }
+}
+
+/// The rate limit of the peer of one stream connection
+struct Admission {
+    limiter: Arc<Limiter>,
+    peer: Peer,
+    rate_limited_lines: stats::Counter,
+}
+
+impl Admission {
+    fn new(stats: &stats::Scope, limiter: Arc<Limiter>, peer: Peer) -> Self {
+        Admission {
+            limiter,
+            peer,
+            rate_limited_lines: stats.counter("rate_limited_lines").unwrap(),
+        }
+    }
+
+    /// Drop the events over the peer's limit, returning whether the peer is
+    /// to be disconnected for exceeding it
+    fn admit(&self, events: &mut Vec<Event>) -> bool {
+        let admitted = self.limiter.admit(self.peer, events.len());
+        if admitted == events.len() {
+            return false;
+        }
+        self.rate_limited_lines
+            .inc_by((events.len() - admitted) as f64);
+        events.truncate(admitted);
+        self.limiter.action() == config::RateLimitAction::Disconnect
+    }
+}
+
+/// Parses and validates the lines of one listener, counting the lines it
+/// rejects by parse error.
+struct LineParser {
+    validate: config::Validation,
+    stats: stats::Scope,
+    parse_errors: HashMap<&'static str, stats::Counter>,
+}
+
+impl LineParser {
+    fn new(stats: &stats::Scope, validate: config::Validation) -> Self {
+        LineParser {
+            validate,
+            stats: stats.scope("parse_errors"),
+            parse_errors: HashMap::new(),
+        }
+    }
+
+    /// Validate a parsed line to the configured level, returning the PDU if
+    /// it is to be routed
+    fn check(&mut self, parsed: Result<Pdu, ParseError>) -> Option<Pdu> {
+        let checked = parsed.and_then(|pdu| {
+            match self.validate {
+                config::Validation::None => (),
+                config::Validation::Structural => pdu.validate_structure()?,
+                config::Validation::Full => {
+                    pdu.validate_structure()?;
+                    pdu.validate_values()?;
                 }
+            };
+            Ok(pdu)
+        });
+        match checked {
+            Ok(pdu) => Some(pdu),
+            Err(e) => {
+                let stats = &self.stats;
+                self.parse_errors
+                    .entry(e.kind())
+                    .or_insert_with(|| stats.counter(e.kind()).unwrap())
+                    .inc();
+                None
             }
-            info!("terminating statsd udp");
-        })
+        }
+    }
+
+    /// Parse a final line which was not newline terminated
+    fn parse_remaining(&mut self, line: Bytes) -> Option<Event> {
+        if line.is_empty() {
+            return None;
+        }
+        self.check(Pdu::parse(line)).map(Event::Pdu)
     }
 }
 
-fn process_buffer_newlines(buf: &mut BytesMut) -> Vec<Event> {
+fn process_buffer_newlines(buf: &mut BytesMut, parser: &mut LineParser) -> Vec<Event> {
     let mut ret: Vec<Event> = Vec::new();
-    loop {
-        match memchr(b'\n', &buf) {
-            None => break,
-            Some(newline) => {
-                let mut incoming = buf.split_to(newline + 1);
-                if incoming[incoming.len() - 2] == b'\r' {
-                    incoming.truncate(incoming.len() - 2);
-                } else {
-                    incoming.truncate(incoming.len() - 1);
-                }
-                let frozen = incoming.freeze();
-                if frozen == "status" {
-                    // Consume a line consisting of just the word status, and do not produce a PDU
-                    continue;
+    // Only complete lines are consumed, any remnant stays in the buffer
+    let last_newline = match memrchr(b'\n', &buf) {
+        None => return ret,
+        Some(newline) => newline,
+    };
+    let lines = buf.split_to(last_newline + 1).freeze();
+    parse_lines(&lines, parser, &mut ret);
+    ret
+}
+
+/// Parse a datagram, which holds only whole lines, the last of which need
+/// not be newline terminated. The PDUs share the datagram's allocation.
+fn process_datagram(datagram: &Bytes, parser: &mut LineParser) -> Vec<Event> {
+    let mut ret: Vec<Event> = Vec::new();
+    parse_lines(datagram, parser, &mut ret);
+    ret
+}
+
+fn parse_lines(lines: &Bytes, parser: &mut LineParser, ret: &mut Vec<Event>) {
+    Pdu::parse_lines(lines, |line, pdu| {
+        if line == b"status" {
+            // Consume a line consisting of just the word status, and do not produce a PDU
+            return;
+        }
+        if let Some(pdu) = parser.check(pdu) {
+            ret.push(Event::Pdu(pdu));
+        }
+    });
+}
+
+/// Decode the complete binary frames in the buffer, leaving any partial frame
+fn process_buffer_frames(
+    buf: &mut BytesMut,
+    decoder: &mut binary::Decoder,
+    parser: &mut LineParser,
+) -> Result<Vec<Event>, binary::FrameError> {
+    let mut ret: Vec<Event> = Vec::new();
+    decoder.decode(buf, |pdu| {
+        if let Some(pdu) = parser.check(pdu) {
+            ret.push(Event::Pdu(pdu));
+        }
+    })?;
+    Ok(ret)
+}
+
+#[derive(Error, Debug)]
+enum StreamError {
+    #[error(transparent)]
+    Frame(#[from] binary::FrameError),
+    #[error("unterminated line longer than {0} bytes")]
+    LineTooLong(usize),
+}
+
+impl From<std::io::Error> for StreamError {
+    fn from(e: std::io::Error) -> Self {
+        StreamError::Frame(e.into())
+    }
+}
+
+/// Format of a stream connection, detected from its first bytes
+enum Format {
+    Detecting,
+    Text,
+    Binary(binary::Decoder),
+}
+
+impl Format {
+    /// Consume the complete lines or frames in the input, failing once what
+    /// is left behind is longer than the limit
+    fn consume(
+        &mut self,
+        input: &mut BytesMut,
+        parser: &mut LineParser,
+        max_line_length: usize,
+    ) -> Result<Vec<Event>, StreamError> {
+        let events = match self {
+            Format::Detecting => unreachable!("format is detected first"),
+            Format::Text => {
+                let events = process_buffer_newlines(input, parser);
+                if input.len() > max_line_length {
+                    return Err(StreamError::LineTooLong(max_line_length));
                 }
-                if let Ok(pdu) = Pdu::parse(frozen) {
-                    ret.push(Event::Pdu(pdu));
+                events
+            }
+            Format::Binary(decoder) => process_buffer_frames(input, decoder, parser)?,
+        };
+        if input.len() > MAX_DECOMPRESSED_BUFFER {
+            return Err(binary::FrameError::DecompressedTooLong.into());
+        }
+        Ok(events)
+    }
+}
+
+/// Format and compression of a stream connection
+struct Framing {
+    format: Format,
+    decompressor: Option<Decompressor>,
+    max_line_length: usize,
+}
+
+impl Framing {
+    fn new(max_line_length: usize) -> Self {
+        Framing {
+            format: Format::Detecting,
+            decompressor: None,
+            max_line_length,
+        }
+    }
+
+    /// Consume the complete lines or frames in the buffer. On compressed
+    /// connections the buffer is decompressed a bounded step at a time,
+    /// consuming what each step completes, and incomplete data is kept
+    /// decompressed until more arrives. Fails once the partial line left
+    /// behind is longer than the limit.
+    fn process(
+        &mut self,
+        buf: &mut BytesMut,
+        parser: &mut LineParser,
+    ) -> Result<Vec<Event>, StreamError> {
+        if let Format::Detecting = self.format {
+            match buf.first() {
+                None => return Ok(Vec::new()),
+                // Statsd lines never start with a NUL, which starts a preamble
+                Some(0) if buf.len() < binary::PREAMBLE_LENGTH => return Ok(Vec::new()),
+                Some(0) => {
+                    let flags = binary::read_preamble(&buf[..binary::PREAMBLE_LENGTH])?;
+                    buf.advance(binary::PREAMBLE_LENGTH);
+                    self.format = if flags & binary::FLAG_BINARY != 0 {
+                        Format::Binary(binary::Decoder::new())
+                    } else {
+                        Format::Text
+                    };
+                    if flags & binary::FLAG_ZSTD != 0 {
+                        self.decompressor = Some(Decompressor::new(MAX_DECOMPRESSED_BUFFER)?);
+                    }
                 }
+                Some(_) => self.format = Format::Text,
             }
+        }
+        let decompressor = match self.decompressor.as_mut() {
+            None => return self.format.consume(buf, parser, self.max_line_length),
+            Some(decompressor) => decompressor,
         };
+        decompressor.decompress(&buf.split())?;
+        let mut events =
+            self.format
+                .consume(decompressor.output(), parser, self.max_line_length)?;
+        // Consuming the output makes room for the rest of the input
+        while decompressor.stalled() {
+            decompressor.decompress(&[])?;
+            events.extend(self.format.consume(
+                decompressor.output(),
+                parser,
+                self.max_line_length,
+            )?);
+        }
+        Ok(events)
+    }
+
+    /// Take a final unterminated text line. Binary connections have none, as
+    /// a partial frame is dropped.
+    fn remaining(&mut self, buf: &mut BytesMut) -> Option<Bytes> {
+        match self.format {
+            Format::Text => match self.decompressor.as_mut() {
+                None => Some(buf.split().freeze()),
+                Some(decompressor) => Some(decompressor.output().split().freeze()),
+            },
+            _ => None,
+        }
     }
-    ret
 }
 
 async fn client_handler<T>(
@@ -124,15 +602,25 @@ async fn client_handler<T>(
     backends: Backends,
     route: Vec<config::Route>,
     config: config::StatsdServerConfig,
+    admission: Option<Admission>,
+    overload: Option<Arc<Controller>>,
 ) where
     T: AsyncRead + AsyncWrite + Unpin,
 {
     let incoming_bytes = stats.counter("incoming_bytes").unwrap();
     let disconnects = stats.counter("disconnects").unwrap();
     let processed_lines = stats.counter("lines").unwrap();
+    let frame_errors = stats.counter("frame_errors").unwrap();
+    let lines_too_long = stats.counter("lines_too_long").unwrap();
+    let yields = stats.counter("yields").unwrap();
+    let rate_limit_disconnects = stats.counter("rate_limit_disconnects").unwrap();
 
     let read_buffer = config.read_buffer.unwrap_or(READ_BUFFER);
+    let lines_per_yield = config.lines_per_yield.unwrap_or(LINES_PER_YIELD).max(1);
     let mut buf = BytesMut::with_capacity(read_buffer);
+    let mut parser = LineParser::new(&stats, config.validate.unwrap_or_default());
+    let mut framing = Framing::new(config.max_line_length.unwrap_or(MAX_LINE_LENGTH));
+    let mut lines_since_yield = 0;
 
     loop {
         if buf.remaining_mut() < read_buffer {
@@ -155,14 +643,20 @@ async fn client_handler<T>(
                 break;
             }
             Ok(bytes) if bytes == 0 => {
-                let r = process_buffer_newlines(&mut buf);
+                let mut r = framing.process(&mut buf, &mut parser).unwrap_or_default();
+                if let Some(remaining) = framing.remaining(&mut buf) {
+                    if let Some(p) = parser.parse_remaining(remaining) {
+                        r.push(p);
+                    };
+                }
+                if let Some(admission) = admission.as_ref() {
+                    admission.admit(&mut r);
+                }
+                if let Some(overload) = overload.as_ref() {
+                    overload.shed(&mut r);
+                }
                 processed_lines.inc_by(r.len() as f64);
-
                 backends.provide_statsd_slice(&r, &route);
-                let remaining = buf.clone().freeze();
-                if let Ok(p) = Pdu::parse(remaining) {
-                    backends.provide_statsd(&Event::Pdu(p), &route);
-                };
                 debug!("remaining {:?}", buf);
                 debug!("closing reader {}", peer);
                 break;
@@ -170,9 +664,41 @@ async fn client_handler<T>(
             Ok(bytes) => {
                 incoming_bytes.inc_by(bytes as f64);
 
-                let r = process_buffer_newlines(&mut buf);
-                processed_lines.inc_by(r.len() as f64);
-                backends.provide_statsd_slice(&r, &route);
+                match framing.process(&mut buf, &mut parser) {
+                    Ok(mut r) => {
+                        let disconnect = admission
+                            .as_ref()
+                            .map_or(false, |admission| admission.admit(&mut r));
+                        if let Some(overload) = overload.as_ref() {
+                            overload.shed(&mut r);
+                        }
+                        processed_lines.inc_by(r.len() as f64);
+                        backends.provide_statsd_slice(&r, &route);
+                        if disconnect {
+                            info!("closing {} over its rate limit", peer);
+                            rate_limit_disconnects.inc();
+                            break;
+                        }
+                        // Let the other connections on this runtime run once
+                        // this one has used up its budget
+                        lines_since_yield += r.len();
+                        if lines_since_yield >= lines_per_yield {
+                            lines_since_yield = 0;
+                            yields.inc();
+                            tokio::task::yield_now().await;
+                        }
+                    }
+                    Err(e @ StreamError::LineTooLong(_)) => {
+                        warn!("closing {}: {}", peer, e);
+                        lines_too_long.inc();
+                        break;
+                    }
+                    Err(e) => {
+                        warn!("closing {} on framing error {}", peer, e);
+                        frame_errors.inc();
+                        break;
+                    }
+                }
             }
             Err(e) if e.kind() == ErrorKind::Other => {
                 // Ignoring the results of the write call here
@@ -214,25 +740,68 @@ pub async fn run(
     stats: stats::Scope,
     tripwire: Tripwire,
     config: StatsdServerConfig,
+    listen: ListenOptions,
     backends: Backends,
+    controls: Controls,
+    handoff: Option<handoff::Sockets>,
 ) {
-    let tcp_listener = TcpListener::bind(config.bind.as_str()).await.unwrap();
+    let tcp_listener = inherit_or_bind(handoff.as_ref(), handoff::Kind::Tcp, || {
+        bind_tcp(config.bind.as_str(), listen)
+    })
+    .unwrap();
+    tcp_listener.set_nonblocking(true).unwrap();
+    let tcp_listener = TcpListener::from_std(tcp_listener).unwrap();
     info!("statsd tcp server running on {}", config.bind);
 
-    let unix_listener = config.socket.as_ref().map(|socket| {
-        let unix = UnixListener::bind(socket.as_str()).unwrap();
+    let unix_socket = config.socket.as_ref().filter(|_| listen.unix_socket);
+    let unix_listener = unix_socket.map(|socket| {
+        let unix = inherit_or_bind(handoff.as_ref(), handoff::Kind::Unix, || {
+            std::os::unix::net::UnixListener::bind(socket.as_str())
+        })
+        .unwrap();
+        unix.set_nonblocking(true).unwrap();
         info!("statsd unix server running on {}", socket);
-        unix
+        UnixListener::from_std(unix).unwrap()
     });
 
-    // Spawn the threaded, non-async blocking UDP server
-    let mut udp = UdpServer::new();
-    let udp_join = udp.udp_worker(
+    // Spawn the threaded, non-async blocking datagram servers
+    let mut datagram = DatagramServer::new();
+    let udp_socket = inherit_or_bind(handoff.as_ref(), handoff::Kind::Udp, || {
+        bind_udp(config.bind.as_str(), listen)
+    })
+    .unwrap();
+    info!("statsd udp server running on {}", config.bind);
+    let mut datagram_join = datagram.readers(
         stats.scope("udp"),
-        config.bind.clone(),
+        config.bind.as_str(),
+        udp_socket,
+        &config,
         backends.clone(),
-        config.route.clone(),
+        controls.clone(),
     );
+    // Like the stream socket, the datagram socket file is bound by one core
+    let datagram_socket = config
+        .datagram_socket
+        .as_ref()
+        .filter(|_| listen.unix_socket);
+    if let Some(path) = datagram_socket {
+        let socket = inherit_or_bind(handoff.as_ref(), handoff::Kind::UnixDatagram, || {
+            bind_unix_datagram(path)
+        })
+        .unwrap();
+        info!("statsd unix datagram server running on {}", path);
+        datagram_join.extend(datagram.readers(
+            stats.scope("unix_datagram"),
+            path.as_str(),
+            socket,
+            &config,
+            backends.clone(),
+            controls.clone(),
+        ));
+    }
+    if let Some(handoff) = handoff.as_ref() {
+        handoff.bound();
+    }
 
     let accept_connections = stats.counter("accepts").unwrap();
     let accept_connections_unix = stats.counter("accepts_unix").unwrap();
@@ -255,7 +824,12 @@ pub async fn run(
                             let peer_addr = format!("{:?}", socket.peer_addr());
                             debug!("accepted unix connection from {:?}", socket.peer_addr());
                             accept_connections_unix.inc();
-                            tokio::spawn(client_handler(stats.scope("connections_unix"), peer_addr, tripwire.clone(), socket, backends.clone(), routes.clone(), server_config.clone()));
+                            let stats = stats.scope("connections_unix");
+                            let admission = match (&controls.limiter, socket.peer_cred()) {
+                                (Some(limiter), Ok(cred)) => Some(Admission::new(&stats, limiter.clone(), Peer::Process { uid: cred.uid(), pid: cred.pid().unwrap_or(0) })),
+                                _ => None,
+                            };
+                            tokio::spawn(client_handler(stats, peer_addr, tripwire.clone(), socket, backends.clone(), routes.clone(), server_config.clone(), admission, controls.overload.clone()));
                         }
                         Err(err) => {
                             accept_failures_unix.inc();
@@ -266,11 +840,13 @@ pub async fn run(
                 socket_res = tcp_listener.accept() => {
 
                     match socket_res {
-                        Ok((socket,_)) => {
+                        Ok((socket,addr)) => {
                             let peer_addr = format!("{:?}", socket.peer_addr());
                             debug!("accepted connection from {:?}", socket.peer_addr());
                             accept_connections.inc();
-                            tokio::spawn(client_handler(stats.scope("connections"), peer_addr, tripwire.clone(), socket, backends.clone(), routes.clone(), server_config.clone()));
+                            let stats = stats.scope("connections");
+                            let admission = controls.limiter.as_ref().map(|limiter| Admission::new(&stats, limiter.clone(), Peer::Ip(addr.ip())));
+                            tokio::spawn(client_handler(stats, peer_addr, tripwire.clone(), socket, backends.clone(), routes.clone(), server_config.clone(), admission, controls.overload.clone()));
                         }
                         Err(err) => {
                             accept_failures.inc();
@@ -282,13 +858,19 @@ pub async fn run(
         }
     }
     .await;
-    drop(udp);
-    // The socket file descriptor is not removed on teardown. Lets remove it if enabled.
-    if let Some(socket) = config.socket.as_ref() {
-        let _ = std::fs::remove_file(socket);
+    drop(datagram);
+    // The socket file descriptor is not removed on teardown. Lets remove it
+    // if enabled, unless the sockets now belong to another process.
+    let handed_off = handoff.map_or(false, |handoff| handoff.handed_off());
+    for socket in unix_socket.iter().chain(datagram_socket.iter()) {
+        if !handed_off {
+            let _ = std::fs::remove_file(socket);
+        }
     }
     tokio::task::spawn_blocking(move || {
-        udp_join.join().unwrap();
+        for reader in datagram_join {
+            reader.join().unwrap();
+        }
     })
     .await
     .unwrap();
@@ -297,12 +879,97 @@ pub async fn run(
 #[cfg(test)]
 pub mod test {
     use super::*;
+    use crate::statsd_proto::compression::Compressor;
+    use std::convert::TryInto;
+
+    fn make_parser(validate: config::Validation) -> LineParser {
+        LineParser::new(&crate::stats::Collector::default().scope("test"), validate)
+    }
+
+    #[test]
+    fn test_process_buffer_validation() {
+        let collector = crate::stats::Collector::default();
+        let lines = b"a:1|c\nb:x|c\nc:1|q\n:1|c\nnone\nstatus\n";
+        let mut routed = Vec::new();
+        for validate in &[
+            config::Validation::None,
+            config::Validation::Structural,
+            config::Validation::Full,
+        ] {
+            let scope = collector.scope(&format!("{:?}", validate));
+            let mut parser = LineParser::new(&scope, *validate);
+            let mut b = BytesMut::new();
+            b.put_slice(lines);
+            routed.push(process_buffer_newlines(&mut b, &mut parser).len());
+        }
+        assert_eq!(routed, vec![4, 2, 1]);
+        let errors = collector.scope("Full").scope("parse_errors");
+        assert_eq!(errors.counter("invalid_line").unwrap().get(), 2_f64);
+        assert_eq!(errors.counter("invalid_type").unwrap().get(), 1_f64);
+        assert_eq!(errors.counter("invalid_value").unwrap().get(), 1_f64);
+    }
+
+    #[test]
+    fn test_bind_reuse_port() {
+        let shared = ListenOptions {
+            reuse_port: true,
+            unix_socket: false,
+        };
+        let first = bind_udp("127.0.0.1:0", shared).unwrap();
+        let addr = first.local_addr().unwrap().to_string();
+        // A second copy binds the same address only when both opt in
+        let second = bind_udp(addr.as_str(), shared).unwrap();
+        assert_eq!(second.local_addr().unwrap(), first.local_addr().unwrap());
+        assert!(bind_udp(addr.as_str(), ListenOptions::default()).is_err());
+    }
+
+    #[test]
+    fn test_bind_unix_datagram() {
+        let path = std::env::temp_dir().join(format!("statsrelay-{}.sock", std::process::id()));
+        let path = path.to_str().unwrap();
+        let _ = std::fs::remove_file(path);
+        let first = bind_unix_datagram(path).unwrap();
+        // A socket file which is still being served is not taken over
+        assert!(bind_unix_datagram(path).is_err());
+        drop(first);
+        // But one left behind is replaced
+        let second = bind_unix_datagram(path).unwrap();
+        let sender = UnixDatagram::unbound().unwrap();
+        sender.send_to(b"foo:1|c", path).unwrap();
+        let mut receiver = BatchReceiver::new(1);
+        assert_eq!(receiver.recv(&second).unwrap(), 1);
+        assert_eq!(receiver.datagram(0), b"foo:1|c");
+        assert_eq!(receiver.source(0), None);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn test_process_datagram() {
+        let mut parser = make_parser(config::Validation::None);
+        // The last line of a datagram needs no newline
+        let datagram = Bytes::from_static(b"a:1|c\r\nstatus\n\nb:2|ms\nc:3|g");
+        let r = process_datagram(&datagram, &mut parser);
+        let names: Vec<&[u8]> = r
+            .iter()
+            .map(|event| match event {
+                Event::Pdu(pdu) => pdu.name(),
+                Event::Parsed(_) => unreachable!(),
+            })
+            .collect();
+        assert_eq!(names, vec![&b"a"[..], b"b", b"c"]);
+        assert!(process_datagram(&Bytes::new(), &mut parser).is_empty());
+        assert_eq!(
+            process_datagram(&Bytes::from_static(b"a:1|c\n"), &mut parser).len(),
+            1
+        );
+    }
+
     #[test]
     fn test_process_buffer_no_newlines() {
         let mut b = BytesMut::new();
         // Validate we don't consume non-newlines
         b.put_slice(b"hello");
-        let r = process_buffer_newlines(&mut b);
+        let r = process_buffer_newlines(&mut b, &mut make_parser(config::Validation::None));
         assert!(r.is_empty());
         assert!(b.split().as_ref() == b"hello");
     }
@@ -312,7 +979,7 @@ pub mod test {
         let mut b = BytesMut::new();
         // Validate we don't consume newlines, but not a remnant
         b.put_slice(b"hello:1|c\nhello:1|c\nhello2");
-        let r = process_buffer_newlines(&mut b);
+        let r = process_buffer_newlines(&mut b, &mut make_parser(config::Validation::None));
         assert!(r.len() == 2);
         assert!(b.split().as_ref() == b"hello2");
     }
@@ -323,9 +990,9 @@ pub mod test {
         let mut b = BytesMut::new();
         // Validate we don't consume newlines, but not a remnant
         b.put_slice(b"hello:1|c\r\nhello:1|c\nhello2");
-        let r = process_buffer_newlines(&mut b);
+        let r = process_buffer_newlines(&mut b, &mut make_parser(config::Validation::None));
         for w in r {
-            let pdu: Pdu = w.into();
+            let pdu: Pdu = w.try_into().unwrap();
             assert!(pdu.pdu_type() == b"c");
             assert!(pdu.name() == b"hello");
             found += 1
@@ -340,9 +1007,9 @@ pub mod test {
         let mut b = BytesMut::new();
         // Validate we don't consume newlines, but not a remnant
         b.put_slice(b"status\r\nhello:1|c\nhello2");
-        let r = process_buffer_newlines(&mut b);
+        let r = process_buffer_newlines(&mut b, &mut make_parser(config::Validation::None));
         for w in r {
-            let pdu: Pdu = w.into();
+            let pdu: Pdu = w.try_into().unwrap();
             assert!(pdu.pdu_type() == b"c");
             assert!(pdu.name() == b"hello");
             found += 1
@@ -350,4 +1017,120 @@ pub mod test {
         assert_eq!(1, found);
         assert!(b.split().as_ref() == b"hello2");
     }
+
+    #[test]
+    fn test_process_buffer_empty_lines() {
+        let mut b = BytesMut::new();
+        b.put_slice(b"\n\r\nhello:1|c\n\nhello2");
+        let r = process_buffer_newlines(&mut b, &mut make_parser(config::Validation::None));
+        assert_eq!(r.len(), 1);
+        assert!(b.split().as_ref() == b"hello2");
+    }
+
+    /// Feed a stream to a connection's framing a byte at a time
+    fn process_stream(stream: &[u8], parser: &mut LineParser) -> (Framing, Vec<Pdu>) {
+        let mut framing = Framing::new(MAX_LINE_LENGTH);
+        let mut b = BytesMut::new();
+        let mut found = Vec::new();
+        for byte in stream.iter() {
+            b.put_u8(*byte);
+            found.extend(framing.process(&mut b, parser).unwrap());
+        }
+        let found = found.into_iter().map(|e| e.try_into().unwrap()).collect();
+        (framing, found)
+    }
+
+    #[test]
+    fn test_detect_framing() {
+        let mut parser = make_parser(config::Validation::None);
+        let mut text = Framing::new(MAX_LINE_LENGTH);
+        let mut b = BytesMut::new();
+        b.put_slice(b"hello:1|c\nhello2");
+        assert_eq!(text.process(&mut b, &mut parser).unwrap().len(), 1);
+        assert!(matches!(text.format, Format::Text));
+        assert_eq!(text.remaining(&mut b).unwrap().as_ref(), b"hello2");
+
+        let pdus = vec![
+            Pdu::parse(Bytes::from_static(b"hello:1|c|#a:b")).unwrap(),
+            Pdu::parse(Bytes::from_static(b"hello:2|c|#a:b")).unwrap(),
+        ];
+        let mut frames = BytesMut::new();
+        frames.put_slice(&binary::preamble(binary::FLAG_BINARY));
+        binary::Encoder::new(b"", b"").encode_frame(&pdus, &mut frames);
+        let (mut framing, found) = process_stream(&frames, &mut parser);
+        assert!(matches!(framing.format, Format::Binary(_)));
+        assert!(framing.remaining(&mut BytesMut::new()).is_none());
+        assert_eq!(found[0].as_bytes(), pdus[0].as_bytes());
+        assert_eq!(found[1].as_bytes(), pdus[1].as_bytes());
+
+        let mut b = BytesMut::new();
+        b.put_slice(b"\0SR\x80");
+        assert!(Framing::new(MAX_LINE_LENGTH)
+            .process(&mut b, &mut parser)
+            .is_err());
+    }
+
+    #[test]
+    fn test_line_length_limit() {
+        let mut parser = make_parser(config::Validation::None);
+        let mut framing = Framing::new(8);
+        let mut b = BytesMut::new();
+        // Complete lines of any length pass, only the partial line is limited
+        b.put_slice(b"a.long.metric.name:1|c\nshort");
+        assert_eq!(framing.process(&mut b, &mut parser).unwrap().len(), 1);
+        b.put_slice(b".and.long");
+        assert!(matches!(
+            framing.process(&mut b, &mut parser),
+            Err(StreamError::LineTooLong(8))
+        ));
+    }
+
+    #[test]
+    fn test_compressed_framing() {
+        let mut parser = make_parser(config::Validation::None);
+        let mut compressor = Compressor::new(3).unwrap();
+        let mut stream = BytesMut::new();
+        stream.put_slice(&binary::preamble(binary::FLAG_ZSTD));
+        stream.put_slice(&compressor.compress(b"hello:1|c\nhello:2|c\n").unwrap());
+        stream.put_slice(&compressor.compress(b"hello:3|c\nhello").unwrap());
+        let (mut framing, found) = process_stream(&stream, &mut parser);
+        assert!(matches!(framing.format, Format::Text));
+        assert_eq!(found.len(), 3);
+        assert_eq!(found[2].value(), b"3");
+        let remaining = framing.remaining(&mut BytesMut::new()).unwrap();
+        assert_eq!(remaining.as_ref(), b"hello");
+
+        let pdus = vec![Pdu::parse(Bytes::from_static(b"hello:1|c|#a:b")).unwrap()];
+        let mut frame = BytesMut::new();
+        binary::Encoder::new(b"", b"").encode_frame(&pdus, &mut frame);
+        let mut stream = BytesMut::new();
+        stream.put_slice(&binary::preamble(binary::FLAG_BINARY | binary::FLAG_ZSTD));
+        let mut compressor = Compressor::new(3).unwrap();
+        stream.put_slice(&compressor.compress(&frame).unwrap());
+        let (framing, found) = process_stream(&stream, &mut parser);
+        assert!(matches!(framing.format, Format::Binary(_)));
+        assert_eq!(found[0].as_bytes(), pdus[0].as_bytes());
+    }
+
+    #[test]
+    fn test_decompression_bomb() {
+        let mut parser = make_parser(config::Validation::None);
+        let mut compressor = Compressor::new(3).unwrap();
+        let mut stream = BytesMut::new();
+        stream.put_slice(&binary::preamble(binary::FLAG_ZSTD));
+        // A few kilobytes expanding to a line twice the buffer limit
+        let bomb = compressor
+            .compress(&vec![b'a'; 2 * MAX_DECOMPRESSED_BUFFER])
+            .unwrap();
+        assert!(bomb.len() < 64 * 1024);
+        stream.put_slice(&bomb);
+        let mut framing = Framing::new(usize::MAX);
+        assert!(matches!(
+            framing.process(&mut stream, &mut parser),
+            Err(StreamError::Frame(binary::FrameError::DecompressedTooLong))
+        ));
+        // Decompression stopped a step past the limit
+        let output = framing.decompressor.as_mut().unwrap().output();
+        assert!(output.len() <= MAX_DECOMPRESSED_BUFFER + 64 * 1024);
+    }
 }